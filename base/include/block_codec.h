@@ -0,0 +1,116 @@
+/*
+* @file     block_codec.h
+* @brief    Block Record Layout and Canonical Encoding
+*/
+
+#ifndef BLOCK_CODEC_H
+#define BLOCK_CODEC_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <errno.h>
+
+#define HASH_LEN 32
+
+#define BLOCK_VERSION 1
+#define BLOCK_USER_LENGTH 18
+#define BLOCK_MEAS_NONE INT32_MIN
+
+/* Size of the canonical encoding of a block, the bytes covered by its hash */
+#define BLOCK_CANONICAL_SIZE 44
+
+/* A checkpoint block follows every CHAIN_CHECKPOINT_INTERVAL blocks */
+#define CHAIN_CHECKPOINT_INTERVAL 16
+#define CHAIN_PROOF_DEPTH 4 /* log2(CHAIN_CHECKPOINT_INTERVAL) */
+/* Blocks are grouped as CHAIN_CHECKPOINT_INTERVAL events followed by a checkpoint */
+#define CHAIN_GROUP_SIZE (CHAIN_CHECKPOINT_INTERVAL + 1)
+#define MERKLE_NODE_PREFIX 0x01
+
+/* Event types stored on the chain. Values are persisted, do not reorder. */
+typedef enum {
+    BLOCK_EVENT_NONE = 0,
+    BLOCK_EVENT_PRESENCE = 1,
+    BLOCK_EVENT_TAMPERING = 2,
+    BLOCK_EVENT_DISCONNECTION = 3,
+    BLOCK_EVENT_FAIL = 4,
+    BLOCK_EVENT_SUCCESS = 5,
+    BLOCK_EVENT_CHECKPOINT = 6,
+    BLOCK_EVENT_RECOVERY = 7,       /* A torn write was cut from the end of the log */
+    BLOCK_EVENT_MAX
+} block_event_t;
+
+/*
+ * On-flash block record (version 1), little-endian, fixed size. The previous
+ * block's hash is not stored: it is the hash of the record before this one.
+ * Checkpoint blocks carry the Merkle root of the CHAIN_CHECKPOINT_INTERVAL
+ * blocks before them in place of the event fields.
+ */
+typedef struct {
+    uint8_t version;
+    uint8_t event;                  /* block_event_t */
+    uint16_t length;                /* sizeof(block_record_t) */
+    uint32_t height;                /* Index of the block in the chain */
+    uint32_t timestamp;             /* Seconds */
+    union {
+        struct {
+            int32_t mag_meas;               /* Normalised^2 x 1000, or BLOCK_MEAS_NONE */
+            int32_t ultra_meas;             /* Millimetres, or BLOCK_MEAS_NONE */
+            uint8_t mac[6];                 /* All zero when no device was involved */
+            char user[BLOCK_USER_LENGTH];   /* NUL padded alias */
+        };
+        uint8_t merkle_root[HASH_LEN];      /* BLOCK_EVENT_CHECKPOINT only */
+    };
+    uint8_t hash[HASH_LEN];         /* SHA-256 of the fields above + previous hash */
+    uint32_t crc;                   /* CRC-32 of all preceding bytes */
+} block_record_t;
+
+/* Receives the canonical encoding of a block, a few bytes at a time */
+typedef void (*block_sink_t)(void *ctx, const uint8_t *data, size_t len);
+
+/* Feed the canonical encoding of a block to a sink, field by field */
+void block_encode(const block_record_t *block, block_sink_t sink, void *ctx);
+/* Write the canonical encoding of a block into a BLOCK_CANONICAL_SIZE buffer */
+void block_encode_buf(const block_record_t *block, uint8_t *buf);
+/* SHA-256 of the canonical encoding followed by the previous block's hash */
+void block_hash(const block_record_t *block, const uint8_t *prev_hash, uint8_t *output);
+/* Merkle node over two child hashes */
+void block_merkle_node(const uint8_t *left, const uint8_t *right, uint8_t *output);
+/* Replace the first count/2 nodes with the level of the tree above them */
+void block_merkle_reduce(uint8_t nodes[][HASH_LEN], size_t count);
+/* Merkle root of a full checkpoint group of leaves. The leaves are overwritten. */
+void block_merkle_root(uint8_t leaves[][HASH_LEN], uint8_t *root);
+
+/*
+ * Packed records, used for archived segments. Version, length and height
+ * are implied, timestamps are delta coded, measurements are varints, and
+ * users and MACs are added to a dictionary the first time they appear in a
+ * stream. Only the first record carries its hash; the rest are recomputed
+ * from the canonical form on unpack, so hashes never change.
+ */
+#define BLOCK_PACK_DICT_SIZE 8
+#define BLOCK_PACK_MAX_SIZE (1 + HASH_LEN + 3 * 5 + 1 + BLOCK_USER_LENGTH + 6)
+
+/* State of one packed stream, the same on both sides */
+typedef struct {
+    uint32_t height;                /* Height of the next record */
+    uint32_t timestamp;             /* Timestamp of the previous record */
+    uint8_t prev_hash[HASH_LEN];    /* Hash of the previous record */
+    uint8_t linked;                 /* Records so far, saturating at 1 */
+    uint8_t user;                   /* Dictionary index of the previous user and MAC */
+    uint8_t mac;
+    uint8_t user_count;
+    uint8_t mac_count;
+    char users[BLOCK_PACK_DICT_SIZE][BLOCK_USER_LENGTH];
+    uint8_t macs[BLOCK_PACK_DICT_SIZE][6];
+} block_pack_ctx_t;
+
+/* Start a stream whose first record is at the given height */
+void block_pack_init(block_pack_ctx_t *ctx, uint32_t height);
+/* Pack the next record into BLOCK_PACK_MAX_SIZE bytes. Returns the packed
+ * length, or -EINVAL if unpacking would not give back the same record. */
+int block_pack(block_pack_ctx_t *ctx, const block_record_t *block, uint8_t *out);
+/* Unpack the next record. Returns the bytes used, -EAGAIN if len does not
+ * hold the whole record, or -EBADMSG. The CRC is left to the caller. */
+int block_unpack(block_pack_ctx_t *ctx, const uint8_t *in, size_t len, block_record_t *block);
+
+#endif /* BLOCK_CODEC_H */
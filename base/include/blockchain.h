@@ -1,30 +1,100 @@
 #ifndef BLOCKCHAIN_H
 #define BLOCKCHAIN_H
 
-#define MAX_BLOCKS 50
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <zephyr/kernel.h>
+#include <zephyr/shell/shell.h>
+#include "block_codec.h"
+#include "chain_store.h"
+#include "chain_index.h"
+
+/* Recent blocks kept in RAM, and distinct users among them */
+#define CHAIN_RAM_BLOCKS 32
+#define CHAIN_RAM_USERS 16
+#define CHAIN_RAM_USER_NONE 0xFF
 #define HASH_SIZE 65
 
-#define BLOCKCHAIN_FILE "/lfs/chain.log"
+#define BLOCKCHAIN_LEGACY_FILE "/lfs/chain.json"
+#define BLOCKCHAIN_UNSEGMENTED_FILE "/lfs/chain.bin"
+#define CHAIN_TAIL_FILE "/lfs/chain.tail"
+#define CHAIN_TAIL_MAGIC 0x344C4154 /* "TAL4" */
+/* Boot time after which a warning is logged, whatever the chain length */
+#define CHAIN_BOOT_BUDGET_MS 500
+
+#define BLOCK_JSON_SIZE 384
+
+/* Blocks that can wait for the writer thread */
+#define CHAIN_QUEUE_SIZE 16
+/* Most blocks the writer persists with one write */
+#define CHAIN_COMMIT_MAX_BLOCKS 16
+
+#define CHAIN_PROOF_JSON_SIZE 1024
 
+/* Superblock describing the end of chain.log, so appends never re-read the
+ * log and a boot restores the chain without scanning it */
 typedef struct {
-    char timestamp[32];
-    char event[32];
-    char mag_meas[10];
-    char ultra_meas[10];
-    char user[32];
-    char MAC[18];
-    char prev_hash[HASH_SIZE];
-    char curr_hash[HASH_SIZE];
-} Block;
-
-/* Add block to blockchain */
-void add_block(const char *timestamp, const char *event, const char *user, const char *mag_meas, const char *ultra_meas, const char *mac);
-/* Validate blockchain from file system */
+    uint32_t magic;
+    uint32_t height;                /* Number of blocks in the log */
+    uint32_t offset;                /* Byte length of the active segment covered by this record */
+    uint8_t last_hash[HASH_LEN];    /* Hash of the last block, all zero if empty */
+    uint32_t crc;
+} chain_tail_t;
+
+/* Writer queue depth and completion counters */
+typedef struct {
+    uint32_t depth;         /* Blocks waiting to be written */
+    uint32_t capacity;
+    uint32_t peak_depth;
+    uint32_t queued;        /* Blocks accepted by add_block() */
+    uint32_t written;       /* Blocks persisted to the log */
+    uint32_t failed;        /* Blocks the writer could not persist */
+    uint32_t dropped;       /* Blocks rejected because the queue was full */
+    int32_t last_error;
+    uint32_t commits;       /* Writes that persisted at least one block */
+    uint32_t window_ms;     /* Group commit window */
+    uint32_t max_blocks;    /* Group commit size limit */
+    uint32_t boot_ms;       /* Time taken to restore the chain at boot */
+    uint32_t tail_rebuilds; /* Times the superblock was stale and the tail was rebuilt */
+} chain_writer_status_t;
+
+/* Queue a block for the blockchain writer, returning its ticket */
+int add_block(uint32_t timestamp, block_event_t event, int32_t mag_meas, int32_t ultra_meas, const char *user, const char *mac);
+/* Wait until a queued block is durable on flash */
+int chain_wait_durable(int ticket, k_timeout_t timeout);
+/* Set the group commit window and size limit */
+int chain_set_commit_window(uint32_t window_ms, uint32_t max_blocks);
+/* Validate every block of the blockchain file system */
 bool validate_chain_from_file(void);
-/* Validate blockchain held in RAM */
+/* Validate blocks appended since the last verified checkpoint */
+bool validate_chain_incremental(void);
+/* Verify a file of records from a height to its end, returning the blocks verified */
+int chain_verify_file(const char *path, fs_wear_caller_t caller, uint32_t from, const uint8_t *prev_hash);
+/* Validate the recent blocks held in RAM */
 bool validate_chain_in_RAM(void);
-/* Print contents of blockchain */
+/* Print the recent blocks held in RAM */
 void print_chain(void);
+/* Render a block as a JSON line, the format sent over RTT */
+int block_to_json(const block_record_t *block, const uint8_t *prev_hash, char *buf, size_t len);
+/* Read the recorded members of a block back from a JSON line */
+int block_from_json(const char *line, size_t len, block_record_t *block);
+/* Print blocks from the file system as JSON to the shell */
+void chain_view(const struct shell *shell, uint32_t from, uint32_t count);
+/* Print a Merkle inclusion proof for a block to the shell and RTT */
+void chain_proof(const struct shell *shell, uint32_t height);
+/* Stream blocks from a height onwards to the export RTT channel */
+void chain_export(const struct shell *shell, uint32_t since);
+/* Print the newest blocks matching a query to the shell */
+void chain_query(const struct shell *shell, const chain_query_t *query, uint32_t limit);
+/* Event type from its name, BLOCK_EVENT_MAX if unknown */
+block_event_t block_event_parse(const char *name);
+/* Snapshot of the writer queue */
+void chain_writer_status(chain_writer_status_t *status);
+/* Number of blocks in the chain */
+uint32_t chain_height(void);
+/* Timestamp of the newest block, 0 if there is none */
+uint32_t chain_last_timestamp(void);
 
 
-#endif /* BLOCKCHAIN_H */
\ No newline at end of file
+#endif /* BLOCKCHAIN_H */
@@ -0,0 +1,60 @@
+/*
+* @file     chain_bench.h
+* @brief    Blockchain Storage Benchmarks
+*/
+
+#ifndef CHAIN_BENCH_H
+#define CHAIN_BENCH_H
+
+#include <stdint.h>
+#include <zephyr/shell/shell.h>
+
+/* Scratch volume on bench_partition, see bench.overlay. Benchmarks write
+ * nowhere else. */
+#define CHAIN_BENCH_VOLUME "/bench"
+/* Blocks generated per event mix, a whole number of segments */
+#define CHAIN_BENCH_SEGMENTS 4
+/* JSON lines read back by the line reader benchmark */
+#define CHAIN_BENCH_LINES 1000
+#define CHAIN_BENCH_LINES_FILE CHAIN_BENCH_VOLUME "/lines.log"
+/* Users provisioned by the user store benchmark. Only a few of the old
+ * scheme's rewrites are written, the rest are worked out. */
+#define CHAIN_BENCH_USERS 500
+#define CHAIN_BENCH_USERS_SAMPLES 4
+#define CHAIN_BENCH_USERS_CONF CHAIN_BENCH_VOLUME "/users.conf"
+#define CHAIN_BENCH_USERS_LOG CHAIN_BENCH_VOLUME "/users.log"
+
+/* Chain grown by the append and chain benchmarks, and its tail */
+#define CHAIN_BENCH_CHAIN_FILE CHAIN_BENCH_VOLUME "/chain.log"
+#define CHAIN_BENCH_TAIL_FILE CHAIN_BENCH_VOLUME "/chain.tail"
+/* Appends are timed at heights 10, 100, ... up to this, at most */
+#define CHAIN_BENCH_APPEND_HEIGHT 10000
+/* Appends timed each way at each height */
+#define CHAIN_BENCH_APPEND_SAMPLES 8
+
+/* Chains appended by the chain benchmark are 10 blocks up to this long */
+#define CHAIN_BENCH_CHAIN_BLOCKS 10000
+/* Append latencies kept per chain for percentiles, spread evenly over it */
+#define CHAIN_BENCH_CHAIN_SAMPLES 256
+#define CHAIN_BENCH_JSON_SIZE 320
+
+/* Pack and unpack generated event mixes, and estimate how many days of
+ * history the archive partition holds at the given event rate */
+void chain_bench_pack(const struct shell *shell, uint32_t events_per_day);
+/* Write blocks as dashboard JSON lines and read them back */
+void chain_bench_json(const struct shell *shell);
+/* Read a file of JSON lines a byte at a time and through fs_line_reader */
+void chain_bench_lines(const struct shell *shell);
+/* Provision users by rewriting users.conf and by appending to a user log */
+void chain_bench_users(const struct shell *shell, uint32_t users);
+/* Hash blocks with block_hash() and as the JSON string hashing used to */
+void chain_bench_hash(const struct shell *shell);
+/* Time appends from a cached tail and after re-reading the log, at heights
+ * from 10 up to max_height */
+void chain_bench_append(const struct shell *shell, uint32_t max_height);
+/* Append a chain of the given length, or of 10 up to CHAIN_BENCH_CHAIN_BLOCKS
+ * blocks for 0, and print a JSON line per chain with the append latencies,
+ * validation times, bytes written, erases and heap peak */
+void chain_bench_chain(const struct shell *shell, uint32_t blocks);
+
+#endif /* CHAIN_BENCH_H */
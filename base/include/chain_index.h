@@ -0,0 +1,57 @@
+/*
+* @file     chain_index.h
+* @brief    Blockchain Query Index
+*/
+
+#ifndef CHAIN_INDEX_H
+#define CHAIN_INDEX_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "block_codec.h"
+#include "chain_store.h"
+
+/* One entry per block, entry n describes the block at height n */
+#define CHAIN_INDEX_FILE CHAIN_ARCHIVE_DIR "/index"
+
+typedef struct {
+    uint32_t timestamp;
+    uint16_t user_key;      /* Hash of the user name, see chain_index_user_key() */
+    uint8_t event;
+    uint8_t reserved;
+} chain_index_entry_t;
+
+/* One summary per CHAIN_INDEX_ZONE entries, so a query skips whole runs of
+ * blocks without reading their entries. Only complete zones are written;
+ * zone n covers entries n * CHAIN_INDEX_ZONE onwards. */
+#define CHAIN_INDEX_ZONE_FILE CHAIN_ARCHIVE_DIR "/zones"
+#define CHAIN_INDEX_ZONE 32
+
+typedef struct {
+    uint32_t from;          /* Timestamp range of the zone's blocks */
+    uint32_t to;
+    uint32_t users;         /* Bit user_key % 32 set for each block */
+    uint16_t events;        /* Bit event set for each block */
+    uint16_t reserved;
+} chain_index_zone_t;
+
+/* Blocks to match. BLOCK_EVENT_MAX matches any event, an empty user any user. */
+typedef struct {
+    char user[BLOCK_USER_LENGTH];
+    block_event_t event;
+    uint32_t from;          /* Timestamp range, inclusive */
+    uint32_t to;
+} chain_query_t;
+
+/* Bring the index in line with a log of the given height */
+int chain_index_sync(uint32_t height);
+/* Add entries for records appended to the log */
+void chain_index_append(const block_record_t *records, size_t count);
+/* Find the next candidate block below *cursor, newest first. Returns 1 with
+ * its height, 0 when there are no more, or an error if the index is unusable. */
+int chain_index_next(const chain_query_t *query, uint32_t *cursor, uint32_t *height);
+/* Whether a block matches a query */
+bool chain_query_match(const chain_query_t *query, const block_record_t *block);
+uint16_t chain_index_user_key(const char *user);
+
+#endif /* CHAIN_INDEX_H */
@@ -0,0 +1,47 @@
+/*
+* @file     chain_segment.h
+* @brief    Segmented Blockchain Log Layout
+*/
+
+#ifndef CHAIN_SEGMENT_H
+#define CHAIN_SEGMENT_H
+
+#include <stdint.h>
+#include "block_codec.h"
+
+/*
+ * The chain is split into segments of CHAIN_SEGMENT_BLOCKS records. New
+ * blocks go to the active segment in internal flash. A full segment is
+ * sealed with a trailer, then moved to the archive volume on the QSPI NOR.
+ */
+#define BLOCKCHAIN_FILE "/lfs/chain.log"
+#define CHAIN_SEGMENT_HOT_FMT "/lfs/chain.%05u.seg"
+#define CHAIN_ARCHIVE_DIR "/ext/chain"
+#define CHAIN_SEGMENT_ARCHIVE_FMT CHAIN_ARCHIVE_DIR "/%05u.seg"
+#define CHAIN_SEGMENT_PATH_SIZE 32
+
+/* Whole checkpoint groups per segment, so a proof never spans segments */
+#define CHAIN_SEGMENT_GROUPS 4
+#define CHAIN_SEGMENT_BLOCKS (CHAIN_SEGMENT_GROUPS * CHAIN_GROUP_SIZE)
+#define CHAIN_SEGMENT_SIZE (CHAIN_SEGMENT_BLOCKS * sizeof(block_record_t))
+#define CHAIN_SEGMENT_MAGIC 0x31474553 /* "SEG1" */
+
+/* Archived segments may hold packed records, see block_pack() */
+#define CHAIN_SEGMENT_PACKED_MAGIC 0x315A4753 /* "SGZ1" */
+
+/* Written after the last record of a sealed segment */
+typedef struct {
+    uint32_t magic;
+    uint32_t first_height;
+    uint32_t last_height;
+    uint8_t digest[HASH_LEN];   /* SHA-256 of the segment's records */
+    uint32_t crc;
+} chain_segment_trailer_t;
+
+/* Starts an archived segment of packed records, which the trailer follows */
+typedef struct {
+    uint32_t magic;
+    uint32_t first_height;
+} chain_segment_header_t;
+
+#endif /* CHAIN_SEGMENT_H */
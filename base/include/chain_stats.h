@@ -0,0 +1,47 @@
+/*
+* @file     chain_stats.h
+* @brief    Blockchain Performance Counters
+*/
+
+#ifndef CHAIN_STATS_H
+#define CHAIN_STATS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Most recent append latencies kept for percentiles */
+#define CHAIN_STATS_SAMPLES 64
+#define CHAIN_STATS_JSON_SIZE 384
+
+typedef struct {
+    uint32_t count;         /* Samples since boot */
+    uint32_t p50_us;        /* Over the last CHAIN_STATS_SAMPLES */
+    uint32_t p90_us;
+    uint32_t p99_us;
+    uint32_t max_us;
+} chain_latency_t;
+
+/* Snapshot of how the chain performs at its current height */
+typedef struct {
+    uint32_t height;
+    chain_latency_t append;         /* add_block() until the block is durable */
+    uint32_t full_blocks;           /* Last full validation */
+    uint32_t full_ms;
+    uint32_t incremental_blocks;    /* Last incremental validation */
+    uint32_t incremental_ms;
+    uint32_t lfs_used;              /* Bytes in use on each volume */
+    uint32_t ext_used;
+    uint32_t heap_peak;             /* Most of the system heap ever allocated */
+    uint32_t heap_size;
+} chain_stats_t;
+
+/* Record the time from add_block() until a block was durable */
+void chain_stats_append(uint32_t latency_us);
+/* Record a validation pass over the given number of blocks */
+void chain_stats_validated(bool full, uint32_t blocks, uint32_t ms);
+void chain_stats_get(chain_stats_t *stats);
+/* One JSON line, so runs on different firmware versions can be compared */
+int chain_stats_to_json(const chain_stats_t *stats, char *buf, size_t len);
+
+#endif /* CHAIN_STATS_H */
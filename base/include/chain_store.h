@@ -0,0 +1,57 @@
+/*
+* @file     chain_store.h
+* @brief    Segmented Blockchain Log Storage
+*/
+
+#ifndef CHAIN_STORE_H
+#define CHAIN_STORE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <zephyr/fs/fs.h>
+#include "block_codec.h"
+#include "chain_segment.h"
+#include "fs_wear.h"
+
+/* Pack segments as they are archived, see block_pack() */
+#define CHAIN_ARCHIVE_PACKED 1
+
+#define CHAIN_READER_BUF_SIZE (2 * BLOCK_PACK_MAX_SIZE)
+
+/* Sequential access to blocks, whichever segment holds them */
+typedef struct {
+    struct fs_file_t file;
+    uint32_t segment;
+    bool open;
+    bool packed;                /* The segment file holds packed records */
+    fs_wear_caller_t caller;    /* Whose reads these are, FS_WEAR_CHAIN_READ unless set after init */
+    uint32_t next;              /* Index of the next record in the packed stream */
+    block_pack_ctx_t pack;
+    uint8_t buf[CHAIN_READER_BUF_SIZE];
+    uint16_t buf_len;
+    uint16_t buf_pos;
+} chain_reader_t;
+
+/* Finish an interrupted seal */
+void chain_store_init(void);
+/* Remove the active and every sealed segment, or return the error that stopped it */
+int chain_store_reset(void);
+/* Finish any seal left incomplete, so the active segment has room */
+int chain_store_prepare(void);
+/* Append records to the active segment with one write and sync */
+int chain_store_append(const block_record_t *records, size_t count);
+/* Seal the full active segment and start a new one */
+int chain_store_seal(void);
+/* Move sealed segments from internal flash to the archive volume */
+void chain_store_archive(void);
+/* Number of sealed segments, found from their files */
+uint32_t chain_store_sealed_count(void);
+/* Read the trailer of a sealed segment */
+int chain_store_trailer(uint32_t segment, chain_segment_trailer_t *trailer);
+
+void chain_reader_init(chain_reader_t *reader);
+/* Read up to count blocks from height, stopping at the end of its segment */
+int chain_reader_read(chain_reader_t *reader, uint32_t height, block_record_t *blocks, uint32_t count);
+void chain_reader_close(chain_reader_t *reader);
+
+#endif /* CHAIN_STORE_H */
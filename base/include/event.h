@@ -36,7 +36,6 @@
 #define MSGQ_SIZE              10
 #define MOBILE_CONNECT_TIMEOUT K_SECONDS(10)
 #define DISPLAY_BUFFER_SIZE    7
-#define SENSOR_MEAS_LENGTH     10
 #define SENSOR_SYNC_ATTEMPTS   10
 #define MIN_RSSI               -70
 #define TARGET_HANDLE          0x0015
@@ -10,7 +10,6 @@
 #include <zephyr/kernel.h>
 #include <zephyr/sys/util.h>
 #include <zephyr/sys/printk.h>
-#include <zephyr/data/json.h>
 #include <zephyr/fs/fs.h>
 #include <zephyr/fs/littlefs.h>
 #include <zephyr/storage/flash_map.h>
@@ -20,8 +19,55 @@
 #include <ctype.h>
 #include "user.h"
 #include "sensor.h"
+#include "json_codec.h"
+
+// Given once the file systems are mounted.
+extern struct k_sem fs_ready_sem;
+
+// Line buffer for the config files, a few LittleFS cache blocks.
+#define FS_LINE_BUFFER_SIZE 512
+
+// Reads a file a buffer at a time and hands out its lines in place.
+typedef struct {
+    struct fs_file_t *file;
+    char *buf;
+    size_t size;
+    size_t start;       // First byte not yet handed out
+    size_t end;         // End of the bytes read
+    bool eof;
+    bool skipping;      // Dropping the rest of a line too long for the buffer
+} fs_line_reader_t;
+
+// Config writes wait for this long without changes before going to flash.
+#define FS_PERSIST_QUIET_MS 1000
+
+typedef enum {
+    FS_CONFIG_USERS,
+    FS_CONFIG_SENSORS,
+    FS_CONFIG_FILES,
+} fs_config_file_t;
+
+// How well changes to a config file have been coalesced since boot.
+typedef struct {
+    uint32_t changes;       // Changes made in RAM
+    uint32_t writes;        // Times the file was rewritten
+    uint32_t saved;         // Writes avoided by coalescing changes
+    uint32_t failures;
+    uint32_t pending;       // Changes not yet on flash
+    uint32_t generation;    // Of the copy on flash, counts up with each write
+    uint32_t records;       // Records in users.log, superseded ones included
+} fs_config_stats_t;
 
 extern void fs_init(void);
-extern ssize_t fs_read_line(struct fs_file_t *file, char *buf, size_t max_len);
+// Writes any changed config file, and the wear counters, now. Returns the first error.
+extern int fs_config_sync(void);
+extern void fs_config_set_quiet(uint32_t quiet_ms);
+extern uint32_t fs_config_get_quiet(void);
+extern void fs_config_stats(fs_config_file_t config, fs_config_stats_t *stats);
+extern void fs_line_reader_init(fs_line_reader_t *reader, struct fs_file_t *file, char *buf, size_t size);
+// Next non-blank line, NUL terminated in the reader's buffer and valid until the
+// next call. Returns its length, 0 at end of file, -E2BIG for a line longer than
+// the buffer size less 2 (it is skipped) or a read error.
+extern ssize_t fs_line_reader_next(fs_line_reader_t *reader, char **line);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,83 @@
+/*
+* @file     fs_wear.h
+* @brief    Flash Wear Telemetry
+*/
+
+#ifndef FS_WEAR_H
+#define FS_WEAR_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <zephyr/fs/fs.h>
+
+#define FS_WEAR_FILE "/lfs/wear.bin"
+#define FS_WEAR_VERSION 3
+/* Files counted apart. Digits are folded to '#', so all segments count as
+ * one file, and the last entry takes every file once the rest are used. */
+#define FS_WEAR_FILES 16
+#define FS_WEAR_NAME_SIZE 24
+/* Files open at once, CONFIG_FS_LITTLEFS_NUM_FILES */
+#define FS_WEAR_OPEN_FILES 8
+/* Erase block size assumed when a volume cannot report its own */
+#define FS_WEAR_DEFAULT_BLOCK_SIZE 4096
+/* The counters are saved and sent over RTT this often */
+#define FS_WEAR_SAVE_INTERVAL_S 3600
+#define FS_WEAR_JSON_SIZE 768
+
+/* Who opened a file, set when it is opened */
+typedef enum {
+    FS_WEAR_CHAIN,          /* Appends, seals, archiving and the superblock */
+    FS_WEAR_CHAIN_READ,     /* Viewing, proofs, queries, export and loading at boot */
+    FS_WEAR_VALIDATE,       /* Background and full validation */
+    FS_WEAR_INDEX,
+    FS_WEAR_CONFIG,         /* sensors.conf */
+    FS_WEAR_USERS,          /* users.log */
+    FS_WEAR_TELEMETRY,      /* Saving these counters */
+    FS_WEAR_BENCH,          /* Benchmark chains */
+    FS_WEAR_UNTRACKED,      /* Files opened while every FS_WEAR_OPEN_FILES slot was taken */
+    FS_WEAR_CALLERS,
+} fs_wear_caller_t;
+
+typedef struct {
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint32_t opens;
+    uint32_t syncs;         /* fs_sync() and closes after a write */
+    uint32_t erases;        /* Estimated, one per erase block's worth of synced writes */
+} fs_wear_counters_t;
+
+typedef struct {
+    char name[FS_WEAR_NAME_SIZE];
+    fs_wear_counters_t counters;
+} fs_wear_file_t;
+
+/* Everything counted since the device was first booted */
+typedef struct {
+    uint32_t boots;
+    uint32_t seconds;       /* Uptime, summed over boots */
+    fs_wear_counters_t callers[FS_WEAR_CALLERS];
+    uint32_t file_count;
+    fs_wear_file_t files[FS_WEAR_FILES];
+} fs_wear_totals_t;
+
+/* Add the counters saved before the last reset, once /lfs is mounted */
+void fs_wear_init(void);
+
+/* fs_open() and friends, counted against the caller and the file. Files not
+ * opened through fs_wear_open() pass through uncounted. */
+int fs_wear_open(struct fs_file_t *file, const char *path, fs_mode_t flags, fs_wear_caller_t caller);
+ssize_t fs_wear_read(struct fs_file_t *file, void *buf, size_t len);
+ssize_t fs_wear_write(struct fs_file_t *file, const void *buf, size_t len);
+int fs_wear_sync(struct fs_file_t *file);
+int fs_wear_close(struct fs_file_t *file);
+
+const char *fs_wear_caller_name(fs_wear_caller_t caller);
+void fs_wear_get(fs_wear_totals_t *totals);
+/* Write the counters to FS_WEAR_FILE, also done by fs_config_sync() */
+int fs_wear_save(void);
+/* The RTT summary frame, {"wear":{...}}, with the counters of each caller */
+int fs_wear_to_json(const fs_wear_totals_t *totals, char *buf, size_t len);
+/* Send the summary frame as a line on RTT channel 0 */
+void fs_wear_emit(void);
+
+#endif /* FS_WEAR_H */
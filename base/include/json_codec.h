@@ -0,0 +1,33 @@
+/*
+* @file     json_codec.h
+* @brief    Descriptor-driven JSON Codec for Persisted Records
+*/
+
+#ifndef JSON_CODEC_H
+#define JSON_CODEC_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Most members a record type can describe */
+#define JSON_CODEC_MAX_FIELDS 8
+
+/* One member of a record: a JSON string kept in a char array of the struct */
+typedef struct {
+    const char *key;
+    uint16_t offset;
+    uint16_t size;
+} json_codec_field_t;
+
+#define JSON_CODEC_STRING(type, name, member) \
+    { .key = (name), .offset = offsetof(type, member), .size = sizeof(((type *)0)->member) }
+
+/* Write a record as one compact JSON object. Returns its length, or -ENOMEM
+ * if it does not fit in the buffer. */
+int json_codec_encode(const json_codec_field_t *fields, size_t count, const void *record, char *buf, size_t len);
+/* Fill a record from a JSON object. Members it lacks are left "". Returns
+ * how many members were found, -EINVAL for malformed text or -ENOMEM if a
+ * value does not fit its member. */
+int json_codec_decode(const char *text, size_t len, const json_codec_field_t *fields, size_t count, void *record);
+
+#endif /* JSON_CODEC_H */
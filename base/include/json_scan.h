@@ -0,0 +1,33 @@
+/*
+* @file     json_scan.h
+* @brief    In-place Field Scanner for One-line JSON Objects
+*/
+
+#ifndef JSON_SCAN_H
+#define JSON_SCAN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Nesting the scanner skips over inside a member value */
+#define JSON_SCAN_MAX_DEPTH 16
+
+/* A member wanted from the object. After json_scan() the value is a view
+ * into the line: string contents without quotes, escapes still in place. */
+typedef struct {
+    const char *key;
+    const char *value;      /* NULL if the member is absent */
+    size_t len;
+    bool string;
+} json_scan_field_t;
+
+/* Pick the given members out of a flat JSON object in one forward pass,
+ * in any order, without allocating. Returns how many were found, or
+ * -EINVAL if the text is not a single well-formed object. */
+int json_scan(const char *text, size_t len, json_scan_field_t *fields, size_t count);
+/* Copy a string member with its escapes resolved. An absent or non-string
+ * member copies as "". Returns -ENOMEM if it was cut short, or -EINVAL for
+ * an escaped NUL. */
+int json_scan_string(const json_scan_field_t *field, char *buf, size_t len);
+
+#endif /* JSON_SCAN_H */
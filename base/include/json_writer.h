@@ -0,0 +1,45 @@
+/*
+* @file     json_writer.h
+* @brief    Streaming JSON Writer into a Caller Buffer
+*/
+
+#ifndef JSON_WRITER_H
+#define JSON_WRITER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Containers one writer can have open at a time */
+#define JSON_WRITER_MAX_DEPTH 4
+
+/* Compact JSON, the form the dashboard and config files use, written
+ * straight into the buffer with no allocation */
+typedef struct {
+    char *buf;
+    size_t len;
+    size_t pos;
+    uint8_t depth;
+    bool first;         /* Nothing written yet in the open container */
+    bool overflow;
+} json_writer_t;
+
+void json_writer_init(json_writer_t *writer, char *buf, size_t len);
+/* Key is NULL for the top level and for array elements */
+void json_writer_object_begin(json_writer_t *writer, const char *key);
+void json_writer_object_end(json_writer_t *writer);
+void json_writer_array_begin(json_writer_t *writer, const char *key);
+void json_writer_array_end(json_writer_t *writer);
+void json_writer_string(json_writer_t *writer, const char *key, const char *value);
+/* A string of at most len bytes, which need not be NUL terminated */
+void json_writer_string_n(json_writer_t *writer, const char *key, const char *value, size_t len);
+/* Bytes as a lowercase hex string */
+void json_writer_hex(json_writer_t *writer, const char *key, const uint8_t *data, size_t len);
+void json_writer_uint(json_writer_t *writer, const char *key, uint32_t value);
+/* For counters that can pass 4 GiB */
+void json_writer_uint64(json_writer_t *writer, const char *key, uint64_t value);
+/* NUL terminate the document. Returns its length, -ENOMEM if it did not fit
+ * or -EINVAL if a container was left open. */
+int json_writer_finish(json_writer_t *writer);
+
+#endif /* JSON_WRITER_H */
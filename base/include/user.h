@@ -30,17 +30,39 @@ typedef struct {
 #define USER_MAC_INVALID -4
 #define USER_PASSCODE_INVALID -5
 #define USER_MEMORY_ERROR -6
+#define USER_ALIAS_INVALID -7
 
+#define USER_ALIAS_LENGTH 32
 #define MAC_ADDRESS_LENGTH 18
 #define PASSCODE_LENGTH 5
 
+// Change types, as stored
+#define USER_CHANGE_ADD 1
+#define USER_CHANGE_REMOVE 2
+
+// Changes queued for the user store before it is written
+#define USER_CHANGE_QUEUE_SIZE 16
+
+// An add or remove, queued for the user store
+typedef struct {
+    uint8_t type;
+    char alias[USER_ALIAS_LENGTH];
+    char mac[MAC_ADDRESS_LENGTH];
+    char passcode[PASSCODE_LENGTH];
+} user_change_t;
+
 extern sys_slist_t user_config_list;
 extern struct k_mutex user_config_list_mutex;
 extern struct k_sem user_list_update_sem;
+extern struct k_msgq user_change_msgq;
+// Set when a change found the queue full, the whole list must then be stored
+extern atomic_t user_change_overflow;
 
 // Function declarations
 int user_add(const char *alias, const char *mac, const char *passcode);
 int user_remove(const char *alias);
+// Apply a stored change to the list without queueing it to be stored again
+int user_apply(const user_change_t *change);
 void user_view(const struct shell *shell, const char *alias);
 void user_init(void);
 
@@ -0,0 +1,53 @@
+/*
+* @file     user_store.h
+* @brief    Log-structured User Store
+*/
+
+#ifndef USER_STORE_H
+#define USER_STORE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <zephyr/fs/fs.h>
+#include "user.h"
+
+#define USER_STORE_FILE "/lfs/users.log"
+#define USER_STORE_PATH_SIZE 32
+/* Records per fs_read() or fs_write() */
+#define USER_STORE_CHUNK 8
+/* Superseded records allowed beyond one per user before the log is compacted */
+#define USER_STORE_SLACK 32
+
+/* One add or remove, 64 bytes. Records are a fixed size, so the log can be
+ * cut back to the last intact one after a torn append. */
+typedef struct {
+    user_change_t change;
+    uint8_t reserved[4];
+    uint32_t crc;                   /* CRC-32 of all preceding bytes */
+} user_store_record_t;
+
+/* A compacted log being written beside the live one */
+typedef struct {
+    struct fs_file_t file;
+    const char *path;
+    char tmp_path[USER_STORE_PATH_SIZE];
+    uint32_t records;
+    int err;                        /* First error, later records are dropped */
+} user_store_writer_t;
+
+typedef void (*user_store_fn)(const user_change_t *change, void *ctx);
+
+/* Append changes with one write and sync */
+int user_store_append(const char *path, const user_change_t *changes, size_t count);
+/* Call fn with each intact change in order, cutting off a torn tail and
+ * skipping corrupt records before it. Returns the records left in the log,
+ * skipped ones included, or an error, -ENOENT if there is no log. */
+int user_store_replay(const char *path, user_store_fn fn, void *ctx);
+
+/* Start a new log holding only the given records */
+int user_store_rewrite_begin(user_store_writer_t *writer, const char *path);
+void user_store_rewrite_put(user_store_writer_t *writer, const user_change_t *change);
+/* Sync the new log and rename it over the old one */
+int user_store_rewrite_end(user_store_writer_t *writer);
+
+#endif /* USER_STORE_H */
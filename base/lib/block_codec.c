@@ -0,0 +1,399 @@
+/*
+* @file     block_codec.c
+* @brief    Block Record Layout and Canonical Encoding
+*/
+
+#include <string.h>
+#include <stdbool.h>
+#include <mbedtls/sha256.h>
+#include "block_codec.h"
+
+struct buf_sink {
+    uint8_t *buf;
+    size_t len;
+};
+
+static void put_u16(block_sink_t sink, void *ctx, uint16_t value) {
+    uint8_t bytes[2] = { value, value >> 8 };
+    sink(ctx, bytes, sizeof(bytes));
+}
+
+static void put_u32(block_sink_t sink, void *ctx, uint32_t value) {
+    uint8_t bytes[4] = { value, value >> 8, value >> 16, value >> 24 };
+    sink(ctx, bytes, sizeof(bytes));
+}
+
+/**
+ * Canonical encoding: every field before the hash, integers little-endian,
+ * independent of how the compiler lays out block_record_t
+ */
+void block_encode(const block_record_t *block, block_sink_t sink, void *ctx) {
+    sink(ctx, &block->version, 1);
+    sink(ctx, &block->event, 1);
+    put_u16(sink, ctx, block->length);
+    put_u32(sink, ctx, block->height);
+    put_u32(sink, ctx, block->timestamp);
+
+    if (block->event == BLOCK_EVENT_CHECKPOINT) {
+        sink(ctx, block->merkle_root, HASH_LEN);
+    } else {
+        put_u32(sink, ctx, (uint32_t)block->mag_meas);
+        put_u32(sink, ctx, (uint32_t)block->ultra_meas);
+        sink(ctx, block->mac, sizeof(block->mac));
+        sink(ctx, (const uint8_t *)block->user, BLOCK_USER_LENGTH);
+    }
+}
+
+static void buf_sink_put(void *ctx, const uint8_t *data, size_t len) {
+    struct buf_sink *out = ctx;
+
+    memcpy(out->buf + out->len, data, len);
+    out->len += len;
+}
+
+void block_encode_buf(const block_record_t *block, uint8_t *buf) {
+    struct buf_sink out = { .buf = buf, .len = 0 };
+    block_encode(block, buf_sink_put, &out);
+}
+
+static void sha256_sink_put(void *ctx, const uint8_t *data, size_t len) {
+    mbedtls_sha256_update(ctx, data, len);
+}
+
+/**
+ * Hash a block by streaming its fields straight into SHA-256
+ */
+void block_hash(const block_record_t *block, const uint8_t *prev_hash, uint8_t *output) {
+    mbedtls_sha256_context ctx;
+
+    mbedtls_sha256_init(&ctx);
+    mbedtls_sha256_starts(&ctx, 0);
+    block_encode(block, sha256_sink_put, &ctx);
+    mbedtls_sha256_update(&ctx, prev_hash, HASH_LEN);
+    mbedtls_sha256_finish(&ctx, output);
+    mbedtls_sha256_free(&ctx);
+}
+
+void block_merkle_node(const uint8_t *left, const uint8_t *right, uint8_t *output) {
+    static const uint8_t prefix = MERKLE_NODE_PREFIX;
+    mbedtls_sha256_context ctx;
+
+    mbedtls_sha256_init(&ctx);
+    mbedtls_sha256_starts(&ctx, 0);
+    mbedtls_sha256_update(&ctx, &prefix, 1);
+    mbedtls_sha256_update(&ctx, left, HASH_LEN);
+    mbedtls_sha256_update(&ctx, right, HASH_LEN);
+    mbedtls_sha256_finish(&ctx, output);
+    mbedtls_sha256_free(&ctx);
+}
+
+void block_merkle_reduce(uint8_t nodes[][HASH_LEN], size_t count) {
+    for (size_t i = 0; i < count / 2; i++) {
+        block_merkle_node(nodes[2 * i], nodes[2 * i + 1], nodes[i]);
+    }
+}
+
+void block_merkle_root(uint8_t leaves[][HASH_LEN], uint8_t *root) {
+    for (size_t count = CHAIN_CHECKPOINT_INTERVAL; count > 1; count /= 2) {
+        block_merkle_reduce(leaves, count);
+    }
+    memcpy(root, leaves[0], HASH_LEN);
+}
+
+// Tag byte of a packed record: the event, then how its user and MAC are coded
+#define PACK_EVENT_MASK 0x0F
+#define PACK_USER_SHIFT 4
+#define PACK_MAC_SHIFT 6
+#define PACK_MODE_MASK 0x03
+#define PACK_SAME 0         /* As in the previous record */
+#define PACK_REF 1          /* Dictionary index follows */
+#define PACK_LITERAL 2      /* Value follows, and is added to the dictionary */
+#define PACK_NONE 3         /* All zero, MAC only */
+#define PACK_NO_ENTRY 0xFF
+#define VARINT_MAX_SIZE 5
+
+static const uint8_t no_mac[6];
+
+static size_t put_varint(uint8_t *out, uint32_t value) {
+    size_t len = 0;
+
+    while (value >= 0x80) {
+        out[len++] = (value & 0x7F) | 0x80;
+        value >>= 7;
+    }
+    out[len++] = value;
+    return len;
+}
+
+static int get_varint(const uint8_t *in, size_t len, size_t *pos, uint32_t *value) {
+    *value = 0;
+
+    for (int i = 0; i < VARINT_MAX_SIZE; i++) {
+        if (*pos >= len) {
+            return -EAGAIN;
+        }
+        uint8_t byte = in[(*pos)++];
+        *value |= (uint32_t)(byte & 0x7F) << (7 * i);
+        if (!(byte & 0x80)) {
+            return 0;
+        }
+    }
+    return -EBADMSG;
+}
+
+static uint32_t zigzag(int32_t value) {
+    return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+static int32_t unzigzag(uint32_t value) {
+    return (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+}
+
+// Measurements are zigzag coded, with 0 for BLOCK_MEAS_NONE
+static uint32_t pack_meas(int32_t value) {
+    return value == BLOCK_MEAS_NONE ? 0 : zigzag(value) + 1;
+}
+
+static int32_t unpack_meas(uint32_t value) {
+    return value == 0 ? BLOCK_MEAS_NONE : unzigzag(value - 1);
+}
+
+static int dict_find(const void *dict, uint8_t count, size_t size, const void *value) {
+    for (uint8_t i = 0; i < count; i++) {
+        if (memcmp((const uint8_t *)dict + i * size, value, size) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Choose how to code a user or MAC, writing the index or value it needs.
+ * The dictionary is updated as unpacking will update it.
+ */
+static uint8_t pack_entry(void *dict, uint8_t *count, uint8_t *last, size_t size, const void *value,
+                          size_t literal_len, bool with_len, uint8_t *out, size_t *pos) {
+    uint8_t *entries = dict;
+
+    if (*last != PACK_NO_ENTRY && memcmp(entries + *last * size, value, size) == 0) {
+        return PACK_SAME;
+    }
+
+    int index = dict_find(dict, *count, size, value);
+    if (index >= 0) {
+        out[(*pos)++] = index;
+        *last = index;
+        return PACK_REF;
+    }
+
+    if (with_len) {
+        out[(*pos)++] = literal_len;
+    }
+    memcpy(&out[*pos], value, literal_len);
+    *pos += literal_len;
+    if (*count < BLOCK_PACK_DICT_SIZE) {
+        memcpy(entries + *count * size, value, size);
+        *last = (*count)++;
+    } else {
+        *last = PACK_NO_ENTRY;
+    }
+    return PACK_LITERAL;
+}
+
+void block_pack_init(block_pack_ctx_t *ctx, uint32_t height) {
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->height = height;
+    ctx->user = PACK_NO_ENTRY;
+    ctx->mac = PACK_NO_ENTRY;
+}
+
+int block_pack(block_pack_ctx_t *ctx, const block_record_t *block, uint8_t *out) {
+    uint8_t hash[HASH_LEN];
+    size_t pos = 1;
+
+    if (block->version != BLOCK_VERSION || block->length != sizeof(block_record_t) ||
+        block->height != ctx->height || block->event > PACK_EVENT_MASK) {
+        return -EINVAL;
+    }
+
+    // Only hashes that can be recomputed are left out
+    if (ctx->linked) {
+        block_hash(block, ctx->prev_hash, hash);
+        if (memcmp(hash, block->hash, HASH_LEN) != 0) {
+            return -EINVAL;
+        }
+    } else {
+        memcpy(&out[pos], block->hash, HASH_LEN);
+        pos += HASH_LEN;
+    }
+
+    uint8_t tag = block->event;
+    pos += put_varint(&out[pos], zigzag((int32_t)(block->timestamp - ctx->timestamp)));
+
+    if (block->event == BLOCK_EVENT_CHECKPOINT) {
+        memcpy(&out[pos], block->merkle_root, HASH_LEN);
+        pos += HASH_LEN;
+    } else {
+        size_t user_len = strnlen(block->user, BLOCK_USER_LENGTH);
+
+        // The user is stored up to its NUL, so the padding must be zero
+        for (size_t i = user_len; i < BLOCK_USER_LENGTH; i++) {
+            if (block->user[i]) {
+                return -EINVAL;
+            }
+        }
+
+        pos += put_varint(&out[pos], pack_meas(block->mag_meas));
+        pos += put_varint(&out[pos], pack_meas(block->ultra_meas));
+
+        uint8_t user_mode = pack_entry(ctx->users, &ctx->user_count, &ctx->user, BLOCK_USER_LENGTH,
+                                       block->user, user_len, true, out, &pos);
+
+        uint8_t mac_mode = PACK_NONE;
+        if (memcmp(block->mac, no_mac, sizeof(no_mac)) != 0) {
+            mac_mode = pack_entry(ctx->macs, &ctx->mac_count, &ctx->mac, sizeof(block->mac),
+                                  block->mac, sizeof(block->mac), false, out, &pos);
+        }
+
+        tag |= user_mode << PACK_USER_SHIFT | mac_mode << PACK_MAC_SHIFT;
+    }
+
+    out[0] = tag;
+    ctx->height++;
+    ctx->timestamp = block->timestamp;
+    memcpy(ctx->prev_hash, block->hash, HASH_LEN);
+    ctx->linked = 1;
+
+    return pos;
+}
+
+/**
+ * Read a user or MAC coded by pack_entry(). The dictionary is only changed
+ * once the whole record has been read, so a short buffer can be retried.
+ */
+static int unpack_entry(const block_pack_ctx_t *ctx, uint8_t mode, bool user, const uint8_t *in, size_t len,
+                        size_t *pos, uint8_t *value, uint8_t *index) {
+    size_t size = user ? BLOCK_USER_LENGTH : sizeof(no_mac);
+    const uint8_t *entries = user ? (const uint8_t *)ctx->users : (const uint8_t *)ctx->macs;
+    uint8_t count = user ? ctx->user_count : ctx->mac_count;
+    uint8_t last = user ? ctx->user : ctx->mac;
+    size_t literal_len = size;
+
+    memset(value, 0, size);
+    *index = last;
+
+    switch (mode) {
+        case PACK_SAME:
+            if (last == PACK_NO_ENTRY) {
+                return -EBADMSG;
+            }
+            memcpy(value, entries + last * size, size);
+            return 0;
+        case PACK_REF:
+            if (*pos >= len) {
+                return -EAGAIN;
+            }
+            *index = in[(*pos)++];
+            if (*index >= count) {
+                return -EBADMSG;
+            }
+            memcpy(value, entries + *index * size, size);
+            return 0;
+        case PACK_LITERAL:
+            if (user) {
+                if (*pos >= len) {
+                    return -EAGAIN;
+                }
+                literal_len = in[(*pos)++];
+                if (literal_len > size) {
+                    return -EBADMSG;
+                }
+            }
+            if (*pos + literal_len > len) {
+                return -EAGAIN;
+            }
+            memcpy(value, &in[*pos], literal_len);
+            *pos += literal_len;
+            *index = count < BLOCK_PACK_DICT_SIZE ? count : PACK_NO_ENTRY;
+            return 0;
+        default:
+            return user ? -EBADMSG : 0;
+    }
+}
+
+int block_unpack(block_pack_ctx_t *ctx, const uint8_t *in, size_t len, block_record_t *block) {
+    uint8_t first_hash[HASH_LEN];
+    uint8_t user_index = ctx->user, mac_index = ctx->mac;
+    uint32_t delta, mag_meas, ultra_meas;
+    size_t pos = 1;
+    int ret;
+
+    if (len < 1) {
+        return -EAGAIN;
+    }
+
+    uint8_t tag = in[0];
+    uint8_t user_mode = (tag >> PACK_USER_SHIFT) & PACK_MODE_MASK;
+    uint8_t mac_mode = (tag >> PACK_MAC_SHIFT) & PACK_MODE_MASK;
+
+    memset(block, 0, sizeof(*block));
+    block->version = BLOCK_VERSION;
+    block->length = sizeof(block_record_t);
+    block->height = ctx->height;
+    block->event = tag & PACK_EVENT_MASK;
+
+    if (!ctx->linked) {
+        if (pos + HASH_LEN > len) {
+            return -EAGAIN;
+        }
+        memcpy(first_hash, &in[pos], HASH_LEN);
+        pos += HASH_LEN;
+    }
+
+    if ((ret = get_varint(in, len, &pos, &delta)) < 0) {
+        return ret;
+    }
+    block->timestamp = ctx->timestamp + (uint32_t)unzigzag(delta);
+
+    if (block->event == BLOCK_EVENT_CHECKPOINT) {
+        if (user_mode != PACK_SAME || mac_mode != PACK_SAME) {
+            return -EBADMSG;
+        }
+        if (pos + HASH_LEN > len) {
+            return -EAGAIN;
+        }
+        memcpy(block->merkle_root, &in[pos], HASH_LEN);
+        pos += HASH_LEN;
+    } else {
+        if ((ret = get_varint(in, len, &pos, &mag_meas)) < 0 ||
+            (ret = get_varint(in, len, &pos, &ultra_meas)) < 0 ||
+            (ret = unpack_entry(ctx, user_mode, true, in, len, &pos, (uint8_t *)block->user, &user_index)) < 0 ||
+            (ret = unpack_entry(ctx, mac_mode, false, in, len, &pos, block->mac, &mac_index)) < 0) {
+            return ret;
+        }
+        block->mag_meas = unpack_meas(mag_meas);
+        block->ultra_meas = unpack_meas(ultra_meas);
+
+        if (user_mode == PACK_LITERAL && user_index != PACK_NO_ENTRY) {
+            memcpy(ctx->users[ctx->user_count++], block->user, BLOCK_USER_LENGTH);
+        }
+        if (mac_mode == PACK_LITERAL && mac_index != PACK_NO_ENTRY) {
+            memcpy(ctx->macs[ctx->mac_count++], block->mac, sizeof(block->mac));
+        }
+        ctx->user = user_index;
+        ctx->mac = mac_index;
+    }
+
+    if (ctx->linked) {
+        block_hash(block, ctx->prev_hash, block->hash);
+    } else {
+        memcpy(block->hash, first_hash, HASH_LEN);
+    }
+
+    ctx->height++;
+    ctx->timestamp = block->timestamp;
+    memcpy(ctx->prev_hash, block->hash, HASH_LEN);
+    ctx->linked = 1;
+
+    return pos;
+}
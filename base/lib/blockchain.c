@@ -2,273 +2,1976 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
-#include <cJSON.h>
+#include <math.h>
 #include <zephyr/logging/log.h>
 #include <mbedtls/sha256.h>
 #include <zephyr/fs/fs.h>
+#include <zephyr/sys/crc.h>
 #include "SEGGER_RTT.h"
 #include "fs.h"
+#include "fs_wear.h"
 #include "blockchain.h"
+#include "chain_stats.h"
+#include "json_codec.h"
+#include "json_writer.h"
 
 LOG_MODULE_REGISTER(blockchain, LOG_LEVEL_DBG);
 
 #define STACK_SIZE 4096
-#define THREAD_PRIORITY 2
+// The writer runs ahead of validation but behind the FSM (priority 1)
+#define WRITER_THREAD_PRIORITY 2
+#define VALIDATION_THREAD_PRIORITY 3
 
-static Block chain[MAX_BLOCKS];
-static int block_count = 0;
+// How long add_block() waits for space before dropping an event
+#define CHAIN_ENQUEUE_TIMEOUT_MS 100
 
-static void to_sha256_hex(const char *input, char *output) {
-    unsigned char hash[32];
-    mbedtls_sha256_context ctx;
+// Default group commit: wait up to 20 ms for up to 4 blocks
+#define CHAIN_COMMIT_WINDOW_MS 20
+#define CHAIN_COMMIT_DEFAULT_BLOCKS 4
+
+// Validation reads this many records per fs_read and sleeps between slices
+#define CHAIN_VERIFY_BATCH 4
+#define CHAIN_VERIFY_SLICE_MS 10
+#define CHAIN_VERIFY_BACKOFF_MS 20
+
+// chain export writes frames of a few raw records to their own RTT channel,
+// waiting for the host to drain it and giving up if it stops reading
+#define CHAIN_EXPORT_RTT_CHANNEL 1
+#define CHAIN_EXPORT_RTT_BUFFER_SIZE 2048
+#define CHAIN_EXPORT_BATCH 4
+#define CHAIN_EXPORT_FRAME_SIZE 1024
+#define CHAIN_EXPORT_POLL_MS 10
+#define CHAIN_EXPORT_STALL_MS 5000
+
+BUILD_ASSERT(sizeof(block_record_t) == 80, "block_record_t must not contain padding");
+BUILD_ASSERT(offsetof(block_record_t, hash) == BLOCK_CANONICAL_SIZE, "canonical encoding must cover the hashed fields");
+BUILD_ASSERT(BIT(CHAIN_PROOF_DEPTH) == CHAIN_CHECKPOINT_INTERVAL, "checkpoint interval must be 2^CHAIN_PROOF_DEPTH");
+BUILD_ASSERT(CHAIN_RAM_USERS < CHAIN_RAM_USER_NONE, "too many interned users");
+BUILD_ASSERT(CHAIN_RAM_BLOCKS >= CHAIN_GROUP_SIZE, "RAM ring must hold the open checkpoint group");
+
+// Compact copy of a recent block. The user is interned in ram_users and a
+// checkpoint's Merkle root is rebuilt from the blocks before it, so the hash
+// can be recomputed without keeping the whole record.
+typedef struct {
+    uint8_t hash[HASH_LEN];
+    uint32_t height;
+    uint32_t timestamp;
+    int32_t mag_meas;
+    int32_t ultra_meas;
+    uint8_t mac[6];
+    uint8_t event;
+    uint8_t user;           /* Index into ram_users, or CHAIN_RAM_USER_NONE */
+} chain_ram_block_t;
+
+// The last CHAIN_RAM_BLOCKS blocks, block n at ram_blocks[n % CHAIN_RAM_BLOCKS],
+// under chain_mutex
+static chain_ram_block_t ram_blocks[CHAIN_RAM_BLOCKS];
+static uint32_t ram_count;
+static uint32_t ram_next_height;
+// Hash of the block preceding the oldest one in the ring
+static uint8_t ram_base_hash[HASH_LEN];
+static char ram_users[CHAIN_RAM_USERS][BLOCK_USER_LENGTH];
+
+static chain_tail_t tail;
+static bool tail_loaded = false;
+static uint32_t tail_rebuilds;
+// Time blockchain_init() took to restore the chain
+static uint32_t boot_ms;
+// A torn write was cut from the log, record it with the next commit
+static bool recovery_pending = false;
+// Last point up to which the log has been verified, under verify_mutex
+static struct {
+    uint32_t height;
+    uint8_t hash[HASH_LEN];
+} verified;
+K_MUTEX_DEFINE(chain_mutex);
+// Serialises the periodic and on-demand verification passes
+K_MUTEX_DEFINE(verify_mutex);
+
+// A queued block and its position in the queue
+typedef struct {
+    block_record_t block;
+    uint32_t ticket;
+    uint32_t queued_at;     /* k_cycle_get_32() when queued */
+} chain_write_req_t;
+
+// Blocks waiting for the writer thread, in event order
+K_MSGQ_DEFINE(chain_write_msgq, sizeof(chain_write_req_t), CHAIN_QUEUE_SIZE, 4);
+// Keeps tickets in the same order as the queue
+K_MUTEX_DEFINE(enqueue_mutex);
+static uint32_t next_ticket = 1;
+
+// Highest ticket the writer has finished with, and the last batch that failed
+K_MUTEX_DEFINE(ack_mutex);
+K_CONDVAR_DEFINE(ack_condvar);
+static uint32_t acked_ticket;
+static uint32_t failed_first;
+static uint32_t failed_last;
+static int failed_status;
+// Given once blockchain_init() has migrated and loaded the log
+K_SEM_DEFINE(chain_ready_sem, 0, 1);
+
+// Writer counters, readable from any thread
+static atomic_t writer_queued;
+static atomic_t writer_written;
+static atomic_t writer_failed;
+static atomic_t writer_dropped;
+static atomic_t writer_peak_depth;
+static atomic_t writer_last_error;
+static atomic_t writer_commits;
+static atomic_t commit_window_ms = ATOMIC_INIT(CHAIN_COMMIT_WINDOW_MS);
+static atomic_t commit_max_blocks = ATOMIC_INIT(CHAIN_COMMIT_DEFAULT_BLOCKS);
+
+// Records linked but not yet written, owned by the writer thread. A batch of
+// events can add one checkpoint per group, plus one left over from a reset.
+static block_record_t commit_buf[CHAIN_COMMIT_MAX_BLOCKS + CHAIN_COMMIT_MAX_BLOCKS / CHAIN_CHECKPOINT_INTERVAL + 2];
+static size_t commit_len;
+// Hash of the block preceding commit_buf[0]
+static uint8_t commit_prev_hash[HASH_LEN];
+// Hashes of the events in the open checkpoint group, under chain_mutex
+static uint8_t group_leaves[CHAIN_CHECKPOINT_INTERVAL][HASH_LEN];
+
+// Merkle tree scratch space, used under chain_mutex
+static uint8_t merkle_nodes[CHAIN_CHECKPOINT_INTERVAL][HASH_LEN];
+// Verification scratch space, used under verify_mutex
+static block_record_t verify_blocks[CHAIN_VERIFY_BATCH];
+static uint8_t verify_leaves[CHAIN_CHECKPOINT_INTERVAL][HASH_LEN];
+
+static const char *const block_event_names[BLOCK_EVENT_MAX] = {
+    [BLOCK_EVENT_NONE] = "NONE",
+    [BLOCK_EVENT_PRESENCE] = "PRESENCE",
+    [BLOCK_EVENT_TAMPERING] = "TAMPERING",
+    [BLOCK_EVENT_DISCONNECTION] = "DISCONNECTION",
+    [BLOCK_EVENT_FAIL] = "FAIL",
+    [BLOCK_EVENT_SUCCESS] = "SUCCESS",
+    [BLOCK_EVENT_CHECKPOINT] = "CHECKPOINT",
+    [BLOCK_EVENT_RECOVERY] = "RECOVERY",
+};
+
+static void to_hex(const uint8_t *input, size_t len, char *output) {
+    static const char digits[] = "0123456789abcdef";
+
+    for (size_t i = 0; i < len; i++) {
+        output[i * 2] = digits[input[i] >> 4];
+        output[i * 2 + 1] = digits[input[i] & 0x0F];
+    }
+    output[len * 2] = '\0';
+}
+
+static bool hash_is_zero(const uint8_t *hash) {
+    for (int i = 0; i < HASH_LEN; i++) {
+        if (hash[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool is_checkpoint_height(uint32_t height) {
+    return height % CHAIN_GROUP_SIZE == CHAIN_CHECKPOINT_INTERVAL;
+}
+
+static uint32_t block_compute_crc(const block_record_t *block) {
+    return crc32_ieee((const uint8_t *)block, offsetof(block_record_t, crc));
+}
+
+/**
+ * Check that a record read back from flash is complete and undamaged
+ */
+static bool block_is_intact(const block_record_t *block) {
+    return block->version == BLOCK_VERSION &&
+           block->length == sizeof(block_record_t) &&
+           block->event < BLOCK_EVENT_MAX &&
+           (block->event == BLOCK_EVENT_CHECKPOINT) == is_checkpoint_height(block->height) &&
+           block->crc == block_compute_crc(block);
+}
+
+/**
+ * Convert a fixed-point measurement back to the "%.3f" text used by the dashboard
+ */
+static void format_milli(int32_t value, char *buf, size_t len) {
+    if (value == BLOCK_MEAS_NONE) {
+        snprintf(buf, len, "N/A");
+        return;
+    }
+
+    uint32_t magnitude = value < 0 ? -(int64_t)value : value;
+    snprintf(buf, len, "%s%u.%03u", value < 0 ? "-" : "", magnitude / 1000, magnitude % 1000);
+}
+
+static int32_t parse_milli(const char *text) {
+    if (!text || strcmp(text, "N/A") == 0 || text[0] == '\0') {
+        return BLOCK_MEAS_NONE;
+    }
+    return (int32_t)lround(strtod(text, NULL) * 1000.0);
+}
+
+static void parse_mac(const char *text, uint8_t *mac) {
+    memset(mac, 0, 6);
+    if (text) {
+        sscanf(text, "%2hhx:%2hhx:%2hhx:%2hhx:%2hhx:%2hhx", &mac[0], &mac[1], &mac[2], &mac[3], &mac[4], &mac[5]);
+    }
+}
+
+// A block as the dashboard sees it, every member already text
+typedef struct {
+    char timestamp[12];
+    char event[16];
+    char mag_meas[16];
+    char ultra_meas[16];
+    char user[32];              /* Legacy lines may name longer aliases than a block keeps */
+    char mac[18];
+    char merkle_root[HASH_SIZE];
+    char prev_hash[HASH_SIZE];
+    char curr_hash[HASH_SIZE];
+} block_json_t;
+
+// Member order is the order the dashboard has always received
+static const json_codec_field_t block_json_fields[] = {
+    JSON_CODEC_STRING(block_json_t, "timestamp", timestamp),
+    JSON_CODEC_STRING(block_json_t, "event", event),
+    JSON_CODEC_STRING(block_json_t, "mag_meas", mag_meas),
+    JSON_CODEC_STRING(block_json_t, "ultra_meas", ultra_meas),
+    JSON_CODEC_STRING(block_json_t, "user", user),
+    JSON_CODEC_STRING(block_json_t, "MAC", mac),
+    JSON_CODEC_STRING(block_json_t, "prev_hash", prev_hash),
+    JSON_CODEC_STRING(block_json_t, "curr_hash", curr_hash),
+};
+
+static const json_codec_field_t checkpoint_json_fields[] = {
+    JSON_CODEC_STRING(block_json_t, "timestamp", timestamp),
+    JSON_CODEC_STRING(block_json_t, "event", event),
+    JSON_CODEC_STRING(block_json_t, "merkle_root", merkle_root),
+    JSON_CODEC_STRING(block_json_t, "prev_hash", prev_hash),
+    JSON_CODEC_STRING(block_json_t, "curr_hash", curr_hash),
+};
+
+/**
+ * Render a block in the JSON line format expected by the PC dashboard
+ */
+int block_to_json(const block_record_t *block, const uint8_t *prev_hash, char *buf, size_t len) {
+    static const uint8_t no_mac[6] = {0};
+    block_json_t json;
+
+    snprintf(json.timestamp, sizeof(json.timestamp), "%u", block->timestamp);
+    strncpy(json.event, block_event_names[block->event], sizeof(json.event) - 1);
+    json.event[sizeof(json.event) - 1] = '\0';
+
+    if (block->height == 0 && hash_is_zero(prev_hash)) {
+        strcpy(json.prev_hash, "GENESIS");
+    } else {
+        to_hex(prev_hash, HASH_LEN, json.prev_hash);
+    }
+    to_hex(block->hash, HASH_LEN, json.curr_hash);
+
+    if (block->event == BLOCK_EVENT_CHECKPOINT) {
+        to_hex(block->merkle_root, HASH_LEN, json.merkle_root);
+        return json_codec_encode(checkpoint_json_fields, ARRAY_SIZE(checkpoint_json_fields), &json, buf, len);
+    }
+
+    format_milli(block->mag_meas, json.mag_meas, sizeof(json.mag_meas));
+    format_milli(block->ultra_meas, json.ultra_meas, sizeof(json.ultra_meas));
+    memcpy(json.user, block->user, BLOCK_USER_LENGTH);
+    json.user[BLOCK_USER_LENGTH] = '\0';
+
+    if (memcmp(block->mac, no_mac, sizeof(no_mac)) == 0) {
+        strcpy(json.mac, "N/A");
+    } else {
+        snprintf(json.mac, sizeof(json.mac), "%02X:%02X:%02X:%02X:%02X:%02X",
+                 block->mac[0], block->mac[1], block->mac[2], block->mac[3], block->mac[4], block->mac[5]);
+    }
+
+    return json_codec_encode(block_json_fields, ARRAY_SIZE(block_json_fields), &json, buf, len);
+}
+
+int block_from_json(const char *line, size_t len, block_record_t *block) {
+    block_json_t json;
+
+    // The hashes are not read back, a block is re-linked wherever it goes
+    int ret = json_codec_decode(line, len, block_json_fields, ARRAY_SIZE(block_json_fields) - 2, &json);
+    if (ret < 0) {
+        return ret;
+    }
+
+    memset(block, 0, sizeof(*block));
+    block_event_t event = block_event_parse(json.event);
+    block->event = event == BLOCK_EVENT_MAX ? BLOCK_EVENT_NONE : event;
+    block->timestamp = strtoul(json.timestamp, NULL, 10);
+    block->mag_meas = parse_milli(json.mag_meas);
+    block->ultra_meas = parse_milli(json.ultra_meas);
+    parse_mac(json.mac, block->mac);
+    strncpy(block->user, json.user, BLOCK_USER_LENGTH - 1);
+    return 0;
+}
+
+/**
+ * Read the block at the given height, from whichever segment holds it
+ */
+static int chain_read_block(chain_reader_t *reader, uint32_t height, block_record_t *block) {
+    int ret = chain_reader_read(reader, height, block, 1);
+    if (ret < 0) {
+        return ret;
+    }
+    if (ret != 1) {
+        return -EIO;
+    }
+
+    return block_is_intact(block) && block->height == height ? 0 : -EBADMSG;
+}
+
+/**
+ * Intern a user name for the RAM ring. Names no longer referenced by the
+ * ring are recycled; if the ring holds more distinct users than the table,
+ * the block is kept without its user.
+ */
+static uint8_t chain_ram_user(const char *user) {
+    bool used[CHAIN_RAM_USERS] = {false};
+
+    for (uint8_t i = 0; i < CHAIN_RAM_USERS; i++) {
+        if (memcmp(ram_users[i], user, BLOCK_USER_LENGTH) == 0) {
+            return i;
+        }
+    }
+
+    for (uint32_t i = 0; i < ram_count; i++) {
+        const chain_ram_block_t *entry = &ram_blocks[(ram_next_height - 1 - i) % CHAIN_RAM_BLOCKS];
+        if (entry->user != CHAIN_RAM_USER_NONE) {
+            used[entry->user] = true;
+        }
+    }
+
+    for (uint8_t i = 0; i < CHAIN_RAM_USERS; i++) {
+        if (!used[i]) {
+            memcpy(ram_users[i], user, BLOCK_USER_LENGTH);
+            return i;
+        }
+    }
+
+    return CHAIN_RAM_USER_NONE;
+}
+
+/**
+ * Add a persisted block to the RAM ring, dropping the oldest when full. A
+ * block that does not follow the newest one restarts the ring.
+ * Caller must hold chain_mutex.
+ */
+static void chain_ram_push(const block_record_t *block, const uint8_t *prev_hash) {
+    if (ram_count > 0 && block->height != ram_next_height) {
+        ram_count = 0;
+    }
+
+    chain_ram_block_t *entry = &ram_blocks[block->height % CHAIN_RAM_BLOCKS];
+
+    if (ram_count == 0) {
+        memcpy(ram_base_hash, prev_hash, HASH_LEN);
+    } else if (ram_count == CHAIN_RAM_BLOCKS) {
+        memcpy(ram_base_hash, entry->hash, HASH_LEN);
+        ram_count--;
+    }
+
+    // Evicted first, so its user can be recycled
+    entry->user = CHAIN_RAM_USER_NONE;
+
+    memcpy(entry->hash, block->hash, HASH_LEN);
+    entry->height = block->height;
+    entry->timestamp = block->timestamp;
+    entry->event = block->event;
+    if (block->event != BLOCK_EVENT_CHECKPOINT) {
+        entry->mag_meas = block->mag_meas;
+        entry->ultra_meas = block->ultra_meas;
+        memcpy(entry->mac, block->mac, sizeof(entry->mac));
+        entry->user = chain_ram_user(block->user);
+    }
+
+    ram_count++;
+    ram_next_height = block->height + 1;
+}
+
+/**
+ * Rebuild the record of a block in the RAM ring. Returns false if a field
+ * the hash covers could not be recovered: a checkpoint whose group starts
+ * before the ring, or a block whose user was not interned.
+ * Caller must hold chain_mutex.
+ */
+static bool chain_ram_expand(const chain_ram_block_t *entry, block_record_t *block) {
+    memset(block, 0, sizeof(*block));
+    block->version = BLOCK_VERSION;
+    block->length = sizeof(block_record_t);
+    block->event = entry->event;
+    block->height = entry->height;
+    block->timestamp = entry->timestamp;
+    memcpy(block->hash, entry->hash, HASH_LEN);
+
+    if (entry->event == BLOCK_EVENT_CHECKPOINT) {
+        if (entry->height - CHAIN_CHECKPOINT_INTERVAL < ram_next_height - ram_count) {
+            return false;
+        }
+        for (uint32_t i = 0; i < CHAIN_CHECKPOINT_INTERVAL; i++) {
+            uint32_t height = entry->height - CHAIN_CHECKPOINT_INTERVAL + i;
+            memcpy(merkle_nodes[i], ram_blocks[height % CHAIN_RAM_BLOCKS].hash, HASH_LEN);
+        }
+        block_merkle_root(merkle_nodes, block->merkle_root);
+        return true;
+    }
+
+    block->mag_meas = entry->mag_meas;
+    block->ultra_meas = entry->ultra_meas;
+    memcpy(block->mac, entry->mac, sizeof(block->mac));
+    if (entry->user == CHAIN_RAM_USER_NONE) {
+        return false;
+    }
+    memcpy(block->user, ram_users[entry->user], BLOCK_USER_LENGTH);
+    return true;
+}
+
+/**
+ * Fill the RAM ring with the last blocks of the log.
+ * Caller must hold chain_mutex.
+ */
+static void chain_ram_load(void) {
+    chain_reader_t reader;
+    block_record_t block;
+    uint8_t prev_hash[HASH_LEN] = {0};
+    uint32_t first = tail.height > CHAIN_RAM_BLOCKS ? tail.height - CHAIN_RAM_BLOCKS : 0;
+
+    ram_count = 0;
+    chain_reader_init(&reader);
+
+    if (first > 0 && chain_read_block(&reader, first - 1, &block) == 0) {
+        memcpy(prev_hash, block.hash, HASH_LEN);
+    }
+
+    for (uint32_t height = first; height < tail.height; height++) {
+        if (chain_read_block(&reader, height, &block) < 0) {
+            LOG_ERR("Failed to load block %u into RAM", height);
+            ram_count = 0;
+            break;
+        }
+        chain_ram_push(&block, prev_hash);
+        memcpy(prev_hash, block.hash, HASH_LEN);
+    }
+
+    chain_reader_close(&reader);
+}
+
+static uint32_t chain_tail_crc(const chain_tail_t *state) {
+    return crc32_ieee((const uint8_t *)state, offsetof(chain_tail_t, crc));
+}
+
+/**
+ * Write the cached tail state to the superblock file
+ */
+static void chain_tail_save(void) {
+    struct fs_file_t file;
+    fs_file_t_init(&file);
+
+    tail.crc = chain_tail_crc(&tail);
+
+    int ret = fs_wear_open(&file, CHAIN_TAIL_FILE, FS_O_CREATE | FS_O_WRITE | FS_O_TRUNC, FS_WEAR_CHAIN);
+    if (ret < 0) {
+        LOG_ERR("Failed to open chain tail file: %d", ret);
+        return;
+    }
+
+    if (fs_wear_write(&file, &tail, sizeof(tail)) != sizeof(tail)) {
+        LOG_ERR("Failed to write chain tail file");
+    }
+
+    fs_wear_close(&file);
+}
+
+/**
+ * Find the active segment from a stale superblock. It trails the log by at
+ * most one commit, so normally no more than one seal has happened since. The
+ * segment files are only listed if there is no superblock or it is ahead of
+ * the log.
+ */
+static uint32_t chain_tail_segment(const chain_tail_t *stale) {
+    chain_segment_trailer_t trailer;
+
+    if (stale == NULL) {
+        return chain_store_sealed_count();
+    }
+
+    uint32_t segment = stale->height / CHAIN_SEGMENT_BLOCKS;
+    if (segment > 0 && chain_store_trailer(segment - 1, &trailer) < 0) {
+        return chain_store_sealed_count();
+    }
+
+    while (chain_store_trailer(segment, &trailer) == 0) {
+        segment++;
+    }
+    return segment;
+}
+
+/**
+ * Rebuild the tail state from the last intact record of the log. The active
+ * segment's first record gives its position; an empty or damaged one follows
+ * the last sealed segment. A torn write is found by stepping back from the
+ * end of the active segment, so this never reads more than one segment, and
+ * is cut off so the next block links to the last intact one.
+ */
+static void chain_tail_rebuild(const chain_tail_t *stale) {
+    chain_reader_t reader;
+    struct fs_dirent entry;
+    block_record_t block;
+    uint32_t base;
+
+    tail.magic = CHAIN_TAIL_MAGIC;
+    tail.height = 0;
+    tail.offset = 0;
+    memset(tail.last_hash, 0, HASH_LEN);
+
+    size_t size = fs_stat(BLOCKCHAIN_FILE, &entry) == 0 ? entry.size : 0;
+    uint32_t count = MIN(size / sizeof(block_record_t), CHAIN_SEGMENT_BLOCKS);
+
+    chain_reader_init(&reader);
+
+    base = chain_tail_segment(stale) * CHAIN_SEGMENT_BLOCKS;
+    if (count > 0 && chain_reader_read(&reader, base, &block, 1) == 1 && block_is_intact(&block) &&
+        block.height % CHAIN_SEGMENT_BLOCKS == 0) {
+        base = block.height;
+    }
+
+    uint32_t intact = count;
+    while (intact > 0 && chain_read_block(&reader, base + intact - 1, &block) < 0) {
+        intact--;
+    }
+
+    // An empty active segment links to the end of the last sealed one
+    bool linked = intact > 0 || base == 0 || chain_read_block(&reader, base - 1, &block) == 0;
+    if (!linked) {
+        LOG_ERR("Last block of chain is damaged");
+    }
+
+    chain_reader_close(&reader);
+
+    tail.height = base + intact;
+    tail.offset = intact * sizeof(block_record_t);
+    if (tail.height > 0 && linked) {
+        memcpy(tail.last_hash, block.hash, HASH_LEN);
+    }
+
+    if (size > tail.offset) {
+        struct fs_file_t file;
+        fs_file_t_init(&file);
+
+        int ret = fs_wear_open(&file, BLOCKCHAIN_FILE, FS_O_WRITE, FS_WEAR_CHAIN);
+        if (ret == 0) {
+            ret = fs_truncate(&file, tail.offset);
+            fs_wear_close(&file);
+        }
+        if (ret < 0) {
+            LOG_ERR("Failed to cut torn write from chain: %d", ret);
+        }
+
+        LOG_WRN("Cut %u torn bytes from the end of the chain", (uint32_t)(size - tail.offset));
+        recovery_pending = true;
+    }
+
+    LOG_INF("Chain tail rebuilt: %u blocks, %u bytes", tail.height, tail.offset);
+}
+
+/**
+ * Fill group_leaves with the hashes of the open checkpoint group, so the
+ * next checkpoint can be built without reading the log. They come from the
+ * RAM ring unless it could not be loaded.
+ */
+static void chain_group_load(void) {
+    chain_reader_t reader;
+    block_record_t block;
+    uint32_t first = tail.height - tail.height % CHAIN_GROUP_SIZE;
+
+    if (ram_next_height == tail.height && first >= ram_next_height - ram_count) {
+        for (uint32_t height = first; height < tail.height; height++) {
+            memcpy(group_leaves[height % CHAIN_GROUP_SIZE], ram_blocks[height % CHAIN_RAM_BLOCKS].hash, HASH_LEN);
+        }
+        return;
+    }
+
+    chain_reader_init(&reader);
+
+    for (uint32_t height = first; height < tail.height; height++) {
+        if (chain_read_block(&reader, height, &block) < 0) {
+            LOG_ERR("Failed to read block %u of open checkpoint group", height);
+            break;
+        }
+        memcpy(group_leaves[height % CHAIN_GROUP_SIZE], block.hash, HASH_LEN);
+    }
+
+    chain_reader_close(&reader);
+}
+
+/**
+ * Load the tail state from the superblock, rebuilding it if it does not
+ * describe the current end of the log. Only the blocks kept in RAM are read,
+ * however long the chain. Caller must hold chain_mutex.
+ */
+static void chain_tail_load(void) {
+    struct fs_file_t file;
+    struct fs_dirent entry;
+    bool intact = false;
+    bool valid = false;
+
+    fs_file_t_init(&file);
+
+    if (fs_wear_open(&file, CHAIN_TAIL_FILE, FS_O_READ, FS_WEAR_CHAIN) >= 0) {
+        intact = fs_wear_read(&file, &tail, sizeof(tail)) == sizeof(tail) &&
+                 tail.magic == CHAIN_TAIL_MAGIC && tail.crc == chain_tail_crc(&tail);
+        fs_wear_close(&file);
+    }
+
+    if (intact) {
+        // The superblock is only trusted if it covers exactly the bytes on flash
+        size_t log_size = fs_stat(BLOCKCHAIN_FILE, &entry) == 0 ? entry.size : 0;
+        valid = tail.offset == log_size &&
+                tail.offset == tail.height % CHAIN_SEGMENT_BLOCKS * sizeof(block_record_t);
+    }
+
+    if (!valid) {
+        chain_tail_t stale = tail;
+
+        chain_tail_rebuild(intact ? &stale : NULL);
+        chain_tail_save();
+        tail_rebuilds++;
+    }
+
+    chain_ram_load();
+    chain_group_load();
+    tail_loaded = true;
+}
+
+/**
+ * Link a block to the end of the chain and stage it in commit_buf. Nothing
+ * reaches flash until chain_flush(). Caller must hold chain_mutex.
+ */
+static int chain_stage_record(block_record_t *block) {
+    if (commit_len >= ARRAY_SIZE(commit_buf)) {
+        return -ENOBUFS;
+    }
+
+    block->version = BLOCK_VERSION;
+    block->length = sizeof(block_record_t);
+    block->height = tail.height;
+    block_hash(block, tail.last_hash, block->hash);
+    block->crc = block_compute_crc(block);
+
+    if (!is_checkpoint_height(block->height)) {
+        memcpy(group_leaves[block->height % CHAIN_GROUP_SIZE], block->hash, HASH_LEN);
+    }
+
+    commit_buf[commit_len++] = *block;
+    tail.height++;
+    memcpy(tail.last_hash, block->hash, HASH_LEN);
+
+    return 0;
+}
+
+/**
+ * Read the hashes of the blocks committed to by the checkpoint at the given
+ * height into leaves
+ */
+static int chain_read_leaves(chain_reader_t *reader, uint32_t checkpoint_height, uint8_t leaves[][HASH_LEN]) {
+    block_record_t block;
+    uint32_t first = checkpoint_height - CHAIN_CHECKPOINT_INTERVAL;
+
+    for (uint32_t i = 0; i < CHAIN_CHECKPOINT_INTERVAL; i++) {
+        int ret = chain_read_block(reader, first + i, &block);
+        if (ret < 0) {
+            return ret;
+        }
+        memcpy(leaves[i], block.hash, HASH_LEN);
+    }
+
+    return 0;
+}
+
+/**
+ * Stage a checkpoint committing to the last CHAIN_CHECKPOINT_INTERVAL blocks.
+ * Caller must hold chain_mutex.
+ */
+static int chain_stage_checkpoint(uint32_t timestamp) {
+    block_record_t block = {0};
+
+    block.event = BLOCK_EVENT_CHECKPOINT;
+    block.timestamp = timestamp;
+    memcpy(merkle_nodes, group_leaves, sizeof(merkle_nodes));
+    block_merkle_root(merkle_nodes, block.merkle_root);
+
+    return chain_stage_record(&block);
+}
+
+/**
+ * Stage an event block, adding the checkpoint that follows it when due.
+ * Caller must hold chain_mutex.
+ */
+static int chain_stage_event(block_record_t *block) {
+    // A checkpoint lost to a reset is written before the next event
+    if (is_checkpoint_height(tail.height)) {
+        int ret = chain_stage_checkpoint(block->timestamp);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    int ret = chain_stage_record(block);
+    if (ret == 0 && is_checkpoint_height(tail.height)) {
+        ret = chain_stage_checkpoint(block->timestamp);
+    }
+
+    return ret;
+}
+
+/**
+ * Append every staged record with a single open/write/sync per segment,
+ * sealing each segment that fills up. If a later segment fails, the records
+ * already on flash stay committed: commit_len is cut to them and the tail
+ * follows, and the rest are discarded and reloaded from flash on the next
+ * append. Caller must hold chain_mutex.
+ */
+static int chain_flush(void) {
+    size_t done = 0, durable = 0;
+    int ret = 0;
+
+    while (done < commit_len && ret == 0) {
+        uint32_t height = commit_buf[done].height;
+        size_t count = MIN(commit_len - done, CHAIN_SEGMENT_BLOCKS - height % CHAIN_SEGMENT_BLOCKS);
+
+        if (height % CHAIN_SEGMENT_BLOCKS == 0) {
+            ret = chain_store_prepare();
+        }
+        if (ret == 0) {
+            ret = chain_store_append(&commit_buf[done], count);
+        }
+        if (ret == 0) {
+            durable = done + count;
+        }
+        if (ret == 0 && (height + count) % CHAIN_SEGMENT_BLOCKS == 0) {
+            // A failed seal is finished before the next append
+            chain_store_seal();
+        }
+        done += count;
+    }
+
+    if (ret < 0) {
+        // Partial write, recover the real tail on the next append
+        tail_loaded = false;
+        commit_len = durable;
+        if (durable == 0) {
+            return ret;
+        }
+        tail.height = commit_buf[durable - 1].height + 1;
+        memcpy(tail.last_hash, commit_buf[durable - 1].hash, HASH_LEN);
+    }
+
+    tail.offset = tail.height % CHAIN_SEGMENT_BLOCKS * sizeof(block_record_t);
+    chain_tail_save();
+    chain_index_append(commit_buf, commit_len);
+
+    for (size_t i = 0; i < commit_len; i++) {
+        chain_ram_push(&commit_buf[i], i == 0 ? commit_prev_hash : commit_buf[i - 1].hash);
+    }
+
+    return ret;
+}
+
+/**
+ * Send the event blocks of the last commit over RTT
+ */
+static void chain_emit_committed(void) {
+    char line[BLOCK_JSON_SIZE];
+    const uint8_t *prev_hash = commit_prev_hash;
+
+    for (size_t i = 0; i < commit_len; i++) {
+        const block_record_t *block = &commit_buf[i];
+
+        if (block->event != BLOCK_EVENT_CHECKPOINT) {
+            // Leave room for the newline so the frame goes out in one write
+            int len = block_to_json(block, prev_hash, line, sizeof(line) - 1);
+            if (len > 0) {
+                line[len++] = '\n';
+                SEGGER_RTT_Write(0, line, len);
+            } else {
+                printk("Failed to serialize block to JSON\n");
+            }
+        }
+        prev_hash = block->hash;
+    }
+}
+
+/**
+ * Link and persist a batch of blocks, then send them over RTT if emit is set.
+ * If committed is given it is set to how many of the blocks, from the first,
+ * are on flash, which on a failure part way through a batch may be some.
+ * Only the writer thread commits, so commit_buf stays valid after unlocking.
+ */
+static int chain_commit_batch(chain_write_req_t *reqs, size_t count, bool emit, size_t *committed) {
+    int ret = 0;
+
+    k_mutex_lock(&chain_mutex, K_FOREVER);
+    if (!tail_loaded) {
+        chain_tail_load();
+    }
+
+    commit_len = 0;
+    memcpy(commit_prev_hash, tail.last_hash, HASH_LEN);
+
+    if (recovery_pending) {
+        block_record_t recovery = {0};
+
+        recovery.event = BLOCK_EVENT_RECOVERY;
+        recovery.timestamp = count > 0 ? reqs[0].block.timestamp : k_uptime_get() / 1000;
+        recovery.mag_meas = BLOCK_MEAS_NONE;
+        recovery.ultra_meas = BLOCK_MEAS_NONE;
+        ret = chain_stage_event(&recovery);
+    }
+
+    for (size_t i = 0; i < count && ret == 0; i++) {
+        ret = chain_stage_event(&reqs[i].block);
+    }
+
+    if (ret == 0) {
+        ret = chain_flush();
+    } else {
+        commit_len = 0;
+        tail_loaded = false;
+    }
+    if (commit_len > 0) {
+        // The recovery block, if any, went first
+        recovery_pending = false;
+    }
+
+    // Blocks were given their heights when staged
+    size_t done = 0;
+    uint32_t end = commit_len > 0 ? commit_buf[commit_len - 1].height + 1 : 0;
+    while (done < count && commit_len > 0 && reqs[done].block.height < end) {
+        done++;
+    }
+    k_mutex_unlock(&chain_mutex);
+
+    if (commit_len > 0 && emit) {
+        chain_emit_committed();
+    }
+    if (committed) {
+        *committed = done;
+    }
+
+    return ret;
+}
+
+/**
+ * Mark tickets up to last as processed and wake anyone waiting on them
+ */
+static void chain_ack(uint32_t first, uint32_t last, int status) {
+    k_mutex_lock(&ack_mutex, K_FOREVER);
+    acked_ticket = last;
+    if (status < 0) {
+        failed_first = first;
+        failed_last = last;
+        failed_status = status;
+    }
+    k_condvar_broadcast(&ack_condvar);
+    k_mutex_unlock(&ack_mutex);
+}
+
+/**
+ * Queue a block for the writer thread. Blocks are persisted in the order
+ * they are queued. Returns a ticket for chain_wait_durable(), or -EAGAIN if
+ * the queue stayed full.
+ */
+int add_block(uint32_t timestamp, block_event_t event, int32_t mag_meas, int32_t ultra_meas, const char *user, const char *mac) {
+    chain_write_req_t req = {0};
+
+    req.block.event = event;
+    req.block.timestamp = timestamp;
+    req.block.mag_meas = mag_meas;
+    req.block.ultra_meas = ultra_meas;
+    parse_mac(mac, req.block.mac);
+    strncpy(req.block.user, user, BLOCK_USER_LENGTH - 1);
+    req.queued_at = k_cycle_get_32();
+
+    // Tickets are handed out in queue order
+    k_mutex_lock(&enqueue_mutex, K_FOREVER);
+    req.ticket = next_ticket;
+    int ret = k_msgq_put(&chain_write_msgq, &req, K_MSEC(CHAIN_ENQUEUE_TIMEOUT_MS));
+    if (ret == 0) {
+        next_ticket++;
+    }
+    k_mutex_unlock(&enqueue_mutex);
+
+    if (ret < 0) {
+        atomic_inc(&writer_dropped);
+        LOG_ERR("Blockchain queue full, event dropped");
+        return -EAGAIN;
+    }
+
+    atomic_inc(&writer_queued);
+    uint32_t depth = k_msgq_num_used_get(&chain_write_msgq);
+    if (depth > (uint32_t)atomic_get(&writer_peak_depth)) {
+        atomic_set(&writer_peak_depth, depth);
+    }
+
+    return (int)req.ticket;
+}
+
+/**
+ * Wait until the block with the given ticket is durable on flash. Returns
+ * -EAGAIN on timeout, or the write error if its batch failed.
+ */
+int chain_wait_durable(int ticket, k_timeout_t timeout) {
+    // Every batch wakes all waiters, so each wait gets only what is left
+    k_timepoint_t deadline = sys_timepoint_calc(timeout);
+    int ret = 0;
+
+    k_mutex_lock(&ack_mutex, K_FOREVER);
+    while (acked_ticket < (uint32_t)ticket && ret == 0) {
+        ret = k_condvar_wait(&ack_condvar, &ack_mutex, sys_timepoint_timeout(deadline));
+    }
+
+    if (ret < 0) {
+        ret = -EAGAIN;
+    } else if ((uint32_t)ticket >= failed_first && (uint32_t)ticket <= failed_last) {
+        ret = failed_status;
+    }
+    k_mutex_unlock(&ack_mutex);
+
+    return ret;
+}
+
+/**
+ * Set how long the writer waits for more blocks before committing, and the
+ * most blocks it commits at once. A window of 0 only batches blocks that are
+ * already queued.
+ */
+int chain_set_commit_window(uint32_t window_ms, uint32_t max_blocks) {
+    if (max_blocks == 0 || max_blocks > CHAIN_COMMIT_MAX_BLOCKS) {
+        return -EINVAL;
+    }
+
+    atomic_set(&commit_window_ms, window_ms);
+    atomic_set(&commit_max_blocks, max_blocks);
+    return 0;
+}
+
+/**
+ * Snapshot of the writer queue and commit counters
+ */
+void chain_writer_status(chain_writer_status_t *status) {
+    status->depth = k_msgq_num_used_get(&chain_write_msgq);
+    status->capacity = CHAIN_QUEUE_SIZE;
+    status->peak_depth = atomic_get(&writer_peak_depth);
+    status->queued = atomic_get(&writer_queued);
+    status->written = atomic_get(&writer_written);
+    status->failed = atomic_get(&writer_failed);
+    status->dropped = atomic_get(&writer_dropped);
+    status->last_error = atomic_get(&writer_last_error);
+    status->commits = atomic_get(&writer_commits);
+    status->window_ms = atomic_get(&commit_window_ms);
+    status->max_blocks = atomic_get(&commit_max_blocks);
+    status->boot_ms = boot_ms;
+    status->tail_rebuilds = tail_rebuilds;
+}
+
+/**
+ * Check one block against the hash before it and, for a checkpoint, against
+ * the leaves gathered since `from`. last_hash moves on to this block.
+ * Caller must hold verify_mutex.
+ */
+static bool chain_verify_block(const block_record_t *block, uint32_t height, uint32_t from, uint8_t *last_hash) {
+    uint8_t recomputed[HASH_LEN];
+
+    if (!block_is_intact(block) || block->height != height) {
+        printk("Damaged block at height %u\n", height);
+        return false;
+    }
+
+    block_hash(block, last_hash, recomputed);
+    if (memcmp(recomputed, block->hash, HASH_LEN) != 0) {
+        printk("Validation failed at height %u, timestamp: %u\n", height, block->timestamp);
+        return false;
+    }
+
+    if (!is_checkpoint_height(height)) {
+        memcpy(verify_leaves[height % CHAIN_GROUP_SIZE], block->hash, HASH_LEN);
+    } else if (height >= from + CHAIN_CHECKPOINT_INTERVAL) {
+        block_merkle_root(verify_leaves, recomputed);
+        if (memcmp(recomputed, block->merkle_root, HASH_LEN) != 0) {
+            printk("Merkle root mismatch at checkpoint %u\n", height);
+            return false;
+        }
+    }
+
+    memcpy(last_hash, block->hash, HASH_LEN);
+    return true;
+}
+
+/**
+ * Compare the digest of a segment's records with its sealed trailer
+ */
+static bool chain_verify_segment(mbedtls_sha256_context *digest, uint32_t segment) {
+    chain_segment_trailer_t trailer;
+    uint8_t recomputed[HASH_LEN];
+
+    mbedtls_sha256_finish(digest, recomputed);
+
+    int ret = chain_store_trailer(segment, &trailer);
+    if (ret < 0) {
+        printk("Missing trailer for segment %u: %d\n", segment, ret);
+        return false;
+    }
+
+    if (memcmp(recomputed, trailer.digest, HASH_LEN) != 0 ||
+        trailer.first_height != segment * CHAIN_SEGMENT_BLOCKS ||
+        trailer.last_height != trailer.first_height + CHAIN_SEGMENT_BLOCKS - 1) {
+        printk("Trailer mismatch for segment %u\n", segment);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Verify blocks [from, to) of the log, starting from the hash of the block
+ * before `from`. Checkpoint roots are checked for every group that starts
+ * inside the range, and segment trailers for every sealed segment that does.
+ * Work is split into slices of CHAIN_VERIFY_SLICE_MS, with a sleep between
+ * slices so the event path can use the CPU and flash.
+ * Caller must hold verify_mutex.
+ */
+static bool chain_verify_range(uint32_t from, uint32_t to, const uint8_t *prev_hash, uint8_t *last_hash) {
+    chain_reader_t reader;
+    mbedtls_sha256_context digest;
+    bool digesting = false;
+    bool valid = true;
+
+    memcpy(last_hash, prev_hash, HASH_LEN);
+    chain_reader_init(&reader);
+    reader.caller = FS_WEAR_VALIDATE;
+    mbedtls_sha256_init(&digest);
+
+    int64_t slice_start = k_uptime_get();
+    uint32_t height = from;
+
+    while (valid && height < to) {
+        int count = chain_reader_read(&reader, height, verify_blocks, MIN(to - height, CHAIN_VERIFY_BATCH));
+        if (count <= 0) {
+            printk("Failed to read block at height %u\n", height);
+            valid = false;
+            break;
+        }
+
+        for (int i = 0; i < count && valid; i++, height++) {
+            if (height % CHAIN_SEGMENT_BLOCKS == 0) {
+                mbedtls_sha256_starts(&digest, 0);
+                digesting = true;
+            }
+            if (digesting) {
+                mbedtls_sha256_update(&digest, (const uint8_t *)&verify_blocks[i], sizeof(block_record_t));
+            }
+
+            valid = chain_verify_block(&verify_blocks[i], height, from, last_hash);
+
+            if (valid && digesting && (height + 1) % CHAIN_SEGMENT_BLOCKS == 0) {
+                valid = chain_verify_segment(&digest, height / CHAIN_SEGMENT_BLOCKS);
+                digesting = false;
+            }
+        }
+
+        if (k_uptime_get() - slice_start >= CHAIN_VERIFY_SLICE_MS) {
+            k_msleep(CHAIN_VERIFY_BACKOFF_MS);
+            slice_start = k_uptime_get();
+        }
+    }
+
+    chain_reader_close(&reader);
+    mbedtls_sha256_free(&digest);
+    return valid;
+}
+
+/**
+ * Verify blocks of a file of records, such as a benchmark chain, from `from`
+ * to its end with the checks applied to the log, starting from the hash of
+ * the block before `from`. There are no segments, so no trailers are checked.
+ * Returns the number of blocks verified.
+ */
+int chain_verify_file(const char *path, fs_wear_caller_t caller, uint32_t from, const uint8_t *prev_hash) {
+    struct fs_file_t file;
+    uint8_t last_hash[HASH_LEN];
+    uint32_t height = from;
+    ssize_t len;
+
+    fs_file_t_init(&file);
+    int ret = fs_wear_open(&file, path, FS_O_READ, caller);
+    if (ret < 0) {
+        return ret;
+    }
+
+    k_mutex_lock(&verify_mutex, K_FOREVER);
+
+    memcpy(last_hash, prev_hash, HASH_LEN);
+    ret = fs_seek(&file, from * sizeof(block_record_t), FS_SEEK_SET);
+
+    while (ret == 0 && (len = fs_wear_read(&file, verify_blocks, sizeof(verify_blocks))) > 0) {
+        size_t count = len / sizeof(block_record_t);
+
+        for (size_t i = 0; i < count && ret == 0; i++, height++) {
+            if (!chain_verify_block(&verify_blocks[i], height, from, last_hash)) {
+                ret = -EBADMSG;
+            }
+        }
+    }
+    if (ret == 0 && len < 0) {
+        ret = len;
+    }
+
+    k_mutex_unlock(&verify_mutex);
+    fs_wear_close(&file);
+
+    return ret < 0 ? ret : (int)(height - from);
+}
+
+/**
+ * Print a Merkle inclusion proof for the block at the given height. The
+ * proof carries the hashed bytes of the block, so the receiver can recompute
+ * the leaf and then the checkpoint root from CHAIN_PROOF_DEPTH siblings.
+ */
+void chain_proof(const struct shell *shell, uint32_t height) {
+    static char line[CHAIN_PROOF_JSON_SIZE];
+    chain_reader_t reader;
+    block_record_t block, checkpoint_block;
+    uint8_t prev_hash[HASH_LEN] = {0};
+    json_writer_t writer;
+    uint32_t checkpoint_height = height - height % CHAIN_GROUP_SIZE + CHAIN_CHECKPOINT_INTERVAL;
+
+    if (is_checkpoint_height(height)) {
+        shell_error(shell, "Block %u is a checkpoint", height);
+        return;
+    }
+
+    if (checkpoint_height >= chain_height()) {
+        shell_error(shell, "Block %u is not covered by a checkpoint yet", height);
+        return;
+    }
+
+    chain_reader_init(&reader);
+
+    json_writer_init(&writer, line, sizeof(line));
+    json_writer_object_begin(&writer, NULL);
+    json_writer_object_begin(&writer, "proof");
+    json_writer_array_begin(&writer, "path");
+
+    k_mutex_lock(&chain_mutex, K_FOREVER);
+
+    int ret = chain_read_block(&reader, height, &block);
+    if (ret == 0 && height > 0) {
+        block_record_t prev;
+        ret = chain_read_block(&reader, height - 1, &prev);
+        memcpy(prev_hash, prev.hash, HASH_LEN);
+    }
+    if (ret == 0) {
+        ret = chain_read_block(&reader, checkpoint_height, &checkpoint_block);
+    }
+    if (ret == 0) {
+        ret = chain_read_leaves(&reader, checkpoint_height, merkle_nodes);
+    }
+
+    if (ret == 0) {
+        uint32_t index = height % CHAIN_GROUP_SIZE;
+
+        for (size_t count = CHAIN_CHECKPOINT_INTERVAL; count > 1; count /= 2) {
+            json_writer_hex(&writer, NULL, merkle_nodes[index ^ 1], HASH_LEN);
+            block_merkle_reduce(merkle_nodes, count);
+            index /= 2;
+        }
+
+        if (memcmp(merkle_nodes[0], checkpoint_block.merkle_root, HASH_LEN) != 0) {
+            ret = -EBADMSG;
+        }
+    }
+
+    k_mutex_unlock(&chain_mutex);
+    chain_reader_close(&reader);
+
+    if (ret < 0) {
+        shell_error(shell, "Failed to build proof for block %u: %d", height, ret);
+        return;
+    }
 
-    mbedtls_sha256_init(&ctx);
-    mbedtls_sha256_starts(&ctx, 0);
-    mbedtls_sha256_update(&ctx, (const unsigned char *)input, strlen(input));
-    mbedtls_sha256_finish(&ctx, hash);
-    mbedtls_sha256_free(&ctx);
+    json_writer_array_end(&writer);
+    json_writer_uint(&writer, "height", height);
+    json_writer_uint(&writer, "index", height % CHAIN_GROUP_SIZE);
+    uint8_t encoded[BLOCK_CANONICAL_SIZE];
+    block_encode_buf(&block, encoded);
+    json_writer_hex(&writer, "block", encoded, sizeof(encoded));
+    json_writer_hex(&writer, "prev_hash", prev_hash, HASH_LEN);
+    json_writer_hex(&writer, "leaf", block.hash, HASH_LEN);
+    json_writer_uint(&writer, "checkpoint", checkpoint_height);
+    json_writer_hex(&writer, "root", checkpoint_block.merkle_root, HASH_LEN);
+    json_writer_object_end(&writer);
+    json_writer_object_end(&writer);
+
+    int len = json_writer_finish(&writer);
+    if (len > 0) {
+        shell_print(shell, "%s", line);
+        SEGGER_RTT_Write(0, line, len);
+        SEGGER_RTT_Write(0, "\n", 1);
+    } else {
+        shell_error(shell, "Proof does not fit in %u bytes", (unsigned)sizeof(line));
+    }
+}
+
+uint32_t chain_height(void) {
+    k_mutex_lock(&chain_mutex, K_FOREVER);
+    if (!tail_loaded) {
+        chain_tail_load();
+    }
+    uint32_t height = tail.height;
+    k_mutex_unlock(&chain_mutex);
+
+    return height;
+}
+
+uint32_t chain_last_timestamp(void) {
+    chain_reader_t reader;
+    block_record_t block;
+    uint32_t timestamp = 0;
+
+    k_mutex_lock(&chain_mutex, K_FOREVER);
+    if (!tail_loaded) {
+        chain_tail_load();
+    }
+    uint32_t height = tail.height;
+    bool cached = ram_count > 0 && ram_next_height == height;
+    if (cached) {
+        timestamp = ram_blocks[(height - 1) % CHAIN_RAM_BLOCKS].timestamp;
+    }
+    k_mutex_unlock(&chain_mutex);
 
-    for (int i = 0; i < 32; i++) {
-        sprintf(output + i * 2, "%02x", hash[i]);
+    if (!cached && height > 0) {
+        chain_reader_init(&reader);
+        if (chain_read_block(&reader, height - 1, &block) == 0) {
+            timestamp = block.timestamp;
+        }
+        chain_reader_close(&reader);
     }
-    output[64] = '\0';
+
+    return timestamp;
 }
 
 /**
- * Add a block to the blockchain
+ * Validate all blocks in blockchain file
  */
-void add_block(const char *timestamp, const char *event, const char *mag_meas, const char *ultra_meas, const char *user, const char *mac) {
-    struct fs_file_t file;
-    fs_file_t_init(&file);
+bool validate_chain_from_file(void) {
+    static const uint8_t genesis[HASH_LEN] = {0};
+    uint8_t last_hash[HASH_LEN];
+    uint32_t height = chain_height();
 
-    // Default for first block
-    char prev_hash[HASH_SIZE] = "GENESIS";
+    k_mutex_lock(&verify_mutex, K_FOREVER);
+
+    int64_t start = k_uptime_get();
+    bool valid = chain_verify_range(0, height, genesis, last_hash);
+    if (valid) {
+        verified.height = height;
+        memcpy(verified.hash, last_hash, HASH_LEN);
+        chain_stats_validated(true, height, k_uptime_get() - start);
+    }
+
+    k_mutex_unlock(&verify_mutex);
+    return valid;
+}
+
+/**
+ * Verify the blocks appended since the last verified point. The pass restarts
+ * at the first block of the current checkpoint group, so the next checkpoint
+ * root can be checked against a full set of leaves. Caller must hold
+ * verify_mutex.
+ */
+static bool chain_verify_new_blocks(uint32_t height) {
+    chain_reader_t reader;
+    block_record_t block;
+    uint8_t start_hash[HASH_LEN] = {0};
+    uint8_t last_hash[HASH_LEN];
+    uint32_t from = verified.height;
+    uint32_t start = from - from % CHAIN_GROUP_SIZE;
 
-    // Attempt to read the last line from the file
-    if (fs_open(&file, BLOCKCHAIN_FILE, FS_O_READ) >= 0) {
-        char line[512];  // Adjust size as needed
-        char last_line[512] = {0};
+    if (from > height) {
+        // The log got shorter than what was already verified
+        printk("Chain truncated below verified height %u\n", from);
+        return false;
+    }
+
+    if (from > 0) {
+        chain_reader_init(&reader);
+        reader.caller = FS_WEAR_VALIDATE;
+
+        // The last verified block must still carry the verified hash
+        int ret = chain_read_block(&reader, from - 1, &block);
+        if (ret < 0 || memcmp(block.hash, verified.hash, HASH_LEN) != 0) {
+            printk("Verified block at height %u has changed\n", from - 1);
+            chain_reader_close(&reader);
+            return false;
+        }
+
+        if (start > 0) {
+            ret = chain_read_block(&reader, start - 1, &block);
+            memcpy(start_hash, block.hash, HASH_LEN);
+        }
+        chain_reader_close(&reader);
 
-        while (fs_read_line(&file, line, sizeof(line)) > 0) {
-            strncpy(last_line, line, sizeof(last_line) - 1);  // Save the most recent
+        if (ret < 0) {
+            return false;
         }
+    }
+
+    if (!chain_verify_range(start, height, start_hash, last_hash)) {
+        return false;
+    }
+
+    verified.height = height;
+    memcpy(verified.hash, last_hash, HASH_LEN);
+    return true;
+}
+
+/**
+ * Validate only the blocks appended since the last verified point
+ */
+bool validate_chain_incremental(void) {
+    uint32_t height = chain_height();
+
+    k_mutex_lock(&verify_mutex, K_FOREVER);
+
+    uint32_t from = verified.height;
+    int64_t start = k_uptime_get();
+    bool valid = chain_verify_new_blocks(height);
+    if (valid) {
+        chain_stats_validated(false, height - from, k_uptime_get() - start);
+    }
+
+    k_mutex_unlock(&verify_mutex);
+
+    return valid;
+}
+
+/**
+ * Temporary function just to test the validation of blockchain
+ */
+bool validate_chain_in_RAM(void) {
+    block_record_t block;
+    uint8_t computed_hash[HASH_LEN];
+    bool valid = true;
+
+    k_mutex_lock(&chain_mutex, K_FOREVER);
+
+    const uint8_t *prev_hash = ram_base_hash;
 
-        fs_close(&file);
+    for (uint32_t height = ram_next_height - ram_count; height < ram_next_height && valid; height++) {
+        const chain_ram_block_t *entry = &ram_blocks[height % CHAIN_RAM_BLOCKS];
 
-        if (strlen(last_line) > 0) {
-            cJSON *last_json = cJSON_Parse(last_line);
-            if (last_json) {
-                cJSON *curr_hash_field = cJSON_GetObjectItem(last_json, "curr_hash");
-                if (cJSON_IsString(curr_hash_field)) {
-                    strncpy(prev_hash, curr_hash_field->valuestring, HASH_SIZE - 1);
-                }
-                cJSON_Delete(last_json);
+        // Blocks that cannot be rebuilt are still checked through the next one's link
+        if (chain_ram_expand(entry, &block)) {
+            block_hash(&block, prev_hash, computed_hash);
+
+            if (memcmp(computed_hash, entry->hash, HASH_LEN) != 0) {
+                printf("Invalid chain at block %u\n", height);
+                valid = false;
             }
         }
+        prev_hash = entry->hash;
     }
-    
-    if (block_count >= MAX_BLOCKS) return;
 
-    Block *new_block = &chain[block_count];
-    strncpy(new_block->timestamp, timestamp, sizeof(new_block->timestamp) - 1);
-    strncpy(new_block->event, event, sizeof(new_block->event) - 1);
-    strncpy(new_block->mag_meas, mag_meas, sizeof(new_block->mag_meas) - 1);
-    strncpy(new_block->ultra_meas, ultra_meas, sizeof(new_block->ultra_meas) - 1);
-    strncpy(new_block->user, user, sizeof(new_block->user) - 1);
-    strncpy(new_block->MAC, mac, sizeof(new_block->MAC) - 1);
-    strncpy(new_block->prev_hash, prev_hash, HASH_SIZE - 1);
+    k_mutex_unlock(&chain_mutex);
+    return valid;
+}
 
-    // Build JSON without curr_hash
-    cJSON *block_json = cJSON_CreateObject();
-    cJSON_AddStringToObject(block_json, "timestamp", new_block->timestamp);
-    cJSON_AddStringToObject(block_json, "event", new_block->event);
-    cJSON_AddStringToObject(block_json, "mag_meas", new_block->mag_meas);
-    cJSON_AddStringToObject(block_json, "ultra_meas", new_block->ultra_meas);
-    cJSON_AddStringToObject(block_json, "user", new_block->user);
-    cJSON_AddStringToObject(block_json, "MAC", new_block->MAC);
-    cJSON_AddStringToObject(block_json, "prev_hash", new_block->prev_hash);
 
-    char *serialized = cJSON_PrintUnformatted(block_json);
-    to_sha256_hex(serialized, new_block->curr_hash);
+/**
+ * Print the recent blocks held in RAM
+ */
+void print_chain(void) {
+    char mag_meas[16], ultra_meas[16], hash[HASH_SIZE];
 
-    cJSON_Delete(block_json);
-    free(serialized);
+    k_mutex_lock(&chain_mutex, K_FOREVER);
 
-    block_count++;
+    const uint8_t *prev_hash = ram_base_hash;
 
-    fs_file_t_init(&file);
-    // Append to file
-    int ret = fs_open(&file, BLOCKCHAIN_FILE, FS_O_CREATE | FS_O_WRITE | FS_O_APPEND);
-    if (ret < 0) {
-        printk("Failed to open blockchain file\n");
-    } else {
-        cJSON *full_json = cJSON_CreateObject();
-        cJSON_AddStringToObject(full_json, "timestamp", new_block->timestamp);
-        cJSON_AddStringToObject(full_json, "event", new_block->event);
-        cJSON_AddStringToObject(full_json, "mag_meas", new_block->mag_meas);
-        cJSON_AddStringToObject(full_json, "ultra_meas", new_block->ultra_meas);
-        cJSON_AddStringToObject(full_json, "user", new_block->user);
-        cJSON_AddStringToObject(full_json, "MAC", new_block->MAC);
-        cJSON_AddStringToObject(full_json, "prev_hash", new_block->prev_hash);
-        cJSON_AddStringToObject(full_json, "curr_hash", new_block->curr_hash);
-
-        char *line = cJSON_PrintUnformatted(full_json);
-        
-        if (line) {
-            fs_write(&file, line, strlen(line));
-            fs_write(&file, "\n", 1);
-
-            SEGGER_RTT_Write(0, line, strlen(line));
-            SEGGER_RTT_Write(0, "\n", 2);
-        } else {
-            printk("Failed to serialize block to JSON\n");
+    for (uint32_t height = ram_next_height - ram_count; height < ram_next_height; height++) {
+        const chain_ram_block_t *entry = &ram_blocks[height % CHAIN_RAM_BLOCKS];
+
+        printf("Block %u:\n", entry->height);
+        printf("  timestamp:   %u\n", entry->timestamp);
+        printf("  event:       %s\n", block_event_names[entry->event]);
+        if (entry->event != BLOCK_EVENT_CHECKPOINT) {
+            format_milli(entry->mag_meas, mag_meas, sizeof(mag_meas));
+            format_milli(entry->ultra_meas, ultra_meas, sizeof(ultra_meas));
+
+            printf("  mag_meas:    %s\n", mag_meas);
+            printf("  ultra_meas:  %s\n", ultra_meas);
+            printf("  user:        %.*s\n", BLOCK_USER_LENGTH,
+                   entry->user == CHAIN_RAM_USER_NONE ? "?" : ram_users[entry->user]);
+            printf("  MAC:         %02X:%02X:%02X:%02X:%02X:%02X\n", entry->mac[0], entry->mac[1],
+                   entry->mac[2], entry->mac[3], entry->mac[4], entry->mac[5]);
+        }
+        to_hex(prev_hash, HASH_LEN, hash);
+        printf("  prev_hash:   %s\n", hash);
+        to_hex(entry->hash, HASH_LEN, hash);
+        printf("  curr_hash:   %s\n\n", hash);
+        prev_hash = entry->hash;
+    }
+
+    k_mutex_unlock(&chain_mutex);
+}
+
+/**
+ * Print blocks from the file system as JSON lines
+ */
+void chain_view(const struct shell *shell, uint32_t from, uint32_t count) {
+    chain_reader_t reader;
+
+    uint32_t height = chain_height();
+    if (from >= height) {
+        shell_print(shell, "Chain has %u blocks.", height);
+        return;
+    }
+
+    chain_reader_init(&reader);
+
+    block_record_t block;
+    uint8_t prev_hash[HASH_LEN] = {0};
+    char line[BLOCK_JSON_SIZE];
+
+    if (from > 0 && chain_read_block(&reader, from - 1, &block) == 0) {
+        memcpy(prev_hash, block.hash, HASH_LEN);
+    }
+
+    for (uint32_t i = from; i < height && i - from < count; i++) {
+        if (chain_read_block(&reader, i, &block) < 0) {
+            shell_error(shell, "Damaged block at height %u", i);
+            break;
         }
 
-        fs_close(&file);
-        cJSON_Delete(full_json);
-        free(line);
+        if (block_to_json(&block, prev_hash, line, sizeof(line)) > 0) {
+            shell_print(shell, "%s", line);
+        }
+        memcpy(prev_hash, block.hash, HASH_LEN);
     }
+
+    chain_reader_close(&reader);
 }
 
 /**
- * Validate all blocks in blockchain file
+ * Print the newest blocks matching a query. The index narrows the search to
+ * candidate heights; without it every block is read, newest first.
  */
-bool validate_chain_from_file(void) {
+void chain_query(const struct shell *shell, const chain_query_t *query, uint32_t limit) {
+    chain_reader_t reader;
+    block_record_t block;
+    uint8_t prev_hash[HASH_LEN];
+    char line[BLOCK_JSON_SIZE];
+    uint32_t cursor = chain_height();
+    uint32_t height = 0;
+    uint32_t found = 0;
+    bool indexed = true;
+
+    chain_reader_init(&reader);
+
+    while (found < limit) {
+        int ret = indexed ? chain_index_next(query, &cursor, &height) : 0;
+        if (ret < 0) {
+            // Carry on from the same point without the index
+            shell_warn(shell, "Chain index unavailable, scanning the log");
+            indexed = false;
+        }
+        if (!indexed) {
+            if (cursor == 0) {
+                break;
+            }
+            height = --cursor;
+        } else if (ret == 0) {
+            break;
+        }
+
+        if (chain_read_block(&reader, height, &block) < 0) {
+            shell_error(shell, "Damaged block at height %u", height);
+            continue;
+        }
+        if (!chain_query_match(query, &block)) {
+            continue;
+        }
+
+        memset(prev_hash, 0, HASH_LEN);
+        if (height > 0) {
+            block_record_t prev;
+            if (chain_read_block(&reader, height - 1, &prev) == 0) {
+                memcpy(prev_hash, prev.hash, HASH_LEN);
+            }
+        }
+
+        if (block_to_json(&block, prev_hash, line, sizeof(line)) > 0) {
+            shell_print(shell, "%s", line);
+        }
+        found++;
+    }
+
+    chain_reader_close(&reader);
+    shell_print(shell, "%u matching blocks.", found);
+}
+
+block_event_t block_event_parse(const char *name) {
+    for (int i = 0; i < BLOCK_EVENT_MAX; i++) {
+        if (strcmp(name, block_event_names[i]) == 0) {
+            return i;
+        }
+    }
+    return BLOCK_EVENT_MAX;
+}
+
+/**
+ * Write a frame to the export channel once the host has made room for all
+ * of it, so frames are never skipped or cut short
+ */
+static int chain_export_write(const char *frame, size_t len) {
+    int64_t deadline = k_uptime_get() + CHAIN_EXPORT_STALL_MS;
+
+    while (SEGGER_RTT_GetAvailWriteSpace(CHAIN_EXPORT_RTT_CHANNEL) < len) {
+        if (k_uptime_get() > deadline) {
+            return -ETIMEDOUT;
+        }
+        k_msleep(CHAIN_EXPORT_POLL_MS);
+    }
+
+    SEGGER_RTT_Write(CHAIN_EXPORT_RTT_CHANNEL, frame, len);
+    return 0;
+}
+
+/**
+ * Stream the blocks from height since onwards to the export RTT channel.
+ * Each frame carries the raw records and the hash they link to, so the host
+ * can check and resume from its last acknowledged height without replaying
+ * the chain.
+ */
+void chain_export(const struct shell *shell, uint32_t since) {
+    static uint8_t rtt_buf[CHAIN_EXPORT_RTT_BUFFER_SIZE];
+    // Used by the shell thread only
+    static char frame[CHAIN_EXPORT_FRAME_SIZE];
+    static bool configured;
+    chain_reader_t reader;
+    block_record_t blocks[CHAIN_EXPORT_BATCH];
+    uint8_t prev_hash[HASH_LEN] = {0};
+    char prev_hex[HASH_SIZE];
+    int ret = 0;
+
+    BUILD_ASSERT(CHAIN_EXPORT_FRAME_SIZE > 160 + 2 * sizeof(blocks), "export frame too small");
+
+    uint32_t height = chain_height();
+    if (since > height) {
+        shell_error(shell, "Chain has %u blocks.", height);
+        return;
+    }
+
+    if (!configured) {
+        SEGGER_RTT_ConfigUpBuffer(CHAIN_EXPORT_RTT_CHANNEL, "chain", rtt_buf, sizeof(rtt_buf),
+                                  SEGGER_RTT_MODE_NO_BLOCK_SKIP);
+        configured = true;
+    }
+
+    chain_reader_init(&reader);
+
+    if (since > 0) {
+        ret = chain_read_block(&reader, since - 1, &blocks[0]);
+        memcpy(prev_hash, blocks[0].hash, HASH_LEN);
+    }
+
+    uint32_t next = since;
+    while (ret == 0 && next < height) {
+        int count = chain_reader_read(&reader, next, blocks, MIN(height - next, CHAIN_EXPORT_BATCH));
+        if (count <= 0) {
+            ret = count < 0 ? count : -EIO;
+            break;
+        }
+
+        for (int i = 0; i < count && ret == 0; i++) {
+            if (!block_is_intact(&blocks[i]) || blocks[i].height != next + i) {
+                ret = -EBADMSG;
+            }
+        }
+        if (ret < 0) {
+            break;
+        }
+
+        to_hex(prev_hash, HASH_LEN, prev_hex);
+        int len = snprintf(frame, sizeof(frame), "{\"export\":{\"from\":%u,\"count\":%d,\"prev_hash\":\"%s\",\"records\":\"",
+                           next, count, prev_hex);
+        to_hex((const uint8_t *)blocks, count * sizeof(block_record_t), &frame[len]);
+        len += count * sizeof(block_record_t) * 2;
+        len += snprintf(&frame[len], sizeof(frame) - len, "\"}}\n");
+
+        ret = chain_export_write(frame, len);
+        memcpy(prev_hash, blocks[count - 1].hash, HASH_LEN);
+        next += count;
+    }
+
+    chain_reader_close(&reader);
+
+    if (ret == 0) {
+        int len = snprintf(frame, sizeof(frame), "{\"export\":{\"end\":%u}}\n", height);
+        ret = chain_export_write(frame, len);
+    }
+
+    if (ret == -ETIMEDOUT) {
+        shell_error(shell, "Export stalled at block %u, host is not reading RTT channel %d", next,
+                    CHAIN_EXPORT_RTT_CHANNEL);
+    } else if (ret < 0) {
+        shell_error(shell, "Export failed at block %u: %d", next, ret);
+    } else {
+        shell_print(shell, "Exported %u blocks from height %u on RTT channel %d.", height - since, since,
+                    CHAIN_EXPORT_RTT_CHANNEL);
+    }
+}
+
+/**
+ * Check a legacy JSON line against the legacy hashing: its prev_hash must be
+ * the curr_hash of the line before it ("GENESIS" for the first), and its
+ * curr_hash the SHA-256 of the line as it was hashed, which ended before
+ * curr_hash. prev_hash moves on to this line's curr_hash either way, so one
+ * break is reported once; it is left empty, matching any line, when this
+ * line has no hashes to go on.
+ */
+static bool chain_legacy_linked(const char *line, size_t len, char *prev_hash) {
+    static const char curr_member[] = ",\"curr_hash\":\"";
+    uint8_t hash[HASH_LEN];
+    char hex[HASH_SIZE];
+    block_json_t json;
+    mbedtls_sha256_context ctx;
+
+    int found = json_codec_decode(line, len, block_json_fields, ARRAY_SIZE(block_json_fields), &json);
+    if (found < (int)ARRAY_SIZE(block_json_fields)) {
+        prev_hash[0] = '\0';
+        return false;
+    }
+
+    bool linked = prev_hash[0] == '\0' || strcmp(json.prev_hash, prev_hash) == 0;
+    strcpy(prev_hash, json.curr_hash);
+
+    // The legacy writer always put curr_hash last, as 64 hex digits
+    size_t tail = sizeof(curr_member) - 1 + HASH_LEN * 2 + 2;
+    if (len < tail || strncmp(&line[len - tail], curr_member, sizeof(curr_member) - 1) != 0) {
+        return false;
+    }
+
+    mbedtls_sha256_init(&ctx);
+    mbedtls_sha256_starts(&ctx, 0);
+    mbedtls_sha256_update(&ctx, (const uint8_t *)line, len - tail);
+    mbedtls_sha256_update(&ctx, (const uint8_t *)"}", 1);
+    mbedtls_sha256_finish(&ctx, hash);
+    mbedtls_sha256_free(&ctx);
+
+    to_hex(hash, HASH_LEN, hex);
+    return linked && strcmp(hex, json.curr_hash) == 0;
+}
+
+/**
+ * Stage a RECOVERY block naming the legacy line where the linkage broke
+ */
+static void chain_legacy_break(chain_write_req_t *req, uint32_t line_no) {
+    memset(req, 0, sizeof(*req));
+    req->block.event = BLOCK_EVENT_RECOVERY;
+    req->block.mag_meas = BLOCK_MEAS_NONE;
+    req->block.ultra_meas = BLOCK_MEAS_NONE;
+    snprintf(req->block.user, BLOCK_USER_LENGTH, "legacy:%u", line_no);
+}
+
+/**
+ * Convert a chain.log written as JSON lines into binary records. Each line
+ * is first checked against the legacy hash linkage. The blocks are then
+ * re-hashed under the binary format, so the new chain starts a fresh hash
+ * linkage over the same events. Where a line was skipped or the legacy
+ * linkage breaks, a RECOVERY block naming the line goes before the next
+ * migrated block, so an edited chain does not come out as an intact one.
+ */
+static void chain_migrate_legacy(void) {
+    static chain_write_req_t batch[CHAIN_COMMIT_MAX_BLOCKS];
     struct fs_file_t file;
     fs_file_t_init(&file);
 
-    int ret = fs_open(&file, BLOCKCHAIN_FILE, FS_O_READ);
+    if (fs_wear_open(&file, BLOCKCHAIN_LEGACY_FILE, FS_O_READ, FS_WEAR_CHAIN) < 0) {
+        return;
+    }
+
+    LOG_INF("Migrating JSON blockchain to binary format...");
+
+    // Drop whatever an interrupted migration left behind
+    int ret = chain_store_reset();
     if (ret < 0) {
-        printk("Failed to open blockchain file\n");
-        return false;
+        fs_wear_close(&file);
+        LOG_ERR("Migration could not clear the old segments: %d", ret);
+        return;
     }
+    fs_unlink(CHAIN_INDEX_FILE);
+    fs_unlink(CHAIN_TAIL_FILE);
+    tail_loaded = false;
 
-    char line[600];
-    Block prev = {0}, curr;
-    bool first = true;
+    static char line_buf[BLOCK_JSON_SIZE * 2];
+    char prev_hash[HASH_SIZE] = "GENESIS";
+    fs_line_reader_t reader;
+    char *line;
+    uint32_t line_no = 0, migrated = 0, breaks = 0;
+    uint32_t break_line = 0, timestamp = 0;
+    size_t count = 0;
+    bool broken = false;
+    ssize_t len;
 
-    while (fs_read_line(&file, line, sizeof(line)) > 0) {
-        cJSON *json = cJSON_Parse(line);
-        if (!json) {
-            fs_close(&file);
-            printk("Invalid JSON in file\n");
-            return false;
+    fs_line_reader_init(&reader, &file, line_buf, sizeof(line_buf));
+    while (ret == 0 && (len = fs_line_reader_next(&reader, &line)) != 0) {
+        if (len < 0 && len != -E2BIG) {
+            // Keep the JSON chain, the next boot starts the migration over
+            LOG_ERR("Migration read failed at line %u: %d", line_no, (int)len);
+            ret = len;
+            break;
         }
 
-        strncpy(curr.timestamp,  cJSON_GetObjectItem(json, "timestamp")->valuestring,  sizeof(curr.timestamp));
-        strncpy(curr.event,      cJSON_GetObjectItem(json, "event")->valuestring,      sizeof(curr.event));
-        strncpy(curr.mag_meas,   cJSON_GetObjectItem(json, "mag_meas")->valuestring,   sizeof(curr.mag_meas));
-        strncpy(curr.ultra_meas, cJSON_GetObjectItem(json, "ultra_meas")->valuestring, sizeof(curr.ultra_meas));
-        strncpy(curr.user,       cJSON_GetObjectItem(json, "user")->valuestring,       sizeof(curr.user));
-        strncpy(curr.MAC,        cJSON_GetObjectItem(json, "MAC")->valuestring,        sizeof(curr.MAC));
-        strncpy(curr.prev_hash,  cJSON_GetObjectItem(json, "prev_hash")->valuestring,  HASH_SIZE);
-        strncpy(curr.curr_hash,  cJSON_GetObjectItem(json, "curr_hash")->valuestring,  HASH_SIZE);
-
-        if (!first) {
-            // Recompute hash from previous block
-            cJSON *rebuild = cJSON_CreateObject();
-            cJSON_AddStringToObject(rebuild, "timestamp",  prev.timestamp);
-            cJSON_AddStringToObject(rebuild, "event",      prev.event);
-            cJSON_AddStringToObject(rebuild, "mag_meas",   prev.mag_meas);
-            cJSON_AddStringToObject(rebuild, "ultra_meas", prev.ultra_meas);
-            cJSON_AddStringToObject(rebuild, "user",       prev.user);
-            cJSON_AddStringToObject(rebuild, "MAC",        prev.MAC);
-            cJSON_AddStringToObject(rebuild, "prev_hash",  prev.prev_hash);
-
-            char *serialized = cJSON_PrintUnformatted(rebuild);
-            char recomputed[HASH_SIZE];
-            to_sha256_hex(serialized, recomputed);
-
-            if (strcmp(curr.prev_hash, recomputed) != 0) {
-                printk("Validation failed at timestamp: %s\n", curr.timestamp);
-                cJSON_Delete(json);
-                cJSON_Delete(rebuild);
-                free(serialized);
-                fs_close(&file);
-                return false;
+        // Leave room for a break marker and the block after it
+        if (count + 2 > ARRAY_SIZE(batch)) {
+            ret = chain_commit_batch(batch, count, false, NULL);
+            count = 0;
+            if (ret < 0) {
+                break;
             }
+        }
 
-            cJSON_Delete(rebuild);
-            free(serialized);
+        if (len == -E2BIG || block_from_json(line, len, &batch[count].block) < 0) {
+            LOG_ERR("Skipping unreadable JSON block at line %u", line_no);
+            prev_hash[0] = '\0';
+            break_line = broken ? break_line : line_no;
+            broken = true;
+        } else {
+            block_record_t block = batch[count].block;
+
+            if (!chain_legacy_linked(line, len, prev_hash) && !broken) {
+                LOG_ERR("Legacy chain linkage broken at line %u", line_no);
+                break_line = line_no;
+                broken = true;
+            }
+            if (broken) {
+                chain_legacy_break(&batch[count++], break_line);
+                batch[count - 1].block.timestamp = block.timestamp;
+                broken = false;
+                breaks++;
+            }
+            batch[count++].block = block;
+            timestamp = block.timestamp;
+            migrated++;
         }
+        line_no++;
+    }
 
-        prev = curr;
-        cJSON_Delete(json);
-        first = false;
+    if (ret == 0 && broken) {
+        // The last lines were unreadable, mark the end of the chain
+        chain_legacy_break(&batch[count++], break_line);
+        batch[count - 1].block.timestamp = timestamp;
+        breaks++;
+    }
+    if (ret == 0 && count > 0) {
+        ret = chain_commit_batch(batch, count, false, NULL);
     }
 
-    fs_close(&file);
-    return true;
+    fs_wear_close(&file);
+
+    if (ret < 0) {
+        LOG_ERR("Migration failed at line %u: %d", line_no, ret);
+        return;
+    }
+
+    fs_unlink(BLOCKCHAIN_LEGACY_FILE);
+    if (breaks > 0) {
+        LOG_WRN("Migrated %u blocks, %u legacy linkage breaks recorded as RECOVERY blocks", migrated, breaks);
+    } else {
+        LOG_INF("Migrated %u blocks.", migrated);
+    }
 }
 
 /**
- * Temporary function just to test the validation of blockchain
+ * Split a binary chain.log written before segments were introduced. Records
+ * are copied unchanged, so their hashes still prove the original chain. A
+ * record torn by a reset is dropped, as chain_tail_rebuild() would cut it.
  */
-bool validate_chain_in_RAM(void) {
+static void chain_migrate_unsegmented(void) {
+    struct fs_file_t file;
+    struct fs_dirent entry;
+    block_record_t records[CHAIN_VERIFY_BATCH];
+    uint32_t height = 0;
+    int ret = 0;
 
-    char computed_hash[HASH_SIZE];
-    for (int i = 1; i < block_count; i++) {
-        cJSON *block_json = cJSON_CreateObject();
-        cJSON_AddStringToObject(block_json, "timestamp", chain[i - 1].timestamp);
-        cJSON_AddStringToObject(block_json, "event", chain[i - 1].event);
-        cJSON_AddStringToObject(block_json, "user", chain[i - 1].user);
-        cJSON_AddStringToObject(block_json, "MAC", chain[i - 1].MAC);
-        cJSON_AddStringToObject(block_json, "prev_hash", chain[i - 1].prev_hash);
-
-        char *serialized = cJSON_PrintUnformatted(block_json);
-        to_sha256_hex(serialized, computed_hash);
-
-        if (strcmp(computed_hash, chain[i].prev_hash) != 0) {
-            printf("Invalid chain at block %d\n", i);
-            cJSON_Delete(block_json);
-            free(serialized);
-            return false;
+    fs_file_t_init(&file);
+
+    if (fs_stat(BLOCKCHAIN_UNSEGMENTED_FILE, &entry) < 0 ||
+        fs_wear_open(&file, BLOCKCHAIN_UNSEGMENTED_FILE, FS_O_READ, FS_WEAR_CHAIN) < 0) {
+        return;
+    }
+
+    uint32_t whole = entry.size / sizeof(block_record_t);
+    uint32_t torn = entry.size % sizeof(block_record_t);
+
+    LOG_INF("Splitting blockchain into segments...");
+
+    ret = chain_store_reset();
+    if (ret < 0) {
+        fs_wear_close(&file);
+        LOG_ERR("Segment split could not clear the old segments: %d", ret);
+        return;
+    }
+    fs_unlink(CHAIN_INDEX_FILE);
+    fs_unlink(CHAIN_TAIL_FILE);
+    tail_loaded = false;
+
+    while (height < whole) {
+        uint32_t count = MIN(ARRAY_SIZE(records), CHAIN_SEGMENT_BLOCKS - height % CHAIN_SEGMENT_BLOCKS);
+        count = MIN(count, whole - height);
+
+        ssize_t len = fs_wear_read(&file, records, count * sizeof(block_record_t));
+        if (len != (ssize_t)(count * sizeof(block_record_t))) {
+            // Keep chain.bin, the next boot starts the split over
+            ret = len < 0 ? (int)len : -EIO;
+            break;
+        }
+
+        ret = chain_store_append(records, count);
+        if (ret < 0) {
+            break;
         }
 
-        cJSON_Delete(block_json);
-        free(serialized);
+        height += count;
+        if (height % CHAIN_SEGMENT_BLOCKS == 0) {
+            chain_store_seal();
+            chain_store_archive();
+        }
     }
-    return true;
-}
 
+    fs_wear_close(&file);
 
-/**
- * Print the contents of blockchain
- */
-void print_chain(void) {
-    for (int i = 0; i < block_count; i++) {
-        printf("Block %d:\n", i);
-        printf("  timestamp:   %s\n", chain[i].timestamp);
-        printf("  event:       %s\n", chain[i].event);
-        printf("  mag_meas:    %s\n", chain[i].mag_meas);
-        printf("  ultra_meas:  %s\n", chain[i].ultra_meas);
-        printf("  user:        %s\n", chain[i].user);
-        printf("  MAC:         %s\n", chain[i].MAC);
-        printf("  prev_hash:   %s\n", chain[i].prev_hash);
-        printf("  curr_hash:   %s\n\n", chain[i].curr_hash);
+    if (ret < 0) {
+        LOG_ERR("Segment split failed at block %u: %d", height, ret);
+        return;
     }
+
+    if (torn > 0) {
+        LOG_WRN("Cut %u torn bytes from the end of the unsegmented chain", torn);
+        recovery_pending = true;
+    }
+
+    fs_unlink(BLOCKCHAIN_UNSEGMENTED_FILE);
+    LOG_INF("Split %u blocks into segments.", height);
 }
 
 void blockchain_init(void) {
     struct fs_file_t file;
+    struct fs_dirent entry;
+
     fs_file_t_init(&file);
-    
-    int err = fs_open(&file, BLOCKCHAIN_FILE, FS_O_READ);
-    if (err < 0) {
-        if (err == -ENOENT) {
-            // File doesn't exist, create it
-            LOG_INF("Blockchain not found, creating new file...\n");
-            err = fs_open(&file, BLOCKCHAIN_FILE, FS_O_CREATE | FS_O_WRITE);
-            if (err < 0) {
-                LOG_ERR("Failed to create blockchain file: %d\n", err);
-                return;
+
+    // The archive volume is mounted by fs_init()
+    k_sem_take(&fs_ready_sem, K_FOREVER);
+    k_sem_give(&fs_ready_sem);
+
+    int64_t start = k_uptime_get();
+
+    int err = fs_stat(BLOCKCHAIN_FILE, &entry);
+    if (err == 0 && entry.size > 0) {
+        // Logs written before the binary format start with a JSON object
+        char first = 0;
+        if (fs_wear_open(&file, BLOCKCHAIN_FILE, FS_O_READ, FS_WEAR_CHAIN) == 0) {
+            fs_wear_read(&file, &first, 1);
+            fs_wear_close(&file);
+        }
+
+        if (first == '{') {
+            fs_rename(BLOCKCHAIN_FILE, BLOCKCHAIN_LEGACY_FILE);
+        } else if (entry.size > CHAIN_SEGMENT_SIZE + sizeof(chain_segment_trailer_t)) {
+            // Binary logs from before segments hold the whole chain, torn or
+            // not. A shorter one is already a valid first segment, with at
+            // most a torn record that the tail rebuild or an unfinished seal
+            // cuts off, since a trailer is smaller than a record.
+            fs_rename(BLOCKCHAIN_FILE, BLOCKCHAIN_UNSEGMENTED_FILE);
+        }
+    } else if (err < 0 && err != -ENOENT) {
+        LOG_ERR("Error opening blockchain file: %d\n", err);
+        return;
+    }
+
+    chain_store_init();
+    chain_migrate_legacy();
+    chain_migrate_unsegmented();
+
+    k_mutex_lock(&chain_mutex, K_FOREVER);
+    chain_tail_load();
+    k_mutex_unlock(&chain_mutex);
+
+    if (recovery_pending) {
+        // Record the recovery now rather than with the next event
+        chain_commit_batch(NULL, 0, true, NULL);
+    }
+
+    boot_ms = k_uptime_get() - start;
+    if (boot_ms > CHAIN_BOOT_BUDGET_MS) {
+        LOG_WRN("Chain restore took %u ms", boot_ms);
+    } else {
+        LOG_INF("Chain restored at height %u in %u ms", chain_height(), boot_ms);
+    }
+}
+
+/**
+ * Thread that persists queued blocks in order. Blocks that arrive within the
+ * commit window are written together with a single open/write/sync.
+ */
+void blockchain_writer_thread() {
+    static chain_write_req_t batch[CHAIN_COMMIT_MAX_BLOCKS];
+
+    blockchain_init();
+    k_sem_give(&chain_ready_sem);
+
+    // Segments sealed before a reset are archived once events are accepted
+    chain_store_archive();
+
+    for (;;) {
+        k_msgq_get(&chain_write_msgq, &batch[0], K_FOREVER);
+
+        size_t count = 1;
+        size_t max_blocks = atomic_get(&commit_max_blocks);
+        int64_t deadline = k_uptime_get() + atomic_get(&commit_window_ms);
+
+        while (count < max_blocks) {
+            int64_t remaining = deadline - k_uptime_get();
+            k_timeout_t wait = remaining > 0 ? K_MSEC(remaining) : K_NO_WAIT;
+
+            if (k_msgq_get(&chain_write_msgq, &batch[count], wait) < 0) {
+                break;
+            }
+            count++;
+        }
+
+        size_t committed;
+        int ret = chain_commit_batch(batch, count, true, &committed);
+
+        // A batch that failed part way still committed the blocks before it
+        if (committed > 0) {
+            uint32_t now = k_cycle_get_32();
+
+            atomic_add(&writer_written, committed);
+            atomic_inc(&writer_commits);
+            chain_ack(batch[0].ticket, batch[committed - 1].ticket, 0);
+            for (size_t i = 0; i < committed; i++) {
+                chain_stats_append(k_cyc_to_us_floor32(now - batch[i].queued_at));
             }
-            fs_close(&file);
-            return;
-        } else {
-            LOG_ERR("Error opening user blockchain file: %d\n", err);
-            return;
         }
+        // With every block on flash only a checkpoint after them failed,
+        // and that is written before the next event
+        if (ret < 0 && committed < count) {
+            atomic_add(&writer_failed, count - committed);
+            atomic_set(&writer_last_error, ret);
+            LOG_ERR("Failed to write %u blocks: %d", (unsigned)(count - committed), ret);
+            chain_ack(batch[committed].ticket, batch[count - 1].ticket, ret);
+        }
+
+        chain_store_archive();
     }
 }
 
@@ -276,11 +1979,15 @@ void blockchain_init(void) {
  * Thread that periodically checks blockchain
  */
 void blockchain_validation_thread() {
-    blockchain_init();
+    k_sem_take(&chain_ready_sem, K_FOREVER);
+
+    // Rebuilt here rather than at boot, as it grows with the chain. Queries
+    // scan the log until it is ready.
+    chain_index_sync(chain_height());
 
     for (;;) {
         k_msleep(15000);
-        if (!validate_chain_from_file()) {
+        if (!validate_chain_incremental()) {
             LOG_ERR("Blockchain tampered!");
         } else {
             LOG_INF("Blockchain valid.");
@@ -289,5 +1996,6 @@ void blockchain_validation_thread() {
 
 }
 
-// Definte and start validation thread
-K_THREAD_DEFINE(blockchain_thread_id, STACK_SIZE, blockchain_validation_thread, NULL, NULL, NULL, THREAD_PRIORITY, 0, 0);
\ No newline at end of file
+// Define and start writer and validation threads
+K_THREAD_DEFINE(blockchain_writer_id, STACK_SIZE, blockchain_writer_thread, NULL, NULL, NULL, WRITER_THREAD_PRIORITY, 0, 0);
+K_THREAD_DEFINE(blockchain_thread_id, STACK_SIZE, blockchain_validation_thread, NULL, NULL, NULL, VALIDATION_THREAD_PRIORITY, 0, 0);
@@ -0,0 +1,925 @@
+/*
+* @file     chain_bench.c
+* @brief    Blockchain Storage Benchmarks
+*/
+
+#include <zephyr/kernel.h>
+#include <string.h>
+#include <zephyr/storage/flash_map.h>
+#include <zephyr/fs/fs.h>
+#include <zephyr/sys/crc.h>
+#include <mbedtls/sha256.h>
+#include "blockchain.h"
+#include "fs.h"
+#include "chain_store.h"
+#include "chain_stats.h"
+#include "user_store.h"
+#include "chain_bench.h"
+
+#define ARCHIVE_PARTITION_SIZE FIXED_PARTITION_SIZE(archive_partition)
+
+// Records per fs_wear_write() while a benchmark chain is grown untimed
+#define BENCH_CHAIN_BATCH 8
+// Free blocks a run leaves for LittleFS metadata and copy-on-write
+#define BENCH_SPACE_MARGIN_BLOCKS 8
+
+// An event mix: who appears, which events, and how far apart
+typedef struct {
+    const char *name;
+    const char *const *users;
+    size_t user_count;
+    const uint8_t *events;
+    size_t event_count;
+    uint32_t max_gap;       /* Seconds between events, up to */
+    bool with_mac;          /* Users have a registered device */
+} bench_mix_t;
+
+static const char *const entry_users[] = { "alice", "bob", "carol", "dave" };
+static const uint8_t entry_events[] = {
+    BLOCK_EVENT_SUCCESS, BLOCK_EVENT_SUCCESS, BLOCK_EVENT_SUCCESS, BLOCK_EVENT_FAIL, BLOCK_EVENT_DISCONNECTION,
+};
+
+static const char *const alarm_users[] = { "Intruder", "Visitor" };
+static const uint8_t alarm_events[] = { BLOCK_EVENT_TAMPERING, BLOCK_EVENT_PRESENCE };
+
+// More users than the pack dictionary holds
+static const char *const crowd_users[] = {
+    "alice", "bob", "carol", "dave", "erin", "frank", "grace", "heidi", "ivan", "judy", "mallory", "niaj",
+};
+static const uint8_t crowd_events[] = {
+    BLOCK_EVENT_SUCCESS, BLOCK_EVENT_FAIL, BLOCK_EVENT_PRESENCE, BLOCK_EVENT_DISCONNECTION, BLOCK_EVENT_TAMPERING,
+};
+
+static const bench_mix_t bench_mixes[] = {
+    { "entry", entry_users, ARRAY_SIZE(entry_users), entry_events, ARRAY_SIZE(entry_events), 3600, true },
+    { "alarm", alarm_users, ARRAY_SIZE(alarm_users), alarm_events, ARRAY_SIZE(alarm_events), 30, false },
+    { "crowd", crowd_users, ARRAY_SIZE(crowd_users), crowd_events, ARRAY_SIZE(crowd_events), 600, true },
+};
+
+// Generated records, packed records and codec state, shell thread only
+static block_record_t bench_block;
+static block_record_t bench_unpacked;
+static uint8_t bench_packed[BLOCK_PACK_MAX_SIZE];
+static block_pack_ctx_t bench_pack_ctx;
+static block_pack_ctx_t bench_unpack_ctx;
+
+// A chain grown in CHAIN_BENCH_CHAIN_FILE, a block at a time
+typedef struct {
+    uint32_t height;
+    uint32_t seed;
+    uint8_t last_hash[HASH_LEN];
+    uint8_t group_hash[HASH_LEN];                           /* Hash before the open checkpoint group */
+    uint8_t leaves[CHAIN_CHECKPOINT_INTERVAL][HASH_LEN];   /* Open checkpoint group */
+} bench_chain_t;
+
+// The tail a cached append saves, as chain.tail is
+typedef struct {
+    uint32_t height;
+    uint8_t last_hash[HASH_LEN];
+} bench_tail_t;
+
+static bench_chain_t bench_chain;
+static block_record_t bench_records[BENCH_CHAIN_BATCH];
+// Every bench_chain_stride-th append latency of a chain benchmark
+static uint32_t bench_latencies[CHAIN_BENCH_CHAIN_SAMPLES];
+
+static uint32_t bench_random(uint32_t *state) {
+    // xorshift32, seeded the same every run so results compare
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+/**
+ * Generate the block at the given height of a mix, linked to prev_hash
+ */
+static void bench_generate(const bench_mix_t *mix, uint32_t height, uint32_t *seed, uint8_t *prev_hash) {
+    block_record_t *block = &bench_block;
+    uint32_t timestamp = block->timestamp;
+
+    memset(block, 0, sizeof(*block));
+    block->version = BLOCK_VERSION;
+    block->length = sizeof(block_record_t);
+    block->height = height;
+
+    if (height % CHAIN_GROUP_SIZE == CHAIN_CHECKPOINT_INTERVAL) {
+        block->event = BLOCK_EVENT_CHECKPOINT;
+        block->timestamp = timestamp;
+        // Roots are hashes, so they do not compress whatever they commit to
+        memcpy(block->merkle_root, prev_hash, HASH_LEN);
+    } else {
+        size_t user = bench_random(seed) % mix->user_count;
+
+        block->event = mix->events[bench_random(seed) % mix->event_count];
+        block->timestamp = timestamp + 1 + bench_random(seed) % mix->max_gap;
+        block->mag_meas = 200 + bench_random(seed) % 800;
+        block->ultra_meas = bench_random(seed) % 4 ? (int32_t)(300 + bench_random(seed) % 2000) : BLOCK_MEAS_NONE;
+        strncpy(block->user, mix->users[user], BLOCK_USER_LENGTH - 1);
+        if (mix->with_mac) {
+            uint8_t mac[6] = { 0xAA, 0xBB, 0xCC, 0xDD, 0xEE, user };
+            memcpy(block->mac, mac, sizeof(mac));
+        }
+    }
+
+    block_hash(block, prev_hash, block->hash);
+    memcpy(prev_hash, block->hash, HASH_LEN);
+}
+
+void chain_bench_pack(const struct shell *shell, uint32_t events_per_day) {
+    const uint32_t blocks = CHAIN_BENCH_SEGMENTS * CHAIN_SEGMENT_BLOCKS;
+
+    shell_print(shell, "%u blocks per mix, %u events/day, archive partition %u KB",
+                blocks, events_per_day, (uint32_t)(ARCHIVE_PARTITION_SIZE / 1024));
+
+    for (size_t m = 0; m < ARRAY_SIZE(bench_mixes); m++) {
+        const bench_mix_t *mix = &bench_mixes[m];
+        uint8_t prev_hash[HASH_LEN] = {0};
+        uint32_t seed = 0x2545F491;
+        uint64_t pack_cycles = 0, unpack_cycles = 0;
+        uint32_t packed_bytes = 0;
+        bool intact = true;
+
+        bench_block.timestamp = 0;
+
+        for (uint32_t height = 0; height < blocks && intact; height++) {
+            // Archived segments are packed independently
+            if (height % CHAIN_SEGMENT_BLOCKS == 0) {
+                block_pack_init(&bench_pack_ctx, height);
+                block_pack_init(&bench_unpack_ctx, height);
+            }
+
+            bench_generate(mix, height, &seed, prev_hash);
+
+            uint32_t start = k_cycle_get_32();
+            int len = block_pack(&bench_pack_ctx, &bench_block, bench_packed);
+            uint32_t packed = k_cycle_get_32();
+            int used = block_unpack(&bench_unpack_ctx, bench_packed, len > 0 ? len : 0, &bench_unpacked);
+            uint32_t unpacked = k_cycle_get_32();
+
+            pack_cycles += packed - start;
+            unpack_cycles += unpacked - packed;
+            packed_bytes += MAX(len, 0);
+
+            // The CRC is set by the reader, everything before it must match
+            intact = len > 0 && used == len &&
+                     memcmp(&bench_block, &bench_unpacked, offsetof(block_record_t, crc)) == 0;
+        }
+
+        if (!intact) {
+            shell_error(shell, "%s: records did not unpack to themselves", mix->name);
+            continue;
+        }
+
+        uint32_t raw_bytes = blocks * sizeof(block_record_t);
+        // Hundredths of a byte per block and of the ratio
+        uint32_t per_block = packed_bytes * 100 / blocks;
+        uint32_t ratio = raw_bytes * 100 / packed_bytes;
+        uint32_t pack_ns = MAX(k_cyc_to_ns_floor64(pack_cycles) / blocks, 1);
+        uint32_t unpack_ns = MAX(k_cyc_to_ns_floor64(unpack_cycles) / blocks, 1);
+
+        shell_print(shell, "%s: %u.%02u bytes/block (%u.%02ux), pack %u ns/block (%u blocks/s), unpack %u ns/block (%u blocks/s)",
+                    mix->name, per_block / 100, per_block % 100, ratio / 100, ratio % 100,
+                    pack_ns, 1000000000 / pack_ns, unpack_ns, 1000000000 / unpack_ns);
+
+        if (events_per_day > 0) {
+            // Each event also carries its share of a checkpoint
+            uint64_t day_bytes = (uint64_t)packed_bytes * events_per_day * CHAIN_GROUP_SIZE /
+                                 (blocks * CHAIN_CHECKPOINT_INTERVAL);
+            uint64_t raw_day_bytes = (uint64_t)sizeof(block_record_t) * events_per_day * CHAIN_GROUP_SIZE /
+                                     CHAIN_CHECKPOINT_INTERVAL;
+
+            shell_print(shell, "  archive holds %u days packed, %u days raw (before file system overhead)",
+                        (uint32_t)(ARCHIVE_PARTITION_SIZE / MAX(day_bytes, 1)),
+                        (uint32_t)(ARCHIVE_PARTITION_SIZE / raw_day_bytes));
+        }
+    }
+}
+
+static char bench_line[BLOCK_JSON_SIZE];
+
+/**
+ * Whether a block read back from its JSON line records the same event
+ */
+static bool bench_json_matches(const block_record_t *block, const block_record_t *decoded) {
+    return decoded->event == block->event && decoded->timestamp == block->timestamp &&
+           decoded->mag_meas == block->mag_meas && decoded->ultra_meas == block->ultra_meas &&
+           memcmp(decoded->user, block->user, BLOCK_USER_LENGTH) == 0 &&
+           memcmp(decoded->mac, block->mac, sizeof(block->mac)) == 0;
+}
+
+void chain_bench_json(const struct shell *shell) {
+    const uint32_t blocks = CHAIN_BENCH_SEGMENTS * CHAIN_SEGMENT_BLOCKS;
+
+    shell_print(shell, "%u dashboard lines per mix", blocks / CHAIN_GROUP_SIZE * CHAIN_CHECKPOINT_INTERVAL);
+
+    for (size_t m = 0; m < ARRAY_SIZE(bench_mixes); m++) {
+        const bench_mix_t *mix = &bench_mixes[m];
+        uint8_t prev_hash[HASH_LEN] = {0};
+        uint8_t line_prev_hash[HASH_LEN];
+        uint32_t seed = 0x2545F491;
+        uint64_t encode_cycles = 0, decode_cycles = 0;
+        uint32_t lines = 0, line_bytes = 0;
+        bool same = true;
+
+        bench_block.timestamp = 0;
+
+        for (uint32_t height = 0; height < blocks && same; height++) {
+            memcpy(line_prev_hash, prev_hash, HASH_LEN);
+            bench_generate(mix, height, &seed, prev_hash);
+            if (bench_block.event == BLOCK_EVENT_CHECKPOINT) {
+                continue;
+            }
+
+            uint32_t start = k_cycle_get_32();
+            int len = block_to_json(&bench_block, line_prev_hash, bench_line, sizeof(bench_line));
+            uint32_t encoded = k_cycle_get_32();
+            int ret = len > 0 ? block_from_json(bench_line, len, &bench_unpacked) : len;
+            uint32_t decoded = k_cycle_get_32();
+
+            encode_cycles += encoded - start;
+            decode_cycles += decoded - encoded;
+            lines++;
+            line_bytes += MAX(len, 0);
+
+            same = ret == 0 && bench_json_matches(&bench_block, &bench_unpacked);
+        }
+
+        if (!same) {
+            shell_error(shell, "%s: a line did not read back as its block", mix->name);
+            continue;
+        }
+
+        uint32_t encode_ns = MAX(k_cyc_to_ns_floor64(encode_cycles) / lines, 1);
+        uint32_t decode_ns = MAX(k_cyc_to_ns_floor64(decode_cycles) / lines, 1);
+
+        shell_print(shell, "%s: %u bytes/line, encode %u ns/line (%u lines/s), decode %u ns/line (%u lines/s)",
+                    mix->name, line_bytes / lines, encode_ns, 1000000000 / encode_ns,
+                    decode_ns, 1000000000 / decode_ns);
+    }
+}
+
+/**
+ * Hash a block as blocks were hashed before the binary records: the SHA-256
+ * of its JSON line without curr_hash, as hex
+ */
+static int bench_hash_json(const block_record_t *block, const uint8_t *prev_hash, char *output) {
+    static const char curr_hash[] = ",\"curr_hash\"";
+    uint8_t hash[HASH_LEN];
+    mbedtls_sha256_context ctx;
+
+    int len = block_to_json(block, prev_hash, bench_line, sizeof(bench_line));
+    char *end = len > 0 ? strstr(bench_line, curr_hash) : NULL;
+    if (end == NULL) {
+        return -EINVAL;
+    }
+    // The line as it was before curr_hash was added to it
+    end[0] = '}';
+    end[1] = '\0';
+
+    mbedtls_sha256_init(&ctx);
+    mbedtls_sha256_starts(&ctx, 0);
+    mbedtls_sha256_update(&ctx, (const unsigned char *)bench_line, strlen(bench_line));
+    mbedtls_sha256_finish(&ctx, hash);
+    mbedtls_sha256_free(&ctx);
+
+    for (int i = 0; i < HASH_LEN; i++) {
+        sprintf(output + i * 2, "%02x", hash[i]);
+    }
+    return 0;
+}
+
+void chain_bench_hash(const struct shell *shell) {
+    const uint32_t blocks = CHAIN_BENCH_SEGMENTS * CHAIN_SEGMENT_BLOCKS;
+
+    shell_print(shell, "%u event blocks per mix", blocks / CHAIN_GROUP_SIZE * CHAIN_CHECKPOINT_INTERVAL);
+
+    for (size_t m = 0; m < ARRAY_SIZE(bench_mixes); m++) {
+        const bench_mix_t *mix = &bench_mixes[m];
+        uint8_t prev_hash[HASH_LEN] = {0};
+        uint8_t block_prev_hash[HASH_LEN];
+        uint8_t hash[HASH_LEN];
+        char hex[HASH_LEN * 2 + 1];
+        uint32_t seed = 0x2545F491;
+        uint64_t binary_cycles = 0, json_cycles = 0;
+        uint32_t hashes = 0;
+        bool same = true;
+
+        bench_block.timestamp = 0;
+
+        for (uint32_t height = 0; height < blocks && same; height++) {
+            memcpy(block_prev_hash, prev_hash, HASH_LEN);
+            bench_generate(mix, height, &seed, prev_hash);
+            if (bench_block.event == BLOCK_EVENT_CHECKPOINT) {
+                continue;
+            }
+
+            uint32_t start = k_cycle_get_32();
+            block_hash(&bench_block, block_prev_hash, hash);
+            uint32_t binary = k_cycle_get_32();
+            int ret = bench_hash_json(&bench_block, block_prev_hash, hex);
+            uint32_t json = k_cycle_get_32();
+
+            binary_cycles += binary - start;
+            json_cycles += json - binary;
+            hashes++;
+
+            same = ret == 0 && memcmp(hash, bench_block.hash, HASH_LEN) == 0;
+        }
+
+        if (!same) {
+            shell_error(shell, "%s: a block did not hash as it was generated", mix->name);
+            continue;
+        }
+
+        uint32_t binary_ns = MAX(k_cyc_to_ns_floor64(binary_cycles) / hashes, 1);
+        uint32_t json_ns = MAX(k_cyc_to_ns_floor64(json_cycles) / hashes, 1);
+        // Tenths of the binary hash's speed-up
+        uint32_t speedup = json_ns * 10 / binary_ns;
+
+        shell_print(shell, "%s: block_hash %u ns/block (%u blocks/s), JSON string %u ns/block (%u blocks/s), %u.%ux faster",
+                    mix->name, binary_ns, 1000000000 / binary_ns, json_ns, 1000000000 / json_ns,
+                    speedup / 10, speedup % 10);
+    }
+}
+
+/**
+ * The line reader this benchmark replaced: one read per byte
+ */
+static ssize_t bench_read_line_bytewise(struct fs_file_t *file, char *buf, size_t max_len) {
+    size_t total = 0;
+    char c;
+
+    while (total < max_len - 1) {
+        ssize_t r = fs_wear_read(file, &c, 1);
+        if (r <= 0 || c == '\n') {
+            break;
+        }
+        buf[total++] = c;
+    }
+    buf[total] = '\0';
+    return total > 0 ? total : -1;
+}
+
+static int bench_write_lines(uint32_t lines, uint32_t *bytes) {
+    struct fs_file_t file;
+    uint8_t prev_hash[HASH_LEN] = {0};
+    uint8_t line_prev_hash[HASH_LEN];
+    uint32_t seed = 0x2545F491;
+    uint32_t written = 0;
+
+    fs_file_t_init(&file);
+    int ret = fs_wear_open(&file, CHAIN_BENCH_LINES_FILE, FS_O_CREATE | FS_O_WRITE | FS_O_TRUNC, FS_WEAR_BENCH);
+    if (ret < 0) {
+        return ret;
+    }
+
+    *bytes = 0;
+    bench_block.timestamp = 0;
+    for (uint32_t height = 0; written < lines && ret >= 0; height++) {
+        memcpy(line_prev_hash, prev_hash, HASH_LEN);
+        bench_generate(&bench_mixes[0], height, &seed, prev_hash);
+        if (bench_block.event == BLOCK_EVENT_CHECKPOINT) {
+            continue;
+        }
+
+        int len = block_to_json(&bench_block, line_prev_hash, bench_line, sizeof(bench_line) - 1);
+        if (len < 0) {
+            ret = len;
+            break;
+        }
+        bench_line[len++] = '\n';
+        ret = fs_wear_write(&file, bench_line, len);
+        if (ret != len) {
+            ret = ret < 0 ? ret : -EIO;
+            break;
+        }
+        *bytes += len;
+        written++;
+    }
+
+    fs_wear_close(&file);
+    return ret < 0 ? ret : 0;
+}
+
+void chain_bench_lines(const struct shell *shell) {
+    static char reader_buf[FS_LINE_BUFFER_SIZE];
+    struct fs_file_t file;
+    fs_line_reader_t reader;
+    uint32_t bytes, bytewise_lines = 0, buffered_lines = 0;
+    uint32_t bytewise_sum = 0, buffered_sum = 0;
+    char *line;
+    ssize_t len;
+
+    int ret = bench_write_lines(CHAIN_BENCH_LINES, &bytes);
+    if (ret < 0) {
+        shell_error(shell, "Failed to write %s: %d", CHAIN_BENCH_LINES_FILE, ret);
+        fs_unlink(CHAIN_BENCH_LINES_FILE);
+        return;
+    }
+
+    fs_file_t_init(&file);
+    ret = fs_wear_open(&file, CHAIN_BENCH_LINES_FILE, FS_O_READ, FS_WEAR_BENCH);
+    if (ret < 0) {
+        shell_error(shell, "Failed to open %s: %d", CHAIN_BENCH_LINES_FILE, ret);
+        fs_unlink(CHAIN_BENCH_LINES_FILE);
+        return;
+    }
+    int64_t start = k_uptime_get();
+    while ((len = bench_read_line_bytewise(&file, bench_line, sizeof(bench_line))) > 0) {
+        bytewise_lines++;
+        bytewise_sum += len;
+    }
+    uint32_t bytewise_ms = k_uptime_get() - start;
+    fs_wear_close(&file);
+
+    ret = fs_wear_open(&file, CHAIN_BENCH_LINES_FILE, FS_O_READ, FS_WEAR_BENCH);
+    if (ret < 0) {
+        shell_error(shell, "Failed to open %s: %d", CHAIN_BENCH_LINES_FILE, ret);
+        fs_unlink(CHAIN_BENCH_LINES_FILE);
+        return;
+    }
+    fs_line_reader_init(&reader, &file, reader_buf, sizeof(reader_buf));
+    start = k_uptime_get();
+    while ((len = fs_line_reader_next(&reader, &line)) > 0) {
+        buffered_lines++;
+        buffered_sum += len;
+    }
+    uint32_t buffered_ms = k_uptime_get() - start;
+    fs_wear_close(&file);
+    fs_unlink(CHAIN_BENCH_LINES_FILE);
+
+    if (bytewise_lines != CHAIN_BENCH_LINES || buffered_lines != bytewise_lines || buffered_sum != bytewise_sum) {
+        shell_error(shell, "Readers disagree: %u lines of %u bytes byte-wise, %u lines of %u bytes buffered",
+                    bytewise_lines, bytewise_sum, buffered_lines, buffered_sum);
+        return;
+    }
+
+    shell_print(shell, "%u lines, %u bytes: byte-wise %u ms, buffered (%u byte buffer) %u ms, %ux faster",
+                CHAIN_BENCH_LINES, bytes, bytewise_ms, (uint32_t)sizeof(reader_buf), buffered_ms,
+                bytewise_ms / MAX(buffered_ms, 1));
+}
+
+static void bench_user(uint32_t index, user_change_t *user) {
+    memset(user, 0, sizeof(*user));
+    user->type = USER_CHANGE_ADD;
+    snprintf(user->alias, sizeof(user->alias), "user%u", index);
+    snprintf(user->mac, sizeof(user->mac), "02:00:00:00:%02X:%02X", (index >> 8) & 0xFF, index & 0xFF);
+    strcpy(user->passcode, "1234");
+}
+
+static int bench_user_line(uint32_t index) {
+    user_change_t user;
+
+    bench_user(index, &user);
+    return snprintf(bench_line, sizeof(bench_line), "{\"Alias\":\"%s\",\"MAC Address\":\"%s\",\"Passcode\":\"%s\"}\n",
+                    user.alias, user.mac, user.passcode);
+}
+
+/**
+ * Write a users.conf of the first count users, as the old scheme did on
+ * every add
+ */
+static int bench_users_write_conf(uint32_t count, uint32_t *bytes) {
+    struct fs_file_t file;
+
+    fs_file_t_init(&file);
+    int ret = fs_wear_open(&file, CHAIN_BENCH_USERS_CONF, FS_O_CREATE | FS_O_WRITE | FS_O_TRUNC, FS_WEAR_BENCH);
+    if (ret < 0) {
+        return ret;
+    }
+
+    for (uint32_t i = 0; i < count && ret >= 0; i++) {
+        int len = bench_user_line(i);
+        ret = fs_wear_write(&file, bench_line, len);
+        if (ret != len) {
+            ret = ret < 0 ? ret : -EIO;
+            break;
+        }
+        *bytes += len;
+    }
+
+    fs_wear_close(&file);
+    return ret < 0 ? ret : 0;
+}
+
+/**
+ * The users.conf scheme the user store replaced: each add rewrote every
+ * user's JSON line. Doing all of them would put megabytes on the archive
+ * flash, so the bytes are summed without writing, and only
+ * CHAIN_BENCH_USERS_SAMPLES rewrites spread over the run are timed and
+ * scaled up by bytes.
+ */
+static int bench_users_rewrite(uint32_t users, uint32_t *bytes, uint32_t *ms) {
+    uint32_t sample_bytes = 0;
+    uint64_t total = 0;
+
+    // User i is in the file for each add from its own onwards
+    for (uint32_t i = 0; i < users; i++) {
+        total += (uint64_t)bench_user_line(i) * (users - i);
+    }
+
+    int64_t start = k_uptime_get();
+    for (uint32_t sample = 1; sample <= CHAIN_BENCH_USERS_SAMPLES; sample++) {
+        uint32_t count = users * sample / CHAIN_BENCH_USERS_SAMPLES;
+
+        int ret = count > 0 ? bench_users_write_conf(count, &sample_bytes) : 0;
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    uint32_t sample_ms = k_uptime_get() - start;
+
+    *bytes = (uint32_t)MIN(total, UINT32_MAX);
+    *ms = (uint32_t)(total * sample_ms / MAX(sample_bytes, 1));
+    return 0;
+}
+
+static int bench_users_append(uint32_t users, uint32_t *bytes) {
+    user_change_t user;
+
+    *bytes = 0;
+    for (uint32_t i = 0; i < users; i++) {
+        bench_user(i, &user);
+        int ret = user_store_append(CHAIN_BENCH_USERS_LOG, &user, 1);
+        if (ret < 0) {
+            return ret;
+        }
+        *bytes += sizeof(user_store_record_t);
+    }
+    return 0;
+}
+
+static void bench_count_user(const user_change_t *change, void *ctx) {
+    (*(uint32_t *)ctx)++;
+}
+
+void chain_bench_users(const struct shell *shell, uint32_t users) {
+    uint32_t rewrite_bytes, rewrite_ms, append_bytes, replayed = 0;
+
+    fs_unlink(CHAIN_BENCH_USERS_CONF);
+    fs_unlink(CHAIN_BENCH_USERS_LOG);
+
+    int ret = bench_users_rewrite(users, &rewrite_bytes, &rewrite_ms);
+    fs_unlink(CHAIN_BENCH_USERS_CONF);
+    if (ret < 0) {
+        shell_error(shell, "Failed to write %s: %d", CHAIN_BENCH_USERS_CONF, ret);
+        return;
+    }
+
+    int64_t start = k_uptime_get();
+    ret = bench_users_append(users, &append_bytes);
+    uint32_t append_ms = k_uptime_get() - start;
+    if (ret == 0) {
+        ret = user_store_replay(CHAIN_BENCH_USERS_LOG, bench_count_user, &replayed);
+    }
+    fs_unlink(CHAIN_BENCH_USERS_LOG);
+    if (ret < 0) {
+        shell_error(shell, "Failed to write %s: %d", CHAIN_BENCH_USERS_LOG, ret);
+        return;
+    }
+    if (replayed != users) {
+        shell_error(shell, "Replayed %u of %u users", replayed, users);
+        return;
+    }
+
+    shell_print(shell, "%u users: users.conf rewrites ~%u ms (scaled from %u), %u bytes; users.log appends %u ms, %u bytes",
+                users, rewrite_ms, CHAIN_BENCH_USERS_SAMPLES, rewrite_bytes, append_ms, append_bytes);
+    shell_print(shell, "%ux fewer bytes, %ux faster", rewrite_bytes / MAX(append_bytes, 1),
+                rewrite_ms / MAX(append_ms, 1));
+}
+
+/**
+ * Check the bench volume has room for the bytes a run writes
+ */
+static int bench_check_space(const struct shell *shell, uint64_t bytes) {
+    struct fs_statvfs stat;
+
+    int ret = fs_statvfs(CHAIN_BENCH_VOLUME, &stat);
+    if (ret < 0) {
+        shell_error(shell, "Benchmark volume %s unavailable: %d", CHAIN_BENCH_VOLUME, ret);
+        return ret;
+    }
+
+    uint64_t free_bytes = (uint64_t)stat.f_bfree * stat.f_frsize;
+    if (bytes + BENCH_SPACE_MARGIN_BLOCKS * stat.f_frsize > free_bytes) {
+        shell_error(shell, "Benchmark needs %u KB, %s has %u KB free", (uint32_t)(bytes / 1024),
+                    CHAIN_BENCH_VOLUME, (uint32_t)(free_bytes / 1024));
+        return -ENOSPC;
+    }
+    return 0;
+}
+
+static void bench_chain_start(bench_chain_t *chain) {
+    memset(chain, 0, sizeof(*chain));
+    chain->seed = 0x2545F491;
+    bench_block.timestamp = 0;
+    fs_unlink(CHAIN_BENCH_CHAIN_FILE);
+    fs_unlink(CHAIN_BENCH_TAIL_FILE);
+}
+
+/**
+ * Generate the next block of the chain. Checkpoints carry the real root of
+ * their group, so the chain verifies as the device's own does.
+ */
+static void bench_chain_next(bench_chain_t *chain, block_record_t *block) {
+    uint8_t prev_hash[HASH_LEN];
+
+    memcpy(prev_hash, chain->last_hash, HASH_LEN);
+    if (chain->height % CHAIN_GROUP_SIZE == 0) {
+        memcpy(chain->group_hash, prev_hash, HASH_LEN);
+    }
+    bench_generate(&bench_mixes[0], chain->height, &chain->seed, chain->last_hash);
+
+    if (bench_block.event == BLOCK_EVENT_CHECKPOINT) {
+        block_merkle_root(chain->leaves, bench_block.merkle_root);
+        block_hash(&bench_block, prev_hash, bench_block.hash);
+        memcpy(chain->last_hash, bench_block.hash, HASH_LEN);
+    } else {
+        memcpy(chain->leaves[chain->height % CHAIN_GROUP_SIZE], bench_block.hash, HASH_LEN);
+    }
+
+    bench_block.crc = crc32_ieee((const uint8_t *)&bench_block, offsetof(block_record_t, crc));
+    *block = bench_block;
+    chain->height++;
+}
+
+/**
+ * Grow the chain to the given height untimed, several records per write
+ */
+static int bench_chain_grow(bench_chain_t *chain, uint32_t height) {
+    struct fs_file_t file;
+
+    fs_file_t_init(&file);
+    int ret = fs_wear_open(&file, CHAIN_BENCH_CHAIN_FILE, FS_O_CREATE | FS_O_WRITE | FS_O_APPEND, FS_WEAR_BENCH);
+    if (ret < 0) {
+        return ret;
+    }
+
+    while (chain->height < height && ret == 0) {
+        size_t count = MIN(height - chain->height, ARRAY_SIZE(bench_records));
+        ssize_t len = count * sizeof(block_record_t);
+
+        for (size_t i = 0; i < count; i++) {
+            bench_chain_next(chain, &bench_records[i]);
+        }
+        if (fs_wear_write(&file, bench_records, len) != len) {
+            ret = -EIO;
+        }
+    }
+
+    fs_wear_close(&file);
+    return ret;
+}
+
+/**
+ * Append one block and sync it, as the writer commits a block
+ */
+static int bench_chain_write(const block_record_t *block) {
+    struct fs_file_t file;
+
+    fs_file_t_init(&file);
+    int ret = fs_wear_open(&file, CHAIN_BENCH_CHAIN_FILE, FS_O_CREATE | FS_O_WRITE | FS_O_APPEND, FS_WEAR_BENCH);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (fs_wear_write(&file, block, sizeof(*block)) != sizeof(*block) || fs_wear_sync(&file) < 0) {
+        ret = -EIO;
+    }
+
+    fs_wear_close(&file);
+    return ret;
+}
+
+/**
+ * An append as add_block() makes it now: the height and last hash come from
+ * RAM, and the tail is saved after the block
+ */
+static int bench_append_cached(bench_chain_t *chain) {
+    struct fs_file_t file;
+    bench_tail_t tail;
+
+    bench_chain_next(chain, &bench_records[0]);
+    int ret = bench_chain_write(&bench_records[0]);
+    if (ret < 0) {
+        return ret;
+    }
+
+    tail.height = chain->height;
+    memcpy(tail.last_hash, chain->last_hash, HASH_LEN);
+
+    fs_file_t_init(&file);
+    ret = fs_wear_open(&file, CHAIN_BENCH_TAIL_FILE, FS_O_CREATE | FS_O_WRITE | FS_O_TRUNC, FS_WEAR_BENCH);
+    if (ret < 0) {
+        return ret;
+    }
+    if (fs_wear_write(&file, &tail, sizeof(tail)) != sizeof(tail)) {
+        ret = -EIO;
+    }
+    fs_wear_close(&file);
+    return ret;
+}
+
+/**
+ * An append as add_block() made it before the tail was cached: the whole
+ * log is read to find the last block before the new one is linked to it
+ */
+static int bench_append_rescan(bench_chain_t *chain) {
+    struct fs_file_t file;
+    block_record_t last = {0};
+    uint32_t height = 0;
+    ssize_t len;
+
+    fs_file_t_init(&file);
+    int ret = fs_wear_open(&file, CHAIN_BENCH_CHAIN_FILE, FS_O_READ, FS_WEAR_BENCH);
+    if (ret < 0) {
+        return ret;
+    }
+
+    while ((len = fs_wear_read(&file, bench_records, sizeof(bench_records))) > 0) {
+        size_t count = len / sizeof(block_record_t);
+
+        if (count > 0) {
+            last = bench_records[count - 1];
+            height += count;
+        }
+    }
+    fs_wear_close(&file);
+
+    if (len < 0) {
+        return len;
+    }
+    if (height != chain->height || memcmp(last.hash, chain->last_hash, HASH_LEN) != 0) {
+        return -EIO;
+    }
+
+    bench_chain_next(chain, &bench_records[0]);
+    return bench_chain_write(&bench_records[0]);
+}
+
+void chain_bench_append(const struct shell *shell, uint32_t max_height) {
+    uint32_t first_ns = 0;
+    uint32_t levels = 0;
+
+    max_height = MIN(max_height, CHAIN_BENCH_APPEND_HEIGHT);
+    for (uint32_t height = 10; height <= max_height; height *= 10) {
+        levels++;
+    }
+
+    // The chain, plus the blocks each way of timing appends at each height
+    uint32_t blocks = max_height + levels * 2 * CHAIN_BENCH_APPEND_SAMPLES;
+    int ret = bench_check_space(shell, (uint64_t)blocks * sizeof(block_record_t));
+    if (ret < 0) {
+        return;
+    }
+
+    bench_chain_start(&bench_chain);
+    shell_print(shell, "%u appends each way per height, on %s", CHAIN_BENCH_APPEND_SAMPLES, CHAIN_BENCH_CHAIN_FILE);
+
+    for (uint32_t height = 10; height <= max_height && ret == 0; height *= 10) {
+        uint64_t cached_cycles = 0, rescan_cycles = 0;
+
+        ret = bench_chain_grow(&bench_chain, height);
+
+        for (int i = 0; i < CHAIN_BENCH_APPEND_SAMPLES && ret == 0; i++) {
+            uint32_t start = k_cycle_get_32();
+            ret = bench_append_cached(&bench_chain);
+            uint32_t cached = k_cycle_get_32();
+
+            if (ret == 0) {
+                ret = bench_append_rescan(&bench_chain);
+            }
+            uint32_t rescanned = k_cycle_get_32();
+
+            cached_cycles += cached - start;
+            rescan_cycles += rescanned - cached;
+        }
+        if (ret < 0) {
+            break;
+        }
+
+        uint32_t cached_us = k_cyc_to_ns_floor64(cached_cycles) / CHAIN_BENCH_APPEND_SAMPLES / 1000;
+        uint32_t rescan_us = k_cyc_to_ns_floor64(rescan_cycles) / CHAIN_BENCH_APPEND_SAMPLES / 1000;
+        if (first_ns == 0) {
+            first_ns = MAX(cached_us, 1);
+        }
+
+        // Hundredths of the cached time at the first height
+        uint32_t growth = cached_us * 100 / first_ns;
+        shell_print(shell, "height %u: cached tail %u us/append (%u.%02ux height 10), rescanning the log %u us/append",
+                    height, cached_us, growth / 100, growth % 100, rescan_us);
+    }
+
+    fs_unlink(CHAIN_BENCH_CHAIN_FILE);
+    fs_unlink(CHAIN_BENCH_TAIL_FILE);
+
+    if (ret < 0) {
+        shell_error(shell, "Append benchmark failed at height %u: %d", bench_chain.height, ret);
+    }
+}
+
+/**
+ * Percentile of the sorted latency samples
+ */
+static uint32_t bench_percentile(uint32_t count, uint32_t percent) {
+    return count > 0 ? bench_latencies[(count - 1) * percent / 100] : 0;
+}
+
+/**
+ * Append a chain of the given length a block at a time, as the writer does,
+ * then verify all of it and the last checkpoint group, and print one JSON
+ * line with the append latencies, validation times, wear and heap peak
+ */
+static int bench_chain_run(const struct shell *shell, uint32_t blocks) {
+    static const uint8_t genesis[HASH_LEN] = {0};
+    static fs_wear_totals_t wear;
+    static char line[CHAIN_BENCH_JSON_SIZE];
+    // Keep at most CHAIN_BENCH_CHAIN_SAMPLES latencies, evenly spread
+    uint32_t stride = DIV_ROUND_UP(blocks, CHAIN_BENCH_CHAIN_SAMPLES);
+    uint32_t samples = 0, max_us = 0;
+    chain_stats_t stats;
+
+    int ret = bench_check_space(shell, (uint64_t)blocks * sizeof(block_record_t));
+    if (ret < 0) {
+        return ret;
+    }
+
+    bench_chain_start(&bench_chain);
+    fs_wear_get(&wear);
+    fs_wear_counters_t before = wear.callers[FS_WEAR_BENCH];
+
+    for (uint32_t i = 0; i < blocks && ret == 0; i++) {
+        uint32_t start = k_cycle_get_32();
+        ret = bench_append_cached(&bench_chain);
+        uint32_t us = k_cyc_to_ns_floor64(k_cycle_get_32() - start) / 1000;
+
+        max_us = MAX(max_us, us);
+        if (i % stride == 0) {
+            uint32_t j = samples++;
+
+            // Insertion sort, as chain_stats does for its samples
+            for (; j > 0 && bench_latencies[j - 1] > us; j--) {
+                bench_latencies[j] = bench_latencies[j - 1];
+            }
+            bench_latencies[j] = us;
+        }
+    }
+
+    uint32_t start = k_cycle_get_32();
+    int full = ret < 0 ? ret : chain_verify_file(CHAIN_BENCH_CHAIN_FILE, FS_WEAR_BENCH, 0, genesis);
+    uint32_t verified = k_cycle_get_32();
+
+    // The background pass after the last append restarts at its group
+    uint32_t from = (blocks - 1) - (blocks - 1) % CHAIN_GROUP_SIZE;
+    int incremental = full < 0 ? full : chain_verify_file(CHAIN_BENCH_CHAIN_FILE, FS_WEAR_BENCH, from, bench_chain.group_hash);
+    uint32_t reverified = k_cycle_get_32();
+
+    fs_wear_get(&wear);
+    const fs_wear_counters_t *after = &wear.callers[FS_WEAR_BENCH];
+    chain_stats_get(&stats);
+
+    fs_unlink(CHAIN_BENCH_CHAIN_FILE);
+    fs_unlink(CHAIN_BENCH_TAIL_FILE);
+
+    if (ret < 0) {
+        shell_error(shell, "Chain benchmark failed appending block %u: %d", bench_chain.height, ret);
+        return ret;
+    }
+    if (full != (int)blocks || incremental != (int)(blocks - from)) {
+        shell_error(shell, "Chain benchmark of %u blocks did not verify: %d", blocks, MIN(full, incremental));
+        return -EBADMSG;
+    }
+
+    ret = snprintf(line, sizeof(line),
+        "{\"bench\":{\"blocks\":%u,"
+        "\"append_us\":{\"count\":%u,\"p50\":%u,\"p90\":%u,\"p99\":%u,\"max\":%u},"
+        "\"validate_full\":{\"blocks\":%u,\"us\":%u},"
+        "\"validate_incremental\":{\"blocks\":%u,\"us\":%u},"
+        "\"bytes_written\":%llu,\"erases\":%u,\"heap_peak\":%u}}",
+        blocks, blocks, bench_percentile(samples, 50), bench_percentile(samples, 90),
+        bench_percentile(samples, 99), max_us,
+        full, (uint32_t)(k_cyc_to_ns_floor64(verified - start) / 1000),
+        incremental, (uint32_t)(k_cyc_to_ns_floor64(reverified - verified) / 1000),
+        (unsigned long long)(after->bytes_written - before.bytes_written),
+        after->erases - before.erases, stats.heap_peak);
+    if (ret >= (int)sizeof(line)) {
+        return -ENOMEM;
+    }
+
+    shell_print(shell, "%s", line);
+    return 0;
+}
+
+void chain_bench_chain(const struct shell *shell, uint32_t blocks) {
+    if (blocks > 0) {
+        bench_chain_run(shell, blocks);
+        return;
+    }
+
+    for (blocks = 10; blocks <= CHAIN_BENCH_CHAIN_BLOCKS; blocks *= 10) {
+        if (bench_chain_run(shell, blocks) < 0) {
+            return;
+        }
+    }
+}
@@ -0,0 +1,463 @@
+/*
+* @file     chain_index.c
+* @brief    Blockchain Query Index
+*/
+
+#include <zephyr/kernel.h>
+#include <string.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/fs/fs.h>
+#include "chain_index.h"
+
+LOG_MODULE_REGISTER(chain_index, LOG_LEVEL_INF);
+
+// Entries read or written per fs call, one zone
+#define CHAIN_INDEX_CHUNK CHAIN_INDEX_ZONE
+// Blocks read per fs call when rebuilding the index from the log
+#define CHAIN_INDEX_REBUILD_BATCH 4
+// Zone summaries read per fs call
+#define CHAIN_INDEX_ZONE_CHUNK 16
+// Log blocks an append reads to catch the index up after a failed append
+#define CHAIN_INDEX_RESYNC_BLOCKS 64
+
+K_MUTEX_DEFINE(index_mutex);
+// Entries in the index file, and whether they line up with the log
+static uint32_t index_count;
+static bool index_valid;
+// Set while chain_index_sync() runs, from boot until its first pass, as it
+// catches up with appends itself
+static bool index_syncing = true;
+// Height of the log after the last append, so a sync knows when it caught up
+static uint32_t index_log_height;
+// Complete zones in the zone file, and the summary of the partial zone after them
+static uint32_t zone_count;
+static chain_index_zone_t zone_open;
+// Entry and zone buffers, under index_mutex
+static chain_index_entry_t index_buf[CHAIN_INDEX_CHUNK];
+static chain_index_zone_t zone_buf[CHAIN_INDEX_ZONE_CHUNK];
+
+/**
+ * FNV-1a hash of a user name, folded to 16 bits. Collisions only cost an
+ * extra block read, since matches are checked against the block itself.
+ */
+uint16_t chain_index_user_key(const char *user) {
+    uint32_t hash = 2166136261u;
+
+    for (size_t i = 0; i < BLOCK_USER_LENGTH && user[i]; i++) {
+        hash ^= (uint8_t)user[i];
+        hash *= 16777619u;
+    }
+    return (uint16_t)(hash ^ (hash >> 16));
+}
+
+static void zone_reset(chain_index_zone_t *zone) {
+    memset(zone, 0, sizeof(*zone));
+    zone->from = UINT32_MAX;
+}
+
+static void zone_add(chain_index_zone_t *zone, const chain_index_entry_t *entry) {
+    zone->from = MIN(zone->from, entry->timestamp);
+    zone->to = MAX(zone->to, entry->timestamp);
+    zone->users |= BIT(entry->user_key % 32);
+    zone->events |= BIT(entry->event);
+}
+
+/**
+ * Append the summary of a zone that just filled up. Caller must hold
+ * index_mutex.
+ */
+static int zone_append(const chain_index_zone_t *zone) {
+    struct fs_file_t file;
+    fs_file_t_init(&file);
+
+    int ret = fs_wear_open(&file, CHAIN_INDEX_ZONE_FILE, FS_O_CREATE | FS_O_WRITE | FS_O_APPEND, FS_WEAR_INDEX);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (fs_wear_write(&file, zone, sizeof(*zone)) != sizeof(*zone)) {
+        ret = -EIO;
+    }
+    fs_wear_close(&file);
+
+    if (ret == 0) {
+        zone_count++;
+    }
+    return ret;
+}
+
+/**
+ * Line the zone file up with the first index_count entries of an open index
+ * file, summarising any complete zones it lacks, and refill zone_open. The
+ * file is left at its end. Caller must hold index_mutex.
+ */
+static int zones_load(struct fs_file_t *file) {
+    struct fs_file_t zones;
+    struct fs_dirent entry;
+
+    fs_file_t_init(&zones);
+
+    zone_count = fs_stat(CHAIN_INDEX_ZONE_FILE, &entry) == 0 ? entry.size / sizeof(chain_index_zone_t) : 0;
+    zone_count = MIN(zone_count, index_count / CHAIN_INDEX_ZONE);
+
+    int ret = fs_wear_open(&zones, CHAIN_INDEX_ZONE_FILE, FS_O_CREATE | FS_O_WRITE, FS_WEAR_INDEX);
+    if (ret < 0) {
+        return ret;
+    }
+    ret = fs_truncate(&zones, zone_count * sizeof(chain_index_zone_t));
+    fs_wear_close(&zones);
+
+    // Zones start on a chunk boundary, so each read is one zone
+    uint32_t next = zone_count * CHAIN_INDEX_ZONE;
+    zone_reset(&zone_open);
+    while (ret == 0 && next < index_count) {
+        uint32_t count = MIN(index_count - next, CHAIN_INDEX_CHUNK);
+        size_t len = count * sizeof(chain_index_entry_t);
+
+        if (fs_seek(file, next * sizeof(chain_index_entry_t), FS_SEEK_SET) < 0 ||
+            fs_wear_read(file, index_buf, len) != (ssize_t)len) {
+            ret = -EIO;
+            break;
+        }
+
+        for (uint32_t i = 0; i < count; i++) {
+            zone_add(&zone_open, &index_buf[i]);
+        }
+        next += count;
+        if (next % CHAIN_INDEX_ZONE == 0) {
+            ret = zone_append(&zone_open);
+            zone_reset(&zone_open);
+        }
+    }
+
+    if (ret == 0) {
+        ret = fs_seek(file, 0, FS_SEEK_END);
+    }
+    return ret;
+}
+
+/**
+ * Open the index for appending, cut back to index_count entries so any
+ * partly written entry is dropped, with the zones brought in line. Caller
+ * must hold index_mutex.
+ */
+static int index_open(struct fs_file_t *file) {
+    int ret = fs_wear_open(file, CHAIN_INDEX_FILE, FS_O_CREATE | FS_O_RDWR, FS_WEAR_INDEX);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = fs_truncate(file, index_count * sizeof(chain_index_entry_t));
+    if (ret == 0) {
+        ret = zones_load(file);
+    }
+    if (ret < 0) {
+        fs_wear_close(file);
+    }
+    return ret;
+}
+
+/**
+ * Write entries for records at the end of an open index file, appending a
+ * zone summary each time one fills up. Caller must hold index_mutex.
+ */
+static int index_write(struct fs_file_t *file, const block_record_t *records, size_t count) {
+    while (count > 0) {
+        size_t chunk = MIN(count, CHAIN_INDEX_CHUNK);
+
+        for (size_t i = 0; i < chunk; i++) {
+            index_buf[i].timestamp = records[i].timestamp;
+            index_buf[i].user_key = chain_index_user_key(records[i].user);
+            index_buf[i].event = records[i].event;
+            index_buf[i].reserved = 0;
+        }
+
+        size_t len = chunk * sizeof(chain_index_entry_t);
+        if (fs_wear_write(file, index_buf, len) != (ssize_t)len) {
+            return -EIO;
+        }
+
+        for (size_t i = 0; i < chunk; i++) {
+            zone_add(&zone_open, &index_buf[i]);
+            index_count++;
+            if (index_count % CHAIN_INDEX_ZONE == 0) {
+                int ret = zone_append(&zone_open);
+                zone_reset(&zone_open);
+                if (ret < 0) {
+                    return ret;
+                }
+            }
+        }
+
+        records += chunk;
+        count -= chunk;
+    }
+
+    return 0;
+}
+
+/**
+ * Catch the index up with a log of the given height after an append failed
+ * or was missed. At most CHAIN_INDEX_RESYNC_BLOCKS blocks are read back from
+ * the log, so the writer is not held up; the rest follow on later appends.
+ * Caller must hold index_mutex.
+ */
+static void index_resync(uint32_t height) {
+    struct fs_file_t file;
+    chain_reader_t reader;
+    block_record_t blocks[CHAIN_INDEX_REBUILD_BATCH];
+    uint32_t budget = CHAIN_INDEX_RESYNC_BLOCKS;
+
+    fs_file_t_init(&file);
+
+    // A torn write may have cut the log back below the index
+    index_count = MIN(index_count, height);
+
+    int ret = index_open(&file);
+    if (ret < 0) {
+        LOG_WRN("Chain index resync failed: %d", ret);
+        return;
+    }
+
+    chain_reader_init(&reader);
+    reader.caller = FS_WEAR_INDEX;
+
+    while (ret == 0 && index_count < height && budget > 0) {
+        uint32_t count = MIN(MIN(height - index_count, ARRAY_SIZE(blocks)), budget);
+        int read = chain_reader_read(&reader, index_count, blocks, count);
+
+        if (read <= 0) {
+            ret = read < 0 ? read : -EIO;
+            break;
+        }
+        ret = index_write(&file, blocks, read);
+        budget -= read;
+    }
+
+    chain_reader_close(&reader);
+    fs_wear_close(&file);
+
+    index_valid = ret == 0 && index_count == height;
+    if (ret < 0) {
+        LOG_WRN("Chain index resync failed at block %u: %d", index_count, ret);
+    } else if (index_valid) {
+        LOG_INF("Chain index resynced at block %u", height);
+    }
+}
+
+void chain_index_append(const block_record_t *records, size_t count) {
+    struct fs_file_t file;
+    fs_file_t_init(&file);
+
+    k_mutex_lock(&index_mutex, K_FOREVER);
+
+    index_log_height = records[count - 1].height + 1;
+
+    if (index_syncing) {
+        // The rebuild indexes up to index_log_height before it finishes
+        k_mutex_unlock(&index_mutex);
+        return;
+    }
+
+    if (!index_valid || records[0].height != index_count) {
+        index_resync(records[0].height);
+    }
+
+    if (index_valid) {
+        int ret = fs_wear_open(&file, CHAIN_INDEX_FILE, FS_O_CREATE | FS_O_WRITE | FS_O_APPEND, FS_WEAR_INDEX);
+        if (ret == 0) {
+            ret = index_write(&file, records, count);
+            fs_wear_close(&file);
+        }
+
+        if (ret < 0) {
+            // Queries scan the log until the next append resyncs the index
+            LOG_WRN("Chain index append failed: %d", ret);
+            index_valid = false;
+        }
+    }
+
+    k_mutex_unlock(&index_mutex);
+}
+
+int chain_index_sync(uint32_t height) {
+    struct fs_file_t file;
+    struct fs_dirent entry;
+    chain_reader_t reader;
+    block_record_t blocks[CHAIN_INDEX_REBUILD_BATCH];
+
+    fs_file_t_init(&file);
+    chain_reader_init(&reader);
+    reader.caller = FS_WEAR_INDEX;
+
+    k_mutex_lock(&index_mutex, K_FOREVER);
+
+    index_valid = false;
+    index_syncing = true;
+    index_count = fs_stat(CHAIN_INDEX_FILE, &entry) == 0 ? entry.size / sizeof(chain_index_entry_t) : 0;
+    index_count = MIN(index_count, height);
+    index_log_height = MAX(index_log_height, height);
+
+    // Drops entries past the log and any partly written entry
+    int ret = index_open(&file);
+    if (ret < 0) {
+        index_syncing = false;
+        k_mutex_unlock(&index_mutex);
+        LOG_WRN("Chain index unavailable: %d", ret);
+        return ret;
+    }
+
+    uint32_t first = index_count;
+
+    // The lock is only held per batch, so appends are not held up while a
+    // long chain is indexed. Until the index catches up they only move the
+    // target height.
+    while (ret == 0 && index_count < index_log_height) {
+        uint32_t target = index_log_height;
+        k_mutex_unlock(&index_mutex);
+
+        int count = chain_reader_read(&reader, index_count, blocks, MIN(target - index_count, ARRAY_SIZE(blocks)));
+
+        k_mutex_lock(&index_mutex, K_FOREVER);
+        if (count <= 0) {
+            ret = count < 0 ? count : -EIO;
+            break;
+        }
+        ret = index_write(&file, blocks, count);
+    }
+
+    fs_wear_close(&file);
+    chain_reader_close(&reader);
+
+    index_valid = ret == 0;
+    index_syncing = false;
+    uint32_t missing = index_count - first;
+    k_mutex_unlock(&index_mutex);
+
+    if (ret < 0) {
+        LOG_ERR("Failed to rebuild chain index at block %u: %d", index_count, ret);
+    } else if (missing > 0) {
+        LOG_INF("Indexed %u blocks", missing);
+    }
+
+    return ret;
+}
+
+static bool index_entry_match(const chain_query_t *query, uint16_t user_key, const chain_index_entry_t *entry) {
+    if (query->event == BLOCK_EVENT_MAX ? entry->event == BLOCK_EVENT_CHECKPOINT : entry->event != query->event) {
+        return false;
+    }
+    if (query->user[0] && entry->user_key != user_key) {
+        return false;
+    }
+    return entry->timestamp >= query->from && entry->timestamp <= query->to;
+}
+
+bool chain_query_match(const chain_query_t *query, const block_record_t *block) {
+    if (query->event == BLOCK_EVENT_MAX ? block->event == BLOCK_EVENT_CHECKPOINT : block->event != query->event) {
+        return false;
+    }
+    if (query->user[0] && strncmp(query->user, block->user, BLOCK_USER_LENGTH) != 0) {
+        return false;
+    }
+    return block->timestamp >= query->from && block->timestamp <= query->to;
+}
+
+static bool index_zone_match(const chain_query_t *query, uint16_t user_key, const chain_index_zone_t *zone) {
+    uint16_t events = query->event == BLOCK_EVENT_MAX ? ~BIT(BLOCK_EVENT_CHECKPOINT) : BIT(query->event);
+
+    if (!(zone->events & events)) {
+        return false;
+    }
+    if (query->user[0] && !(zone->users & BIT(user_key % 32))) {
+        return false;
+    }
+    return zone->from <= query->to && zone->to >= query->from;
+}
+
+/**
+ * Walk back zone by zone from the cursor. A complete zone whose summary
+ * rules out the query is skipped without reading its entries, so a query
+ * for a rare event, user or time range reads little more than the zone
+ * file. Timestamps restart at each boot, so zones are checked by range
+ * rather than searched in order.
+ */
+int chain_index_next(const chain_query_t *query, uint32_t *cursor, uint32_t *height) {
+    struct fs_file_t file;
+    struct fs_file_t zones;
+    uint16_t user_key = chain_index_user_key(query->user);
+    // Zones held in zone_buf
+    uint32_t zones_first = 0;
+    uint32_t zones_held = 0;
+    int found = 0;
+
+    fs_file_t_init(&file);
+    fs_file_t_init(&zones);
+
+    k_mutex_lock(&index_mutex, K_FOREVER);
+
+    int ret = index_valid ? fs_wear_open(&file, CHAIN_INDEX_FILE, FS_O_READ, FS_WEAR_INDEX) : -ENODATA;
+    if (ret == 0) {
+        ret = fs_wear_open(&zones, CHAIN_INDEX_ZONE_FILE, FS_O_READ, FS_WEAR_INDEX);
+        if (ret < 0) {
+            fs_wear_close(&file);
+        }
+    }
+    if (ret < 0) {
+        k_mutex_unlock(&index_mutex);
+        return ret;
+    }
+
+    *cursor = MIN(*cursor, index_count);
+
+    while (*cursor > 0 && !found) {
+        uint32_t zone = (*cursor - 1) / CHAIN_INDEX_ZONE;
+        uint32_t first = zone * CHAIN_INDEX_ZONE;
+
+        if (zone < zone_count) {
+            if (zone < zones_first || zone >= zones_first + zones_held) {
+                // Read the chunk of zones ending at this one, the next ones back
+                zones_held = MIN(zone + 1, CHAIN_INDEX_ZONE_CHUNK);
+                zones_first = zone + 1 - zones_held;
+                size_t len = zones_held * sizeof(chain_index_zone_t);
+
+                if (fs_seek(&zones, zones_first * sizeof(chain_index_zone_t), FS_SEEK_SET) < 0 ||
+                    fs_wear_read(&zones, zone_buf, len) != (ssize_t)len) {
+                    found = -EIO;
+                    break;
+                }
+            }
+
+            if (!index_zone_match(query, user_key, &zone_buf[zone - zones_first])) {
+                *cursor = first;
+                continue;
+            }
+        }
+
+        uint32_t count = *cursor - first;
+        size_t len = count * sizeof(chain_index_entry_t);
+
+        if (fs_seek(&file, first * sizeof(chain_index_entry_t), FS_SEEK_SET) < 0 ||
+            fs_wear_read(&file, index_buf, len) != (ssize_t)len) {
+            found = -EIO;
+            break;
+        }
+
+        *cursor = first;
+        for (uint32_t i = count; i-- > 0;) {
+            if (index_entry_match(query, user_key, &index_buf[i])) {
+                // Resume below this entry on the next call
+                *height = first + i;
+                *cursor = first + i;
+                found = 1;
+                break;
+            }
+        }
+    }
+
+    fs_wear_close(&zones);
+    fs_wear_close(&file);
+    k_mutex_unlock(&index_mutex);
+
+    return found;
+}
@@ -0,0 +1,121 @@
+/*
+* @file     chain_stats.c
+* @brief    Blockchain Performance Counters
+*/
+
+#include <zephyr/kernel.h>
+#include <stdio.h>
+#include <string.h>
+#include <zephyr/fs/fs.h>
+#include <zephyr/sys/sys_heap.h>
+#include "blockchain.h"
+#include "chain_stats.h"
+
+// The heap behind k_malloc(), sized by CONFIG_HEAP_MEM_POOL_SIZE
+extern struct k_heap _system_heap;
+
+K_MUTEX_DEFINE(stats_mutex);
+// Append latencies, sample n at append_samples[n % CHAIN_STATS_SAMPLES]
+static uint32_t append_samples[CHAIN_STATS_SAMPLES];
+static uint32_t append_count;
+static uint32_t append_max;
+static uint32_t full_blocks, full_ms;
+static uint32_t incremental_blocks, incremental_ms;
+
+void chain_stats_append(uint32_t latency_us) {
+    k_mutex_lock(&stats_mutex, K_FOREVER);
+    append_samples[append_count % CHAIN_STATS_SAMPLES] = latency_us;
+    append_count++;
+    append_max = MAX(append_max, latency_us);
+    k_mutex_unlock(&stats_mutex);
+}
+
+void chain_stats_validated(bool full, uint32_t blocks, uint32_t ms) {
+    k_mutex_lock(&stats_mutex, K_FOREVER);
+    if (full) {
+        full_blocks = blocks;
+        full_ms = ms;
+    } else {
+        incremental_blocks = blocks;
+        incremental_ms = ms;
+    }
+    k_mutex_unlock(&stats_mutex);
+}
+
+static uint32_t volume_used(const char *mount_point) {
+    struct fs_statvfs stat;
+
+    if (fs_statvfs(mount_point, &stat) < 0) {
+        return 0;
+    }
+    return (stat.f_blocks - stat.f_bfree) * stat.f_frsize;
+}
+
+/**
+ * Percentiles of the recent append latencies. The samples are few, so an
+ * insertion sort of a copy is enough. Caller must hold stats_mutex.
+ */
+static void append_percentiles(chain_latency_t *latency) {
+    static uint32_t sorted[CHAIN_STATS_SAMPLES];
+    uint32_t count = MIN(append_count, CHAIN_STATS_SAMPLES);
+
+    memset(latency, 0, sizeof(*latency));
+    latency->count = append_count;
+    latency->max_us = append_max;
+    if (count == 0) {
+        return;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t value = append_samples[i];
+        uint32_t j = i;
+
+        for (; j > 0 && sorted[j - 1] > value; j--) {
+            sorted[j] = sorted[j - 1];
+        }
+        sorted[j] = value;
+    }
+
+    latency->p50_us = sorted[(count - 1) * 50 / 100];
+    latency->p90_us = sorted[(count - 1) * 90 / 100];
+    latency->p99_us = sorted[(count - 1) * 99 / 100];
+}
+
+void chain_stats_get(chain_stats_t *stats) {
+    struct sys_memory_stats heap;
+
+    memset(stats, 0, sizeof(*stats));
+    stats->height = chain_height();
+
+    k_mutex_lock(&stats_mutex, K_FOREVER);
+    append_percentiles(&stats->append);
+    stats->full_blocks = full_blocks;
+    stats->full_ms = full_ms;
+    stats->incremental_blocks = incremental_blocks;
+    stats->incremental_ms = incremental_ms;
+    k_mutex_unlock(&stats_mutex);
+
+    stats->lfs_used = volume_used("/lfs");
+    stats->ext_used = volume_used("/ext");
+
+    if (sys_heap_runtime_stats_get(&_system_heap.heap, &heap) == 0) {
+        stats->heap_peak = heap.max_allocated_bytes;
+        stats->heap_size = heap.allocated_bytes + heap.free_bytes;
+    }
+}
+
+int chain_stats_to_json(const chain_stats_t *stats, char *buf, size_t len) {
+    int ret = snprintf(buf, len,
+        "{\"stats\":{\"height\":%u,"
+        "\"append_us\":{\"count\":%u,\"p50\":%u,\"p90\":%u,\"p99\":%u,\"max\":%u},"
+        "\"validate_full\":{\"blocks\":%u,\"ms\":%u},"
+        "\"validate_incremental\":{\"blocks\":%u,\"ms\":%u},"
+        "\"lfs_used\":%u,\"ext_used\":%u,\"heap_peak\":%u,\"heap_size\":%u}}",
+        stats->height,
+        stats->append.count, stats->append.p50_us, stats->append.p90_us, stats->append.p99_us, stats->append.max_us,
+        stats->full_blocks, stats->full_ms,
+        stats->incremental_blocks, stats->incremental_ms,
+        stats->lfs_used, stats->ext_used, stats->heap_peak, stats->heap_size);
+
+    return ret < (int)len ? ret : -ENOMEM;
+}
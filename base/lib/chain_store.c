@@ -0,0 +1,701 @@
+/*
+* @file     chain_store.c
+* @brief    Segmented Blockchain Log Storage
+*/
+
+#include <zephyr/kernel.h>
+#include <stdio.h>
+#include <string.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/fs/fs.h>
+#include <zephyr/sys/crc.h>
+#include <mbedtls/sha256.h>
+#include "chain_store.h"
+
+LOG_MODULE_REGISTER(chain_store, LOG_LEVEL_INF);
+
+// Records per read when sealing or archiving a segment
+#define CHAIN_STORE_CHUNK 4
+// Most sealed segments moved to the archive per pass
+#define CHAIN_ARCHIVE_BATCH 4
+
+// Guards segment files while they are resolved, renamed or removed
+K_MUTEX_DEFINE(store_mutex);
+// Segment files held open by readers, under store_mutex
+static uint32_t open_readers;
+// A sealed segment may still be in internal flash, writer thread only
+static bool archive_pending = true;
+// Copy and packing buffers, writer thread only
+static block_record_t store_buf[CHAIN_STORE_CHUNK];
+static uint8_t store_packed[CHAIN_STORE_CHUNK * BLOCK_PACK_MAX_SIZE];
+static block_pack_ctx_t store_pack;
+static chain_reader_t store_reader;
+
+static void segment_hot_path(uint32_t segment, char *path) {
+    snprintf(path, CHAIN_SEGMENT_PATH_SIZE, CHAIN_SEGMENT_HOT_FMT, segment);
+}
+
+static void segment_archive_path(uint32_t segment, char *path) {
+    snprintf(path, CHAIN_SEGMENT_PATH_SIZE, CHAIN_SEGMENT_ARCHIVE_FMT, segment);
+}
+
+static bool path_exists(const char *path) {
+    struct fs_dirent entry;
+    return fs_stat(path, &entry) == 0;
+}
+
+static uint32_t trailer_crc(const chain_segment_trailer_t *trailer) {
+    return crc32_ieee((const uint8_t *)trailer, offsetof(chain_segment_trailer_t, crc));
+}
+
+/**
+ * Open the file holding a segment. A sealed segment is read from internal
+ * flash while it is still there, then from the archive.
+ */
+static int segment_acquire(uint32_t segment, struct fs_file_t *file, fs_wear_caller_t caller) {
+    char path[CHAIN_SEGMENT_PATH_SIZE];
+
+    k_mutex_lock(&store_mutex, K_FOREVER);
+
+    segment_hot_path(segment, path);
+    if (!path_exists(path)) {
+        segment_archive_path(segment, path);
+        if (!path_exists(path)) {
+            // Not sealed yet, so it is the active segment
+            strcpy(path, BLOCKCHAIN_FILE);
+        }
+    }
+
+    int ret = fs_wear_open(file, path, FS_O_READ, caller);
+    if (ret == 0) {
+        open_readers++;
+    }
+
+    k_mutex_unlock(&store_mutex);
+    return ret;
+}
+
+static void segment_release(struct fs_file_t *file) {
+    fs_wear_close(file);
+
+    k_mutex_lock(&store_mutex, K_FOREVER);
+    open_readers--;
+    k_mutex_unlock(&store_mutex);
+}
+
+void chain_reader_init(chain_reader_t *reader) {
+    fs_file_t_init(&reader->file);
+    reader->open = false;
+    reader->caller = FS_WEAR_CHAIN_READ;
+}
+
+/**
+ * Go back to the first record of a packed segment
+ */
+static int segment_rewind(chain_reader_t *reader) {
+    block_pack_init(&reader->pack, reader->segment * CHAIN_SEGMENT_BLOCKS);
+    reader->next = 0;
+    reader->buf_len = 0;
+    reader->buf_pos = 0;
+
+    return fs_seek(&reader->file, sizeof(chain_segment_header_t), FS_SEEK_SET);
+}
+
+/**
+ * Find out whether a newly opened segment file holds raw or packed records
+ */
+static int segment_attach(chain_reader_t *reader, uint32_t segment) {
+    chain_segment_header_t header;
+
+    reader->segment = segment;
+    reader->packed = fs_wear_read(&reader->file, &header, sizeof(header)) == sizeof(header) &&
+                     header.magic == CHAIN_SEGMENT_PACKED_MAGIC;
+
+    if (reader->packed && header.first_height != segment * CHAIN_SEGMENT_BLOCKS) {
+        return -EBADMSG;
+    }
+    return reader->packed ? segment_rewind(reader) : 0;
+}
+
+/**
+ * Unpack the next record of a packed segment, reading more of the file as
+ * needed
+ */
+static int segment_unpack(chain_reader_t *reader, block_record_t *block) {
+    for (;;) {
+        int ret = block_unpack(&reader->pack, &reader->buf[reader->buf_pos], reader->buf_len - reader->buf_pos, block);
+        if (ret >= 0) {
+            reader->buf_pos += ret;
+            reader->next++;
+            block->crc = crc32_ieee((const uint8_t *)block, offsetof(block_record_t, crc));
+            return 0;
+        }
+        if (ret != -EAGAIN) {
+            return ret;
+        }
+
+        // Keep the partial record and fill the rest of the buffer
+        reader->buf_len -= reader->buf_pos;
+        memmove(reader->buf, &reader->buf[reader->buf_pos], reader->buf_len);
+        reader->buf_pos = 0;
+
+        ssize_t len = fs_wear_read(&reader->file, &reader->buf[reader->buf_len], sizeof(reader->buf) - reader->buf_len);
+        if (len <= 0) {
+            return len < 0 ? len : -EIO;
+        }
+        reader->buf_len += len;
+    }
+}
+
+/**
+ * Read up to count records from index in the open segment
+ */
+static int segment_read(chain_reader_t *reader, uint32_t index, block_record_t *blocks, uint32_t count) {
+    count = MIN(count, CHAIN_SEGMENT_BLOCKS - index);
+
+    if (!reader->packed) {
+        int ret = fs_seek(&reader->file, (off_t)index * sizeof(block_record_t), FS_SEEK_SET);
+        if (ret < 0) {
+            return ret;
+        }
+
+        ssize_t len = fs_wear_read(&reader->file, blocks, count * sizeof(block_record_t));
+        if (len < 0) {
+            return len;
+        }
+        return len / sizeof(block_record_t);
+    }
+
+    // Packed records can only be reached by unpacking the ones before them
+    if (index < reader->next) {
+        int ret = segment_rewind(reader);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    while (reader->next < index + count) {
+        block_record_t skipped;
+        block_record_t *block = reader->next >= index ? &blocks[reader->next - index] : &skipped;
+
+        int ret = segment_unpack(reader, block);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    return count;
+}
+
+int chain_reader_read(chain_reader_t *reader, uint32_t height, block_record_t *blocks, uint32_t count) {
+    uint32_t segment = height / CHAIN_SEGMENT_BLOCKS;
+
+    if (reader->open && reader->segment != segment) {
+        chain_reader_close(reader);
+    }
+
+    if (!reader->open) {
+        int ret = segment_acquire(segment, &reader->file, reader->caller);
+        if (ret < 0) {
+            return ret;
+        }
+        reader->open = true;
+
+        ret = segment_attach(reader, segment);
+        if (ret < 0) {
+            chain_reader_close(reader);
+            return ret;
+        }
+    }
+
+    return segment_read(reader, height % CHAIN_SEGMENT_BLOCKS, blocks, count);
+}
+
+void chain_reader_close(chain_reader_t *reader) {
+    if (reader->open) {
+        segment_release(&reader->file);
+        reader->open = false;
+    }
+}
+
+int chain_store_append(const block_record_t *records, size_t count) {
+    struct fs_file_t file;
+    size_t len = count * sizeof(block_record_t);
+
+    fs_file_t_init(&file);
+
+    int ret = fs_wear_open(&file, BLOCKCHAIN_FILE, FS_O_CREATE | FS_O_WRITE | FS_O_APPEND, FS_WEAR_CHAIN);
+    if (ret < 0) {
+        LOG_ERR("Failed to open blockchain file: %d", ret);
+        return ret;
+    }
+
+    if (fs_wear_write(&file, records, len) != (ssize_t)len || fs_wear_sync(&file) < 0) {
+        ret = -EIO;
+    }
+
+    fs_wear_close(&file);
+    return ret;
+}
+
+/**
+ * Hash the records of the active segment into its trailer
+ */
+static int segment_digest(struct fs_file_t *file, chain_segment_trailer_t *trailer) {
+    mbedtls_sha256_context ctx;
+    int ret = 0;
+
+    mbedtls_sha256_init(&ctx);
+    mbedtls_sha256_starts(&ctx, 0);
+
+    for (uint32_t i = 0; i < CHAIN_SEGMENT_BLOCKS; i += CHAIN_STORE_CHUNK) {
+        uint32_t count = MIN(CHAIN_STORE_CHUNK, CHAIN_SEGMENT_BLOCKS - i);
+        size_t len = count * sizeof(block_record_t);
+
+        if (fs_wear_read(file, store_buf, len) != (ssize_t)len) {
+            ret = -EIO;
+            break;
+        }
+
+        if (i == 0) {
+            trailer->first_height = store_buf[0].height;
+        }
+        trailer->last_height = store_buf[count - 1].height;
+        mbedtls_sha256_update(&ctx, (const uint8_t *)store_buf, len);
+    }
+
+    mbedtls_sha256_finish(&ctx, trailer->digest);
+    mbedtls_sha256_free(&ctx);
+
+    return ret;
+}
+
+/**
+ * Rename a sealed active segment to its segment file
+ */
+static int segment_publish(const chain_segment_trailer_t *trailer) {
+    char path[CHAIN_SEGMENT_PATH_SIZE];
+    uint32_t segment = trailer->first_height / CHAIN_SEGMENT_BLOCKS;
+
+    segment_hot_path(segment, path);
+
+    k_mutex_lock(&store_mutex, K_FOREVER);
+    int ret = fs_rename(BLOCKCHAIN_FILE, path);
+    k_mutex_unlock(&store_mutex);
+
+    if (ret < 0) {
+        LOG_ERR("Failed to publish segment %u: %d", segment, ret);
+        return ret;
+    }
+
+    archive_pending = true;
+    LOG_INF("Sealed chain segment %u (blocks %u-%u)", segment, trailer->first_height, trailer->last_height);
+    return 0;
+}
+
+int chain_store_seal(void) {
+    struct fs_file_t file;
+    chain_segment_trailer_t trailer = { .magic = CHAIN_SEGMENT_MAGIC };
+
+    fs_file_t_init(&file);
+
+    int ret = fs_wear_open(&file, BLOCKCHAIN_FILE, FS_O_RDWR | FS_O_APPEND, FS_WEAR_CHAIN);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = segment_digest(&file, &trailer);
+    if (ret == 0) {
+        trailer.crc = trailer_crc(&trailer);
+        if (fs_wear_write(&file, &trailer, sizeof(trailer)) != sizeof(trailer) || fs_wear_sync(&file) < 0) {
+            ret = -EIO;
+        }
+    }
+
+    fs_wear_close(&file);
+
+    if (ret < 0) {
+        LOG_ERR("Failed to seal active segment: %d", ret);
+        return ret;
+    }
+
+    return segment_publish(&trailer);
+}
+
+/**
+ * Finish a seal interrupted after the trailer was written. A damaged
+ * trailer is cut off and the segment sealed again.
+ */
+static int segment_finish_seal(void) {
+    struct fs_file_t file;
+    chain_segment_trailer_t trailer;
+
+    fs_file_t_init(&file);
+
+    int ret = fs_wear_open(&file, BLOCKCHAIN_FILE, FS_O_RDWR, FS_WEAR_CHAIN);
+    if (ret < 0) {
+        return ret;
+    }
+
+    bool valid = fs_seek(&file, CHAIN_SEGMENT_SIZE, FS_SEEK_SET) == 0 &&
+                 fs_wear_read(&file, &trailer, sizeof(trailer)) == sizeof(trailer) &&
+                 trailer.magic == CHAIN_SEGMENT_MAGIC &&
+                 trailer.crc == trailer_crc(&trailer);
+
+    if (!valid) {
+        fs_truncate(&file, CHAIN_SEGMENT_SIZE);
+    }
+    fs_wear_close(&file);
+
+    return valid ? segment_publish(&trailer) : chain_store_seal();
+}
+
+int chain_store_trailer(uint32_t segment, chain_segment_trailer_t *trailer) {
+    struct fs_file_t file;
+    fs_file_t_init(&file);
+
+    int ret = segment_acquire(segment, &file, FS_WEAR_CHAIN_READ);
+    if (ret < 0) {
+        return ret;
+    }
+
+    // Last in the file, whether the records are raw or packed
+    ret = fs_seek(&file, -(off_t)sizeof(*trailer), FS_SEEK_END);
+    if (ret == 0 && fs_wear_read(&file, trailer, sizeof(*trailer)) != sizeof(*trailer)) {
+        ret = -EIO;
+    }
+
+    segment_release(&file);
+
+    if (ret == 0 && (trailer->magic != CHAIN_SEGMENT_MAGIC || trailer->crc != trailer_crc(trailer))) {
+        ret = -EBADMSG;
+    }
+
+    return ret;
+}
+
+/**
+ * Copy a sealed segment file as it is
+ */
+static int segment_copy(struct fs_file_t *src, struct fs_file_t *dst) {
+    ssize_t len;
+
+    while ((len = fs_wear_read(src, store_buf, sizeof(store_buf))) > 0) {
+        if (fs_wear_write(dst, store_buf, len) != len) {
+            return -EIO;
+        }
+    }
+    return len;
+}
+
+/**
+ * Write a sealed segment as a header, its packed records and its trailer.
+ * Returns -EINVAL if a record cannot be packed without changing it.
+ */
+static int segment_pack(struct fs_file_t *src, struct fs_file_t *dst, uint32_t segment) {
+    chain_segment_header_t header = {
+        .magic = CHAIN_SEGMENT_PACKED_MAGIC,
+        .first_height = segment * CHAIN_SEGMENT_BLOCKS,
+    };
+    chain_segment_trailer_t trailer;
+
+    block_pack_init(&store_pack, header.first_height);
+
+    if (fs_wear_write(dst, &header, sizeof(header)) != sizeof(header)) {
+        return -EIO;
+    }
+
+    for (uint32_t i = 0; i < CHAIN_SEGMENT_BLOCKS; i += CHAIN_STORE_CHUNK) {
+        uint32_t count = MIN(CHAIN_STORE_CHUNK, CHAIN_SEGMENT_BLOCKS - i);
+        size_t len = count * sizeof(block_record_t);
+        size_t packed = 0;
+
+        if (fs_wear_read(src, store_buf, len) != (ssize_t)len) {
+            return -EIO;
+        }
+
+        for (uint32_t j = 0; j < count; j++) {
+            int ret = block_pack(&store_pack, &store_buf[j], &store_packed[packed]);
+            if (ret < 0) {
+                return ret;
+            }
+            packed += ret;
+        }
+
+        if (fs_wear_write(dst, store_packed, packed) != (ssize_t)packed) {
+            return -EIO;
+        }
+    }
+
+    if (fs_wear_read(src, &trailer, sizeof(trailer)) != sizeof(trailer) ||
+        fs_wear_write(dst, &trailer, sizeof(trailer)) != sizeof(trailer)) {
+        return -EIO;
+    }
+
+    return 0;
+}
+
+/**
+ * Read back an archived segment and check its records against its trailer
+ */
+static int segment_check(const char *path, uint32_t segment) {
+    chain_segment_trailer_t trailer;
+    uint8_t digest[HASH_LEN];
+    mbedtls_sha256_context ctx;
+
+    chain_reader_init(&store_reader);
+
+    int ret = fs_wear_open(&store_reader.file, path, FS_O_READ, FS_WEAR_CHAIN);
+    if (ret < 0) {
+        return ret;
+    }
+
+    mbedtls_sha256_init(&ctx);
+    mbedtls_sha256_starts(&ctx, 0);
+
+    ret = segment_attach(&store_reader, segment);
+
+    for (uint32_t i = 0; ret == 0 && i < CHAIN_SEGMENT_BLOCKS; i += CHAIN_STORE_CHUNK) {
+        int count = segment_read(&store_reader, i, store_buf, CHAIN_STORE_CHUNK);
+        if (count != MIN(CHAIN_STORE_CHUNK, CHAIN_SEGMENT_BLOCKS - i)) {
+            ret = count < 0 ? count : -EIO;
+            break;
+        }
+        mbedtls_sha256_update(&ctx, (const uint8_t *)store_buf, count * sizeof(block_record_t));
+    }
+
+    mbedtls_sha256_finish(&ctx, digest);
+    mbedtls_sha256_free(&ctx);
+
+    if (ret == 0) {
+        ret = fs_seek(&store_reader.file, -(off_t)sizeof(trailer), FS_SEEK_END);
+    }
+    if (ret == 0 && (fs_wear_read(&store_reader.file, &trailer, sizeof(trailer)) != sizeof(trailer) ||
+                     trailer.magic != CHAIN_SEGMENT_MAGIC || trailer.crc != trailer_crc(&trailer) ||
+                     memcmp(digest, trailer.digest, HASH_LEN) != 0)) {
+        ret = -EBADMSG;
+    }
+
+    fs_wear_close(&store_reader.file);
+    return ret;
+}
+
+/**
+ * Copy a sealed segment to the archive volume, packing its records, then
+ * remove it from internal flash once the copy reads back intact. The
+ * internal copy is kept while a reader has a segment open.
+ */
+static int segment_archive(uint32_t segment) {
+    char src_path[CHAIN_SEGMENT_PATH_SIZE], dst_path[CHAIN_SEGMENT_PATH_SIZE];
+    struct fs_file_t src, dst;
+    int ret;
+
+    segment_hot_path(segment, src_path);
+    segment_archive_path(segment, dst_path);
+    fs_file_t_init(&src);
+    fs_file_t_init(&dst);
+
+    ret = fs_wear_open(&src, src_path, FS_O_READ, FS_WEAR_CHAIN);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = fs_wear_open(&dst, dst_path, FS_O_CREATE | FS_O_WRITE | FS_O_TRUNC, FS_WEAR_CHAIN);
+    if (ret < 0) {
+        fs_wear_close(&src);
+        return ret;
+    }
+
+    ret = CHAIN_ARCHIVE_PACKED ? segment_pack(&src, &dst, segment) : segment_copy(&src, &dst);
+    if (ret == -EINVAL) {
+        // Records that do not pack back to themselves are archived raw
+        LOG_WRN("Segment %u archived unpacked", segment);
+        ret = fs_seek(&src, 0, FS_SEEK_SET);
+        if (ret == 0) {
+            ret = fs_truncate(&dst, 0);
+        }
+        if (ret == 0) {
+            ret = fs_seek(&dst, 0, FS_SEEK_SET);
+        }
+        if (ret == 0) {
+            ret = segment_copy(&src, &dst);
+        }
+    }
+
+    if (ret == 0) {
+        ret = fs_wear_sync(&dst);
+    }
+    fs_wear_close(&dst);
+    fs_wear_close(&src);
+
+    if (ret == 0) {
+        ret = segment_check(dst_path, segment);
+    }
+
+    if (ret < 0) {
+        fs_unlink(dst_path);
+        return ret;
+    }
+
+    k_mutex_lock(&store_mutex, K_FOREVER);
+    ret = open_readers == 0 ? fs_unlink(src_path) : -EBUSY;
+    k_mutex_unlock(&store_mutex);
+
+    if (ret == 0) {
+        LOG_INF("Archived chain segment %u", segment);
+    }
+    return ret;
+}
+
+static bool segment_parse_name(const char *name, const char *prefix, uint32_t *segment) {
+    size_t prefix_len = strlen(prefix);
+    char suffix[4];
+
+    return strncmp(name, prefix, prefix_len) == 0 &&
+           sscanf(name + prefix_len, "%u.%3s", segment, suffix) == 2 &&
+           strcmp(suffix, "seg") == 0;
+}
+
+/**
+ * List the segment files in a directory. Up to max indices are stored in
+ * segments; returns how many files were found.
+ */
+static size_t segment_scan(const char *path, const char *prefix, uint32_t *segments, size_t max, uint32_t *highest) {
+    struct fs_dir_t dir;
+    struct fs_dirent entry;
+    size_t found = 0;
+
+    fs_dir_t_init(&dir);
+    if (fs_opendir(&dir, path) < 0) {
+        return 0;
+    }
+
+    while (fs_readdir(&dir, &entry) == 0 && entry.name[0] != '\0') {
+        uint32_t segment;
+
+        if (!segment_parse_name(entry.name, prefix, &segment)) {
+            continue;
+        }
+        if (found < max) {
+            segments[found] = segment;
+        }
+        if (highest && (found == 0 || segment > *highest)) {
+            *highest = segment;
+        }
+        found++;
+    }
+
+    fs_closedir(&dir);
+    return found;
+}
+
+void chain_store_archive(void) {
+    uint32_t segments[CHAIN_ARCHIVE_BATCH];
+
+    if (!archive_pending) {
+        return;
+    }
+
+    size_t found = segment_scan("/lfs", "chain.", segments, ARRAY_SIZE(segments), NULL);
+    archive_pending = found > ARRAY_SIZE(segments);
+
+    for (size_t i = 0; i < MIN(found, ARRAY_SIZE(segments)); i++) {
+        int ret = segment_archive(segments[i]);
+        if (ret == -EBUSY) {
+            archive_pending = true;
+        } else if (ret < 0) {
+            // Retried when the next segment is sealed
+            LOG_WRN("Segment %u stays in internal flash: %d", segments[i], ret);
+        }
+    }
+}
+
+uint32_t chain_store_sealed_count(void) {
+    uint32_t hot = 0, archived = 0;
+    bool any_hot = segment_scan("/lfs", "chain.", NULL, 0, &hot) > 0;
+    bool any_archived = segment_scan(CHAIN_ARCHIVE_DIR, "", NULL, 0, &archived) > 0;
+
+    if (!any_hot && !any_archived) {
+        return 0;
+    }
+    return MAX(any_hot ? hot : 0, any_archived ? archived : 0) + 1;
+}
+
+/**
+ * Remove every segment file in a directory, a batch per pass. Stops with the
+ * error if a pass removes nothing, rather than scanning the same files
+ * forever. Caller must hold store_mutex.
+ */
+static int segment_remove_all(const char *dir, const char *prefix, void (*segment_path)(uint32_t, char *)) {
+    uint32_t segments[CHAIN_ARCHIVE_BATCH];
+    char path[CHAIN_SEGMENT_PATH_SIZE];
+    size_t found;
+    int err;
+
+    do {
+        size_t removed = 0;
+
+        err = 0;
+        found = segment_scan(dir, prefix, segments, ARRAY_SIZE(segments), NULL);
+        for (size_t i = 0; i < MIN(found, ARRAY_SIZE(segments)); i++) {
+            segment_path(segments[i], path);
+            int ret = fs_unlink(path);
+            if (ret < 0) {
+                LOG_ERR("Failed to remove %s: %d", path, ret);
+                err = ret;
+            } else {
+                removed++;
+            }
+        }
+        if (found > 0 && removed == 0) {
+            return err;
+        }
+    } while (found > ARRAY_SIZE(segments));
+
+    return err;
+}
+
+int chain_store_reset(void) {
+    k_mutex_lock(&store_mutex, K_FOREVER);
+
+    int ret = fs_unlink(BLOCKCHAIN_FILE);
+    if (ret == -ENOENT) {
+        ret = 0;
+    }
+    if (ret == 0) {
+        ret = segment_remove_all("/lfs", "chain.", segment_hot_path);
+    }
+    if (ret == 0) {
+        ret = segment_remove_all(CHAIN_ARCHIVE_DIR, "", segment_archive_path);
+    }
+
+    k_mutex_unlock(&store_mutex);
+    return ret;
+}
+
+int chain_store_prepare(void) {
+    struct fs_dirent entry;
+
+    if (fs_stat(BLOCKCHAIN_FILE, &entry) < 0 || entry.size < CHAIN_SEGMENT_SIZE) {
+        return 0;
+    }
+
+    if (entry.size == CHAIN_SEGMENT_SIZE + sizeof(chain_segment_trailer_t)) {
+        return segment_finish_seal();
+    }
+    if (entry.size == CHAIN_SEGMENT_SIZE) {
+        return chain_store_seal();
+    }
+
+    LOG_ERR("Active chain segment has unexpected size %u", (unsigned)entry.size);
+    return -EFBIG;
+}
+
+void chain_store_init(void) {
+    int ret = fs_mkdir(CHAIN_ARCHIVE_DIR);
+    if (ret < 0 && ret != -EEXIST) {
+        LOG_WRN("Archive volume unavailable, segments stay in internal flash: %d", ret);
+    }
+
+    chain_store_prepare();
+}
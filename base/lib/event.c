@@ -34,8 +34,8 @@ static system_state_t current_state = STATE_IDLE;
 system_state_t previous_state = STATE_IDLE;
 static event_type_t current_event = EVENT_NONE;
 static int64_t current_event_time = 0;
-static char last_mag_meas[SENSOR_MEAS_LENGTH] = "N/A";
-static char last_ultra_meas[SENSOR_MEAS_LENGTH] = "N/A";
+static int32_t last_mag_meas = BLOCK_MEAS_NONE;
+static int32_t last_ultra_meas = BLOCK_MEAS_NONE;
 bool mobile_reconnect = false;
 bool clear_passcode = false;
 
@@ -361,7 +361,7 @@ int magnetometer_event(const char *data_str) {
     // Compare with baseline
     double diff_sq = fabs(mag_sq - MAG_BASELINE_SQ);
 
-    snprintf(last_mag_meas, sizeof(last_mag_meas), "%.3f", diff_sq);
+    last_mag_meas = (int32_t)lround(diff_sq * 1000.0);
 
     if (diff_sq > sensor_get_magnetometer_threshold()) {
         // Significant change detected
@@ -379,7 +379,7 @@ int ultrasonic_event(const char *data_str) {
         return -EINVAL; // Parsing error
     }
 
-    snprintf(last_ultra_meas, sizeof(last_ultra_meas), "%.3f", distance);
+    last_ultra_meas = (int32_t)lround(distance * 1000.0);
 
     if (distance <= sensor_get_ultrasonic_threshold()) {
         // Significant change detected
@@ -456,8 +456,8 @@ void handle_idle(void) {
     k_msleep(2500);
     mobile_reconnect = false;
     current_event = EVENT_NONE;
-    strcpy(last_ultra_meas, "N/A");
-    strcpy(last_mag_meas, "N/A");
+    last_ultra_meas = BLOCK_MEAS_NONE;
+    last_mag_meas = BLOCK_MEAS_NONE;
     transition_to(STATE_SENSOR_CONNECT);
 }
 
@@ -768,34 +768,35 @@ void handle_success(void) {
 
 // BLOCKCHAIN: Appends the event to the blockchain
 void handle_blockchain(void) {
-    char event_time[16];
-    snprintf(event_time, sizeof(event_time), "%lld", current_event_time);
-    
-	// Store the event on the blockchain
+    uint32_t event_time = (uint32_t)current_event_time;
+
+	// Queue the event for the blockchain writer
 	switch (previous_state) {
         case STATE_TAMPERING:
-            add_block(event_time, "TAMPERING", last_mag_meas, last_ultra_meas, "Intruder", "N/A");
-            LOG_INF("Tampering event added to blockchain.");
-            k_msleep(2000);
+            if (add_block(event_time, BLOCK_EVENT_TAMPERING, last_mag_meas, last_ultra_meas, "Intruder", NULL) > 0) {
+                LOG_INF("Tampering event queued for blockchain.");
+            }
             break;
         case STATE_PRESENCE:
-            add_block(event_time, "PRESENCE", last_mag_meas, last_ultra_meas, "Visitor", "N/A");
-            LOG_INF("Presence event added to blockchain.");
-            k_msleep(2000);
+            if (add_block(event_time, BLOCK_EVENT_PRESENCE, last_mag_meas, last_ultra_meas, "Visitor", NULL) > 0) {
+                LOG_INF("Presence event queued for blockchain.");
+            }
             break;
         case STATE_MOBILE_DISCONNECTION:
-            add_block(event_time, "DISCONNECTION", last_mag_meas, last_ultra_meas, current_user->alias, current_user->mac);
-            LOG_INF("User disconnect event added to blockchain.");
-            k_msleep(2000);
+            if (add_block(event_time, BLOCK_EVENT_DISCONNECTION, last_mag_meas, last_ultra_meas, current_user->alias, current_user->mac) > 0) {
+                LOG_INF("User disconnect event queued for blockchain.");
+            }
             break;
 		case STATE_FAIL:
-            add_block(event_time, "FAIL", last_mag_meas, last_ultra_meas, current_user->alias, current_user->mac);
-            LOG_INF("Fail event added to blockchain.");
-            k_msleep(2000);
+            if (add_block(event_time, BLOCK_EVENT_FAIL, last_mag_meas, last_ultra_meas, current_user->alias, current_user->mac) > 0) {
+                LOG_INF("Fail event queued for blockchain.");
+            }
             break;
 		case STATE_SUCCESS:
-            add_block(event_time, "SUCCESS", last_mag_meas, last_ultra_meas, current_user->alias, current_user->mac);
-            LOG_INF("Success event added to blockchain.");
+            if (add_block(event_time, BLOCK_EVENT_SUCCESS, last_mag_meas, last_ultra_meas, current_user->alias, current_user->mac) > 0) {
+                LOG_INF("Success event queued for blockchain.");
+            }
+            // Keep the door open for the user before locking it again
             k_msleep(2000);
             LOG_INF("Locking door!");
             servo_toggle();
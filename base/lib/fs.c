@@ -5,17 +5,44 @@
 */
 
 #include "fs.h"
+#include <zephyr/sys/crc.h>
+#include "fs_wear.h"
+#include "user_store.h"
+#include "chain_bench.h"
 
 #define CONFIG_USER_FILE_PATH "/lfs/users.conf"
 #define CONFIG_SENSOR_FILE_PATH "/lfs/sensors.conf"
 
+// A config file is rewritten as <path>.tmp and renamed over the old copy.
+#define CONFIG_TMP_SUFFIX ".tmp"
+#define CONFIG_PATH_SIZE 32
+
+// The first line of a config file, "#conf <version> <generation> <body bytes> <body CRC-32>".
+// The fields are fixed width so the header can be rewritten in place.
+#define CONFIG_FILE_VERSION 1
+#define CONFIG_HEADER_FORMAT "#conf %1u %010u %010u %08x\n"
+#define CONFIG_HEADER_SIZE 39
+
 #define STACK_SIZE 4096
 #define THREAD_PRIORITY 1
 
-static const struct json_obj_descr json_user_descr[] = {
-    JSON_OBJ_DESCR_PRIM_NAMED(user_config_t, "Alias", alias, JSON_TOK_STRING),
-    JSON_OBJ_DESCR_PRIM_NAMED(user_config_t, "MAC Address", mac, JSON_TOK_STRING),
-    JSON_OBJ_DESCR_PRIM_NAMED(user_config_t, "Passcode", passcode, JSON_TOK_STRING)
+// A users.conf line
+typedef struct {
+    char alias[USER_ALIAS_LENGTH];
+    char mac[MAC_ADDRESS_LENGTH];
+    char passcode[PASSCODE_LENGTH];
+} user_record_t;
+
+static const json_codec_field_t user_record_fields[] = {
+    JSON_CODEC_STRING(user_record_t, "Alias", alias),
+    JSON_CODEC_STRING(user_record_t, "MAC Address", mac),
+    JSON_CODEC_STRING(user_record_t, "Passcode", passcode),
+};
+
+// The sensors.conf line
+static const json_codec_field_t sensor_threshold_fields[] = {
+    JSON_CODEC_STRING(sensor_threshold_t, "Magnetometer Threshold", mag_threshold),
+    JSON_CODEC_STRING(sensor_threshold_t, "Ultrasonic Threshold", ultra_threshold),
 };
 
 FS_LITTLEFS_DECLARE_DEFAULT_CONFIG(storage);
@@ -26,108 +53,497 @@ static struct fs_mount_t lfs_storage_mnt = {
 	.mnt_point = "/lfs",
 };
 
-ssize_t fs_read_line(struct fs_file_t *file, char *buf, size_t max_len) {
-    size_t total = 0;
-    char c;
-    while (total < max_len - 1) {
-        ssize_t r = fs_read(file, &c, 1);
-        if (r <= 0) break;
-        if (c == '\n') break;
-        buf[total++] = c;
+// Sealed blockchain segments are archived to the QSPI NOR flash.
+FS_LITTLEFS_DECLARE_DEFAULT_CONFIG(archive);
+static struct fs_mount_t lfs_archive_mnt = {
+	.type = FS_LITTLEFS,
+	.fs_data = &archive,
+	.storage_dev = (void *)FIXED_PARTITION_ID(archive_partition),
+	.mnt_point = "/ext",
+};
+
+#ifdef CONFIG_CHAIN_BENCH
+// Scratch volume for the storage benchmarks, so they never write the archive
+FS_LITTLEFS_DECLARE_DEFAULT_CONFIG(bench);
+static struct fs_mount_t lfs_bench_mnt = {
+	.type = FS_LITTLEFS,
+	.fs_data = &bench,
+	.storage_dev = (void *)FIXED_PARTITION_ID(bench_partition),
+	.mnt_point = CHAIN_BENCH_VOLUME,
+};
+#endif
+
+K_SEM_DEFINE(fs_ready_sem, 0, 1);
+
+void fs_line_reader_init(fs_line_reader_t *reader, struct fs_file_t *file, char *buf, size_t size) {
+    reader->file = file;
+    reader->buf = buf;
+    reader->size = size;
+    reader->start = 0;
+    reader->end = 0;
+    reader->eof = false;
+    reader->skipping = false;
+}
+
+/**
+ * Move what is left of the buffer to its front and fill the rest from the
+ * file in one read. Returns the bytes read, 0 at end of file.
+ */
+static ssize_t fs_line_reader_fill(fs_line_reader_t *reader) {
+    if (reader->eof) {
+        return 0;
+    }
+
+    if (reader->start > 0) {
+        memmove(reader->buf, &reader->buf[reader->start], reader->end - reader->start);
+        reader->end -= reader->start;
+        reader->start = 0;
+    }
+
+    // One byte stays free to terminate a last line with no newline
+    ssize_t r = fs_wear_read(reader->file, &reader->buf[reader->end], reader->size - 1 - reader->end);
+    if (r <= 0) {
+        reader->eof = true;
+        return r;
     }
-    buf[total] = '\0';
-    return total > 0 ? total : -1;
+    reader->end += r;
+    return r;
 }
 
-// Initialise users when powered on.
-int fs_user_init(void) {
+/**
+ * Hand out the line at the front of the buffer, ending at len
+ */
+static ssize_t fs_line_reader_take(fs_line_reader_t *reader, size_t len, size_t used, char **line) {
+    char *head = &reader->buf[reader->start];
+
+    reader->start += used;
+    if (len > 0 && head[len - 1] == '\r') {
+        len--;
+    }
+    head[len] = '\0';
+    *line = head;
+    return len;
+}
+
+ssize_t fs_line_reader_next(fs_line_reader_t *reader, char **line) {
+    // Bytes before this offset hold no newline
+    size_t scanned = reader->start;
+
+    while (1) {
+        char *newline = memchr(&reader->buf[scanned], '\n', reader->end - scanned);
+
+        if (newline) {
+            size_t len = newline - &reader->buf[reader->start];
+
+            if (reader->skipping) {
+                // The end of a line too long to return
+                reader->skipping = false;
+                reader->start += len + 1;
+            } else {
+                ssize_t ret = fs_line_reader_take(reader, len, len + 1, line);
+                if (ret > 0) {
+                    return ret;
+                }
+            }
+            scanned = reader->start;
+            continue;
+        }
+
+        size_t pending = reader->end - reader->start;
+
+        if (reader->eof) {
+            // A last line with no newline
+            if (pending > 0 && !reader->skipping) {
+                ssize_t ret = fs_line_reader_take(reader, pending, pending, line);
+                if (ret > 0) {
+                    return ret;
+                }
+            }
+            reader->start = reader->end;
+            return 0;
+        }
+
+        if (pending == reader->size - 1) {
+            // No newline in a full buffer: drop the line, reporting it once
+            reader->start = reader->end;
+            pending = 0;
+            if (!reader->skipping) {
+                reader->skipping = true;
+                return -E2BIG;
+            }
+        }
+
+        ssize_t r = fs_line_reader_fill(reader);
+        if (r < 0) {
+            return r;
+        }
+        scanned = pending;
+    }
+}
+
+// Generation of the copy of each config file last loaded or written.
+static uint32_t config_generation[FS_CONFIG_FILES];
+
+// A config file being written to its temporary copy.
+typedef struct {
     struct fs_file_t file;
+    const char *path;
+    char tmp_path[CONFIG_PATH_SIZE];
+    uint32_t crc;           // Of the body so far
+    uint32_t len;
+    int err;                // First error, the rest of the writes are dropped
+} fs_config_writer_t;
+
+static void fs_config_tmp_path(const char *path, char *tmp_path) {
+    snprintf(tmp_path, CONFIG_PATH_SIZE, "%s" CONFIG_TMP_SUFFIX, path);
+}
+
+/**
+ * Start a new copy of a config file. A blank header holds its place until
+ * the body is written.
+ */
+static int fs_config_writer_open(fs_config_writer_t *writer, const char *path) {
+    char header[CONFIG_HEADER_SIZE + 1];
+
+    writer->path = path;
+    writer->crc = 0;
+    writer->len = 0;
+    writer->err = 0;
+    fs_config_tmp_path(path, writer->tmp_path);
+    fs_file_t_init(&writer->file);
+
+    int err = fs_wear_open(&writer->file, writer->tmp_path, FS_O_CREATE | FS_O_WRITE | FS_O_TRUNC, FS_WEAR_CONFIG);
+    if (err < 0) {
+        return err;
+    }
+
+    snprintf(header, sizeof(header), CONFIG_HEADER_FORMAT, 0, 0, 0, 0);
+    ssize_t written = fs_wear_write(&writer->file, header, CONFIG_HEADER_SIZE);
+    if (written != CONFIG_HEADER_SIZE) {
+        fs_wear_close(&writer->file);
+        fs_unlink(writer->tmp_path);
+        return written < 0 ? written : -ENOSPC;
+    }
+    return 0;
+}
+
+static void fs_config_writer_put(fs_config_writer_t *writer, const char *buf, size_t len) {
+    if (writer->err < 0) {
+        return;
+    }
+
+    ssize_t written = fs_wear_write(&writer->file, buf, len);
+    if (written != (ssize_t)len) {
+        writer->err = written < 0 ? written : -ENOSPC;
+        return;
+    }
+    writer->crc = crc32_ieee_update(writer->crc, (const uint8_t *)buf, len);
+    writer->len += len;
+}
+
+/**
+ * Seal the temporary copy with its header, sync it and rename it over the
+ * live file. Until the rename the old copy stays in place, and LittleFS
+ * renames atomically, so a reset leaves one whole copy or the other.
+ */
+static int fs_config_writer_commit(fs_config_writer_t *writer, uint32_t *generation) {
+    char header[CONFIG_HEADER_SIZE + 1];
+    int err = writer->err;
+
+    if (err == 0) {
+        snprintf(header, sizeof(header), CONFIG_HEADER_FORMAT, CONFIG_FILE_VERSION,
+                 (unsigned int)(*generation + 1), (unsigned int)writer->len, (unsigned int)writer->crc);
+        err = fs_seek(&writer->file, 0, FS_SEEK_SET);
+    }
+    if (err == 0) {
+        ssize_t written = fs_wear_write(&writer->file, header, CONFIG_HEADER_SIZE);
+        err = written == CONFIG_HEADER_SIZE ? 0 : (written < 0 ? written : -ENOSPC);
+    }
+    if (err == 0) {
+        err = fs_wear_sync(&writer->file);
+    }
+
+    int close_err = fs_wear_close(&writer->file);
+    err = err < 0 ? err : close_err;
+    if (err == 0) {
+        err = fs_rename(writer->tmp_path, writer->path);
+    }
+
+    if (err < 0) {
+        fs_unlink(writer->tmp_path);
+        return err;
+    }
+    (*generation)++;
+    return 0;
+}
+
+/**
+ * Check one copy of a config file against its header. A file with no header
+ * was written before headers were added and is taken as generation 0.
+ * Returns -EBADMSG for a torn or corrupt copy.
+ */
+static int fs_config_check(const char *path, uint32_t *generation) {
+    static char buf[FS_LINE_BUFFER_SIZE];
+    struct fs_file_t file;
+    unsigned int version, header_generation, len, crc;
+
     fs_file_t_init(&file);
+    int err = fs_wear_open(&file, path, FS_O_READ, FS_WEAR_CONFIG);
+    if (err < 0) {
+        return err;
+    }
+
+    ssize_t r = fs_wear_read(&file, buf, sizeof(buf) - 1);
+    if (r <= 0 || buf[0] != '#') {
+        fs_wear_close(&file);
+        *generation = 0;
+        return r < 0 ? r : 0;
+    }
+    if (r < CONFIG_HEADER_SIZE) {
+        fs_wear_close(&file);
+        return -EBADMSG;
+    }
+
+    buf[r] = '\0';
+    if (sscanf(buf, "#conf %u %u %u %x", &version, &header_generation, &len, &crc) != 4 ||
+        version != CONFIG_FILE_VERSION) {
+        fs_wear_close(&file);
+        return -EBADMSG;
+    }
+
+    uint32_t sum = crc32_ieee_update(0, (const uint8_t *)&buf[CONFIG_HEADER_SIZE], r - CONFIG_HEADER_SIZE);
+    uint32_t total = r - CONFIG_HEADER_SIZE;
+
+    while ((r = fs_wear_read(&file, buf, sizeof(buf))) > 0) {
+        sum = crc32_ieee_update(sum, (const uint8_t *)buf, r);
+        total += r;
+    }
+    fs_wear_close(&file);
+
+    if (r < 0) {
+        return r;
+    }
+    if (total != len || sum != crc) {
+        return -EBADMSG;
+    }
+    *generation = header_generation;
+    return 0;
+}
+
+/**
+ * Open the newest whole copy of a config file, moving a finished temporary
+ * copy into place if a reset came before its rename. Its header line starts
+ * with '#' and is skipped by the readers. Returns -ENOENT if there is none.
+ */
+static int fs_config_open(struct fs_file_t *file, const char *path, uint32_t *generation) {
+    char tmp_path[CONFIG_PATH_SIZE];
+    uint32_t live_generation, tmp_generation;
+
+    fs_config_tmp_path(path, tmp_path);
+    int live = fs_config_check(path, &live_generation);
+    int tmp = fs_config_check(tmp_path, &tmp_generation);
+
+    if (tmp == 0 && (live < 0 || tmp_generation > live_generation)) {
+        printk("Recovering %s from %s\n", path, tmp_path);
+        int err = fs_rename(tmp_path, path);
+        if (err < 0) {
+            return err;
+        }
+        live = 0;
+        live_generation = tmp_generation;
+    } else if (tmp != -ENOENT) {
+        // Torn, or older than the live copy
+        fs_unlink(tmp_path);
+    }
+
+    if (live < 0) {
+        if (live == -EBADMSG) {
+            printk("%s is corrupt, ignoring it\n", path);
+        }
+        return live == -EBADMSG ? -ENOENT : live;
+    }
+
+    *generation = live_generation;
+    fs_file_t_init(file);
+    return fs_wear_open(file, path, FS_O_READ, FS_WEAR_CONFIG);
+}
+
+// Records in users.log and the users they leave, under user_persist_lock once booted.
+static uint32_t store_records;
+static uint32_t store_users;
+
+static void fs_user_replay(const user_change_t *change, void *ctx) {
+    if (user_apply(change) != USER_SUCCESS) {
+        printk("Failed to apply stored change for user: %s\n", change->alias);
+    }
+}
+
+/**
+ * Rewrite users.log with one record per user. Every change queued so far is
+ * already in the list, so the queue is dropped. If the rewrite fails the next
+ * write tries again.
+ */
+static int fs_user_compact(void) {
+    user_store_writer_t writer;
+
+    int err = user_store_rewrite_begin(&writer, USER_STORE_FILE);
+    if (err < 0) {
+        atomic_set(&user_change_overflow, 1);
+        return err;
+    }
+
+    k_mutex_lock(&user_config_list_mutex, K_FOREVER);
+    k_msgq_purge(&user_change_msgq);
+    atomic_clear(&user_change_overflow);
+
+    sys_snode_t *node;
+    SYS_SLIST_FOR_EACH_NODE(&user_config_list, node) {
+        user_config_t *entry = CONTAINER_OF(node, user_config_t, node);
+        user_change_t change = { .type = USER_CHANGE_ADD };
+
+        strncpy(change.alias, entry->alias, sizeof(change.alias) - 1);
+        strncpy(change.mac, entry->mac, sizeof(change.mac) - 1);
+        strncpy(change.passcode, entry->passcode, sizeof(change.passcode) - 1);
+        user_store_rewrite_put(&writer, &change);
+    }
+
+    k_mutex_unlock(&user_config_list_mutex);
+
+    err = user_store_rewrite_end(&writer);
+    if (err < 0) {
+        atomic_set(&user_change_overflow, 1);
+        return err;
+    }
+    store_records = writer.records;
+    store_users = writer.records;
+    return 0;
+}
 
-    int err = fs_open(&file, CONFIG_USER_FILE_PATH, FS_O_READ);
+/**
+ * Load users.conf as written by earlier firmware, then move it to users.log
+ */
+static int fs_user_migrate(void) {
+    struct fs_file_t file;
+    uint32_t generation;
+
+    int err = fs_config_open(&file, CONFIG_USER_FILE_PATH, &generation);
     if (err < 0) {
         if (err == -ENOENT) {
-            // File doesn't exist, create it
-            printk("User config not found, creating new file...\n");
-            err = fs_open(&file, CONFIG_USER_FILE_PATH, FS_O_CREATE | FS_O_WRITE);
-            if (err < 0) {
-                printk("Failed to create user config file: %d\n", err);
-                return err;
-            }
-            fs_close(&file);
+            // Written on the first change
+            printk("User config not found, starting with no users\n");
             return 0;
-        } else {
-            printk("Error opening user config file: %d\n", err);
-            return err;
         }
+        printk("Error opening user config file: %d\n", err);
+        return err;
     }
 
-    char line_buf[256];
+    static char line_buf[FS_LINE_BUFFER_SIZE];
+    fs_line_reader_t reader;
+    char *line;
     ssize_t read_len;
-    user_config_t new_user;
+    user_record_t new_user;
 
-    while ((read_len = fs_read_line(&file, line_buf, sizeof(line_buf))) > 0) {
-        memset(&new_user, 0, sizeof(new_user));
+    fs_line_reader_init(&reader, &file, line_buf, sizeof(line_buf));
+    while ((read_len = fs_line_reader_next(&reader, &line)) != 0) {
+        if (read_len < 0) {
+            printk("Failed to read user config line: %d\n", (int)read_len);
+            if (read_len == -E2BIG) {
+                continue;
+            }
+            break;
+        }
+        if (line[0] == '#') {
+            continue;
+        }
 
-        int ret = json_obj_parse(line_buf, strlen(line_buf), json_user_descr, ARRAY_SIZE(json_user_descr), &new_user);
-        if (ret < 0) {
+        int ret = json_codec_decode(line, read_len, user_record_fields, ARRAY_SIZE(user_record_fields), &new_user);
+        if (ret != ARRAY_SIZE(user_record_fields)) {
             printk("Failed to parse JSON line: %d\n", ret);
             continue;
         }
 
-        // Add to your list using user_add
-        if (user_add(new_user.alias, new_user.mac, new_user.passcode) != 0) {
+        user_change_t change = { .type = USER_CHANGE_ADD };
+        strcpy(change.alias, new_user.alias);
+        strcpy(change.mac, new_user.mac);
+        strcpy(change.passcode, new_user.passcode);
+        if (user_apply(&change) != 0) {
             printk("Failed to add user to list: %s\n", new_user.alias);
         }
     }
 
-    fs_close(&file);
+    fs_wear_close(&file);
+
+    // users.conf goes only once users.log holds its users
+    err = fs_user_compact();
+    if (err < 0) {
+        printk("Failed to move users to %s: %d\n", USER_STORE_FILE, err);
+        return err;
+    }
+    fs_unlink(CONFIG_USER_FILE_PATH);
+    printk("Moved %u users from %s to %s\n", store_users, CONFIG_USER_FILE_PATH, USER_STORE_FILE);
+    return 0;
+}
+
+// Initialise users when powered on.
+int fs_user_init(void) {
+    int ret = user_store_replay(USER_STORE_FILE, fs_user_replay, NULL);
+    if (ret == -ENOENT) {
+        return fs_user_migrate();
+    }
+    if (ret < 0) {
+        printk("Error reading user store: %d\n", ret);
+        return ret;
+    }
+
+    store_records = ret;
+    k_mutex_lock(&user_config_list_mutex, K_FOREVER);
+    store_users = 0;
+    sys_snode_t *node;
+    SYS_SLIST_FOR_EACH_NODE(&user_config_list, node) {
+        store_users++;
+    }
+    k_mutex_unlock(&user_config_list_mutex);
+
+    // Left behind if a reset came between writing users.log and removing it
+    fs_unlink(CONFIG_USER_FILE_PATH);
     return 0;
 }
 
 // Initialise sensor thresholds when powered on.
 int fs_sensor_threshold_init(void) {
     struct fs_file_t file;
-    fs_file_t_init(&file);
 
-    int err = fs_open(&file, CONFIG_SENSOR_FILE_PATH, FS_O_READ);
+    int err = fs_config_open(&file, CONFIG_SENSOR_FILE_PATH, &config_generation[FS_CONFIG_SENSORS]);
     if (err < 0) {
         if (err == -ENOENT) {
-            // File doesn't exist, create it
-            printk("Sensor config not found, creating new file...\n");
-            err = fs_open(&file, CONFIG_SENSOR_FILE_PATH, FS_O_CREATE | FS_O_WRITE);
-            if (err < 0) {
-                printk("Failed to create sensor config file: %d\n", err);
-                return err;
-            }
-            fs_close(&file);
+            printk("Sensor config not found, keeping default thresholds\n");
             return 0;
-        } else {
-            printk("Error opening sensor config file: %d\n", err);
-            return err;
         }
+        printk("Error opening sensor config file: %d\n", err);
+        return err;
     }
 
-    char line_buf[256];
-    ssize_t read_len = fs_read_line(&file, line_buf, sizeof(line_buf));
-    fs_close(&file);
+    static char line_buf[FS_LINE_BUFFER_SIZE];
+    fs_line_reader_t reader;
+    char *line;
 
-    if (read_len < 0) {
+    fs_line_reader_init(&reader, &file, line_buf, sizeof(line_buf));
+    ssize_t read_len;
+    do {
+        read_len = fs_line_reader_next(&reader, &line);
+    } while (read_len > 0 && line[0] == '#');
+    fs_wear_close(&file);
+
+    if (read_len <= 0) {
         printk("Failed to read thresholds line from file\n");
         return -EIO;
     }
 
     sensor_threshold_t new_thresholds;
 
-    // Parse with sscanf assuming your format is:
-    // {"Magnetometer Threshold": "0.05", "Ultrasonic Threshold": "0.08"}
-
-    int res = sscanf(line_buf,
-        "{\"Magnetometer Threshold\": \"%[^\"]\", \"Ultrasonic Threshold\": \"%[^\"]\"}",
-        new_thresholds.mag_threshold,
-        new_thresholds.ultra_threshold);
-
-    if (res != 2) {
+    int res = json_codec_decode(line, read_len, sensor_threshold_fields, ARRAY_SIZE(sensor_threshold_fields),
+                                &new_thresholds);
+    if (res != ARRAY_SIZE(sensor_threshold_fields)) {
         printk("Failed to parse threshold values\n");
         return -EINVAL;
     }
@@ -142,78 +558,215 @@ void fs_init(void) {
     int rc;
     rc = fs_mount(&lfs_storage_mnt);
 
+    rc = fs_mount(&lfs_archive_mnt);
+    if (rc < 0) {
+        printk("Failed to mount archive volume: %d\n", rc);
+    }
+#ifdef CONFIG_CHAIN_BENCH
+    rc = fs_mount(&lfs_bench_mnt);
+    if (rc < 0) {
+        printk("Failed to mount benchmark volume: %d\n", rc);
+    }
+#endif
+    fs_wear_init();
+    k_sem_give(&fs_ready_sem);
+
     fs_user_init();
     fs_sensor_threshold_init();
 }
 
-// User file system thread.
-void fs_user_thread(void) {
+/**
+ * Append the queued user changes to users.log, a record each. The log is
+ * rewritten instead if a change was lost to a full queue, and compacted once
+ * superseded records outnumber the users plus USER_STORE_SLACK.
+ */
+static int fs_user_write(void) {
+    static user_change_t changes[USER_CHANGE_QUEUE_SIZE];
+    size_t count = 0;
+
+    if (atomic_get(&user_change_overflow)) {
+        return fs_user_compact();
+    }
 
-    while (1) {
-        k_sem_take(&user_list_update_sem, K_FOREVER);
+    while (count < ARRAY_SIZE(changes) && k_msgq_get(&user_change_msgq, &changes[count], K_NO_WAIT) == 0) {
+        count++;
+    }
+    if (count == 0) {
+        return 0;
+    }
 
-        struct fs_file_t file;
-        fs_file_t_init(&file);
+    int err = user_store_append(USER_STORE_FILE, changes, count);
+    if (err < 0) {
+        // These changes are now only in the list
+        atomic_set(&user_change_overflow, 1);
+        return err;
+    }
 
-        int err = fs_open(&file, CONFIG_USER_FILE_PATH, FS_O_CREATE | FS_O_WRITE | FS_O_TRUNC);
-        if (err < 0) {
-            printk("Failed to open file for writing: %d\n", err);
-            continue;
-        }
+    store_records += count;
+    for (size_t i = 0; i < count; i++) {
+        store_users += changes[i].type == USER_CHANGE_ADD ? 1 : -1;
+    }
 
-        sys_snode_t *node;
-        SYS_SLIST_FOR_EACH_NODE(&user_config_list, node) {
-            user_config_t *entry = CONTAINER_OF(node, user_config_t, node);
-            
-            char json_buf[256];
-            int len = json_obj_encode_buf(json_user_descr, ARRAY_SIZE(json_user_descr), entry, json_buf, sizeof(json_buf));
-            if (len < 0) {
-                printk("Failed to encode JSON: %d\n", len);
-                continue;
-            }
+    if (store_records - store_users > store_users + USER_STORE_SLACK) {
+        return fs_user_compact();
+    }
+    return 0;
+}
 
-            fs_write(&file, json_buf, strlen(json_buf));
-            fs_write(&file, "\n", 1);
-        }
+// Writes sensors.conf from the current thresholds.
+static int fs_sensor_write(void) {
+    sensor_threshold_t thresholds = *sensor_get_thresholds();
+
+    char json_buf[256];
+    int len = json_codec_encode(sensor_threshold_fields, ARRAY_SIZE(sensor_threshold_fields), &thresholds,
+                                json_buf, sizeof(json_buf) - 1);
 
-        fs_close(&file);
+    if (len < 0) {
+        printk("Failed to format sensor thresholds\n");
+        return len;
     }
+
+    fs_config_writer_t writer;
+
+    int err = fs_config_writer_open(&writer, CONFIG_SENSOR_FILE_PATH);
+    if (err < 0) {
+        printk("Failed to open file for writing: %d\n", err);
+        return err;
+    }
+
+    json_buf[len++] = '\n';
+    fs_config_writer_put(&writer, json_buf, len);
+
+    return fs_config_writer_commit(&writer, &config_generation[FS_CONFIG_SENSORS]);
 }
 
-// Sensor file system thread.
-void fs_sensor_thread(void) {
+// A config file and the changes to it not yet on flash.
+typedef struct {
+    const char *path;
+    struct k_sem *changed;      // Given once per change
+    int (*write)(void);
+    struct k_mutex *lock;       // Serialises writes from the thread and fs_config_sync()
+    uint32_t batch;             // Write without waiting for quiet once this many changes are pending, 0 for never
+    uint32_t pending;
+    fs_config_stats_t stats;
+} fs_persist_t;
+
+K_MUTEX_DEFINE(user_persist_lock);
+K_MUTEX_DEFINE(sensor_persist_lock);
+
+static fs_persist_t persist_files[FS_CONFIG_FILES] = {
+    [FS_CONFIG_USERS] = {
+        .path = USER_STORE_FILE,
+        .changed = &user_list_update_sem,
+        .write = fs_user_write,
+        .lock = &user_persist_lock,
+        // Leave room in the change queue while the batch is written
+        .batch = USER_CHANGE_QUEUE_SIZE / 2,
+    },
+    [FS_CONFIG_SENSORS] = {
+        .path = CONFIG_SENSOR_FILE_PATH,
+        .changed = &sensor_threshold_update_sem,
+        .write = fs_sensor_write,
+        .lock = &sensor_persist_lock,
+    },
+};
 
-    while (1) {
-        k_sem_take(&sensor_threshold_update_sem, K_FOREVER);
+static atomic_t persist_quiet_ms = ATOMIC_INIT(FS_PERSIST_QUIET_MS);
 
-        struct fs_file_t file;
-        fs_file_t_init(&file);
+// Counts the changes signalled so far. Caller must hold the file's lock.
+static void fs_persist_collect(fs_persist_t *file) {
+    while (k_sem_take(file->changed, K_NO_WAIT) == 0) {
+        file->pending++;
+        file->stats.changes++;
+    }
+}
 
-        int err = fs_open(&file, CONFIG_SENSOR_FILE_PATH, FS_O_CREATE | FS_O_WRITE | FS_O_TRUNC);
-        if (err < 0) {
-            printk("Failed to open file for writing: %d\n", err);
-            continue;
+// Writes the file if it has changed since it was last written.
+static int fs_persist_flush(fs_persist_t *file) {
+    int ret = 0;
+
+    k_mutex_lock(file->lock, K_FOREVER);
+    fs_persist_collect(file);
+    if (file->pending > 0) {
+        ret = file->write();
+        if (ret == 0) {
+            file->stats.writes++;
+            file->stats.saved += file->pending - 1;
+            file->pending = 0;
+        } else {
+            file->stats.failures++;
         }
+    }
+    k_mutex_unlock(file->lock);
+    return ret;
+}
 
-        const sensor_threshold_t *thresholds = sensor_get_thresholds();
+// Waits for a change, then for the file to stay unchanged for the quiet
+// period, so a burst of changes costs one write.
+static void fs_persist_thread(void *p1, void *p2, void *p3) {
+    fs_persist_t *file = p1;
 
-        char json_buf[256];
-        int len = snprintf(json_buf, sizeof(json_buf),
-            "{\"Magnetometer Threshold\": \"%s\", \"Ultrasonic Threshold\": \"%s\"}\n",
-            thresholds->mag_threshold, thresholds->ultra_threshold);
+    while (1) {
+        k_sem_take(file->changed, K_FOREVER);
+
+        k_mutex_lock(file->lock, K_FOREVER);
+        file->pending++;
+        file->stats.changes++;
+        k_mutex_unlock(file->lock);
+
+        while ((file->batch == 0 || file->pending < file->batch) &&
+               k_sem_take(file->changed, K_MSEC(atomic_get(&persist_quiet_ms))) == 0) {
+            k_mutex_lock(file->lock, K_FOREVER);
+            file->pending++;
+            file->stats.changes++;
+            k_mutex_unlock(file->lock);
+        }
 
-        if (len < 0 || len >= sizeof(json_buf)) {
-            printk("Failed to format sensor thresholds\n");
-            fs_close(&file);
-            continue;
+        if (fs_persist_flush(file) < 0) {
+            // Leave the changes pending, the next change or fs_config_sync() retries
+            printk("Failed to persist %s\n", file->path);
         }
+    }
+}
+
+int fs_config_sync(void) {
+    int ret = 0;
 
-        fs_write(&file, json_buf, strlen(json_buf));
+    for (int i = 0; i < FS_CONFIG_FILES; i++) {
+        int err = fs_persist_flush(&persist_files[i]);
+        ret = ret < 0 ? ret : err;
+    }
 
-        fs_close(&file);
+    // The wear counters are otherwise only saved hourly
+    int err = fs_wear_save();
+    if (err < 0 && err != -EAGAIN) {
+        printk("Failed to save %s: %d\n", FS_WEAR_FILE, err);
+        ret = ret < 0 ? ret : err;
     }
+    return ret;
+}
+
+void fs_config_set_quiet(uint32_t quiet_ms) {
+    atomic_set(&persist_quiet_ms, quiet_ms);
+}
+
+uint32_t fs_config_get_quiet(void) {
+    return atomic_get(&persist_quiet_ms);
+}
+
+void fs_config_stats(fs_config_file_t config, fs_config_stats_t *stats) {
+    fs_persist_t *file = &persist_files[config];
+
+    k_mutex_lock(file->lock, K_FOREVER);
+    *stats = file->stats;
+    stats->generation = config_generation[config];
+    stats->records = config == FS_CONFIG_USERS ? store_records : 0;
+    stats->pending = file->pending + k_sem_count_get(file->changed);
+    k_mutex_unlock(file->lock);
 }
 
 // Definte and start the thread.
-K_THREAD_DEFINE(fs_user_thread_id, STACK_SIZE, fs_user_thread, NULL, NULL, NULL, THREAD_PRIORITY, 0, 0);
-K_THREAD_DEFINE(fs_sensor_thread_id, STACK_SIZE, fs_sensor_thread, NULL, NULL, NULL, THREAD_PRIORITY, 0, 0);
\ No newline at end of file
+K_THREAD_DEFINE(fs_user_thread_id, STACK_SIZE, fs_persist_thread, &persist_files[FS_CONFIG_USERS], NULL, NULL,
+                THREAD_PRIORITY, 0, 0);
+K_THREAD_DEFINE(fs_sensor_thread_id, STACK_SIZE, fs_persist_thread, &persist_files[FS_CONFIG_SENSORS], NULL, NULL,
+                THREAD_PRIORITY, 0, 0);
@@ -0,0 +1,459 @@
+/*
+* @file     fs_wear.c
+* @brief    Flash Wear Telemetry
+*/
+
+#include <zephyr/kernel.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <zephyr/fs/fs.h>
+#include <zephyr/sys/crc.h>
+#include "SEGGER_RTT.h"
+#include "json_writer.h"
+#include "fs_wear.h"
+#include "chain_bench.h"
+
+#define STACK_SIZE 4096
+#define THREAD_PRIORITY 7
+
+#define FS_WEAR_MAGIC 0x52414557     /* "WEAR" */
+#define FS_WEAR_TMP_FILE FS_WEAR_FILE ".tmp"
+
+// A file open through fs_wear_open()
+typedef struct {
+    struct fs_file_t *file;     // NULL while the slot is free
+    uint8_t caller;
+    uint8_t slot;               // Its entry in wear.files
+    uint32_t block_size;
+    uint32_t unsynced;          // Bytes written since it was last synced
+} fs_wear_open_t;
+
+// FS_WEAR_FILE, always written whole
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    fs_wear_totals_t totals;
+    uint32_t crc;               // CRC-32 of all preceding bytes
+} fs_wear_saved_t;
+
+static const char *const caller_names[FS_WEAR_CALLERS] = {
+    [FS_WEAR_CHAIN] = "chain",
+    [FS_WEAR_CHAIN_READ] = "chain_read",
+    [FS_WEAR_VALIDATE] = "validate",
+    [FS_WEAR_INDEX] = "index",
+    [FS_WEAR_CONFIG] = "config",
+    [FS_WEAR_USERS] = "users",
+    [FS_WEAR_TELEMETRY] = "telemetry",
+    [FS_WEAR_BENCH] = "bench",
+    [FS_WEAR_UNTRACKED] = "untracked",
+};
+
+// Erase block size of each volume, read on first use
+static struct {
+    const char *mount;
+    uint32_t block_size;
+} wear_volumes[] = {
+    { "/lfs", 0 },
+    { "/ext", 0 },
+#ifdef CONFIG_CHAIN_BENCH
+    { CHAIN_BENCH_VOLUME, 0 },
+#endif
+};
+
+K_MUTEX_DEFINE(wear_mutex);
+// Counters since the device was first booted, seconds up to this boot
+static fs_wear_totals_t wear;
+static fs_wear_open_t wear_open[FS_WEAR_OPEN_FILES];
+// Synced bytes of each file not yet making up a whole erase block, across opens
+static uint32_t wear_programmed[FS_WEAR_FILES];
+// Files open without a slot, the bytes written to them since a sync, and the
+// synced bytes not yet making up a whole erase block. Their I/O is counted
+// against FS_WEAR_UNTRACKED rather than dropped.
+static uint32_t untracked_open;
+static uint32_t untracked_unsynced;
+static uint32_t untracked_programmed;
+// Nothing is saved until the counters from before this boot are added
+static bool wear_loaded;
+// Guards wear_saved and the save files, the shell saves as well as the thread
+K_MUTEX_DEFINE(wear_save_mutex);
+static fs_wear_saved_t wear_saved;
+
+static uint32_t fs_wear_block_size(const char *path) {
+    for (size_t i = 0; i < ARRAY_SIZE(wear_volumes); i++) {
+        size_t len = strlen(wear_volumes[i].mount);
+
+        if (strncmp(path, wear_volumes[i].mount, len) != 0 || path[len] != '/') {
+            continue;
+        }
+        if (wear_volumes[i].block_size == 0) {
+            struct fs_statvfs stat;
+
+            wear_volumes[i].block_size = fs_statvfs(wear_volumes[i].mount, &stat) == 0 && stat.f_frsize > 0
+                                             ? stat.f_frsize : FS_WEAR_DEFAULT_BLOCK_SIZE;
+        }
+        return wear_volumes[i].block_size;
+    }
+    return FS_WEAR_DEFAULT_BLOCK_SIZE;
+}
+
+/**
+ * The entry counting a file, by its path with each run of digits folded to
+ * '#'. Caller must hold wear_mutex.
+ */
+static uint8_t fs_wear_file_slot(const char *path) {
+    char name[FS_WEAR_NAME_SIZE];
+    size_t len = 0;
+
+    for (const char *c = path; *c != '\0' && len < sizeof(name) - 1; c++) {
+        if (isdigit((unsigned char)*c)) {
+            if (len > 0 && name[len - 1] == '#') {
+                continue;
+            }
+            name[len++] = '#';
+        } else {
+            name[len++] = *c;
+        }
+    }
+    name[len] = '\0';
+
+    for (uint32_t i = 0; i < wear.file_count; i++) {
+        if (strcmp(wear.files[i].name, name) == 0) {
+            return i;
+        }
+    }
+
+    if (wear.file_count < FS_WEAR_FILES - 1) {
+        strcpy(wear.files[wear.file_count].name, name);
+        return wear.file_count++;
+    }
+
+    // Everything else shares the last entry
+    if (wear.file_count < FS_WEAR_FILES) {
+        strcpy(wear.files[wear.file_count].name, "*");
+        wear.file_count++;
+    }
+    return FS_WEAR_FILES - 1;
+}
+
+static void fs_wear_add(fs_wear_counters_t *counters, const fs_wear_counters_t *delta) {
+    counters->bytes_read += delta->bytes_read;
+    counters->bytes_written += delta->bytes_written;
+    counters->opens += delta->opens;
+    counters->syncs += delta->syncs;
+    counters->erases += delta->erases;
+}
+
+// Count against the file's caller and the file itself. Caller must hold wear_mutex.
+static void fs_wear_count(const fs_wear_open_t *entry, const fs_wear_counters_t *delta) {
+    fs_wear_add(&wear.callers[entry->caller], delta);
+    fs_wear_add(&wear.files[entry->slot].counters, delta);
+}
+
+// Caller must hold wear_mutex.
+static fs_wear_open_t *fs_wear_find(const struct fs_file_t *file) {
+    for (size_t i = 0; i < ARRAY_SIZE(wear_open); i++) {
+        if (wear_open[i].file == file) {
+            return &wear_open[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Count I/O on a file with no slot. Only files opened while the table was
+ * full are counted, others were not opened through fs_wear_open(). Their
+ * block size is unknown, so erases assume FS_WEAR_DEFAULT_BLOCK_SIZE.
+ * Caller must hold wear_mutex.
+ */
+static void fs_wear_untracked(fs_wear_counters_t *delta, bool flushed) {
+    if (untracked_open == 0) {
+        return;
+    }
+
+    untracked_unsynced += delta->bytes_written;
+    if (flushed) {
+        untracked_programmed += untracked_unsynced;
+        untracked_unsynced = 0;
+        delta->syncs = 1;
+        delta->erases = untracked_programmed / FS_WEAR_DEFAULT_BLOCK_SIZE;
+        untracked_programmed %= FS_WEAR_DEFAULT_BLOCK_SIZE;
+    }
+    fs_wear_add(&wear.callers[FS_WEAR_UNTRACKED], delta);
+}
+
+/**
+ * Count an erase for each whole block the file's synced writes have filled.
+ * A small append is programmed into space erased with the rest of its block,
+ * so it only counts once a block's worth of them has built up, even across
+ * closes and reopens.
+ */
+static void fs_wear_flushed(fs_wear_open_t *entry) {
+    uint32_t *programmed = &wear_programmed[entry->slot];
+    fs_wear_counters_t delta = { .syncs = 1 };
+
+    *programmed += entry->unsynced;
+    delta.erases = *programmed / entry->block_size;
+    *programmed %= entry->block_size;
+
+    fs_wear_count(entry, &delta);
+    entry->unsynced = 0;
+}
+
+int fs_wear_open(struct fs_file_t *file, const char *path, fs_mode_t flags, fs_wear_caller_t caller) {
+    int ret = fs_open(file, path, flags);
+    if (ret < 0) {
+        return ret;
+    }
+
+    uint32_t block_size = fs_wear_block_size(path);
+
+    k_mutex_lock(&wear_mutex, K_FOREVER);
+    fs_wear_open_t *entry = fs_wear_find(NULL);
+    if (entry) {
+        entry->file = file;
+        entry->caller = caller;
+        entry->slot = fs_wear_file_slot(path);
+        entry->block_size = block_size;
+        entry->unsynced = 0;
+        fs_wear_count(entry, &(fs_wear_counters_t){ .opens = 1 });
+    } else {
+        untracked_open++;
+        fs_wear_untracked(&(fs_wear_counters_t){ .opens = 1 }, false);
+    }
+    k_mutex_unlock(&wear_mutex);
+    return ret;
+}
+
+ssize_t fs_wear_read(struct fs_file_t *file, void *buf, size_t len) {
+    ssize_t ret = fs_read(file, buf, len);
+    if (ret <= 0) {
+        return ret;
+    }
+
+    k_mutex_lock(&wear_mutex, K_FOREVER);
+    fs_wear_open_t *entry = fs_wear_find(file);
+    if (entry) {
+        fs_wear_count(entry, &(fs_wear_counters_t){ .bytes_read = ret });
+    } else {
+        fs_wear_untracked(&(fs_wear_counters_t){ .bytes_read = ret }, false);
+    }
+    k_mutex_unlock(&wear_mutex);
+    return ret;
+}
+
+ssize_t fs_wear_write(struct fs_file_t *file, const void *buf, size_t len) {
+    ssize_t ret = fs_write(file, buf, len);
+    if (ret <= 0) {
+        return ret;
+    }
+
+    k_mutex_lock(&wear_mutex, K_FOREVER);
+    fs_wear_open_t *entry = fs_wear_find(file);
+    if (entry) {
+        fs_wear_count(entry, &(fs_wear_counters_t){ .bytes_written = ret });
+        entry->unsynced += ret;
+    } else {
+        fs_wear_untracked(&(fs_wear_counters_t){ .bytes_written = ret }, false);
+    }
+    k_mutex_unlock(&wear_mutex);
+    return ret;
+}
+
+int fs_wear_sync(struct fs_file_t *file) {
+    int ret = fs_sync(file);
+    if (ret < 0) {
+        return ret;
+    }
+
+    k_mutex_lock(&wear_mutex, K_FOREVER);
+    fs_wear_open_t *entry = fs_wear_find(file);
+    if (entry) {
+        fs_wear_flushed(entry);
+    } else {
+        fs_wear_untracked(&(fs_wear_counters_t){0}, true);
+    }
+    k_mutex_unlock(&wear_mutex);
+    return ret;
+}
+
+int fs_wear_close(struct fs_file_t *file) {
+    int ret = fs_close(file);
+
+    k_mutex_lock(&wear_mutex, K_FOREVER);
+    fs_wear_open_t *entry = fs_wear_find(file);
+    if (entry) {
+        // Closing commits what is left unsynced
+        if (entry->unsynced > 0) {
+            fs_wear_flushed(entry);
+        }
+        entry->file = NULL;
+    } else if (untracked_open > 0) {
+        if (untracked_unsynced > 0) {
+            fs_wear_untracked(&(fs_wear_counters_t){0}, true);
+        }
+        untracked_open--;
+    }
+    k_mutex_unlock(&wear_mutex);
+    return ret;
+}
+
+const char *fs_wear_caller_name(fs_wear_caller_t caller) {
+    return caller < FS_WEAR_CALLERS ? caller_names[caller] : "?";
+}
+
+void fs_wear_get(fs_wear_totals_t *totals) {
+    k_mutex_lock(&wear_mutex, K_FOREVER);
+    *totals = wear;
+    k_mutex_unlock(&wear_mutex);
+    totals->seconds += k_uptime_get() / MSEC_PER_SEC;
+}
+
+void fs_wear_init(void) {
+    struct fs_file_t file;
+    ssize_t len = 0;
+
+    // A save cut short by a reset, the saved copy is still whole
+    fs_unlink(FS_WEAR_TMP_FILE);
+
+    fs_file_t_init(&file);
+    if (fs_wear_open(&file, FS_WEAR_FILE, FS_O_READ, FS_WEAR_TELEMETRY) == 0) {
+        len = fs_wear_read(&file, &wear_saved, sizeof(wear_saved));
+        fs_wear_close(&file);
+    }
+
+    bool valid = len == sizeof(wear_saved) && wear_saved.magic == FS_WEAR_MAGIC &&
+                 wear_saved.version == FS_WEAR_VERSION &&
+                 wear_saved.crc == crc32_ieee((const uint8_t *)&wear_saved, offsetof(fs_wear_saved_t, crc)) &&
+                 wear_saved.totals.file_count <= FS_WEAR_FILES;
+    if (!valid && len != 0) {
+        printk("Discarding unreadable %s\n", FS_WEAR_FILE);
+    }
+
+    k_mutex_lock(&wear_mutex, K_FOREVER);
+    if (valid) {
+        const fs_wear_totals_t *saved = &wear_saved.totals;
+
+        // Add rather than replace, files may have been counted before this
+        wear.boots = saved->boots;
+        wear.seconds = saved->seconds;
+        for (int i = 0; i < FS_WEAR_CALLERS; i++) {
+            fs_wear_add(&wear.callers[i], &saved->callers[i]);
+        }
+        for (uint32_t i = 0; i < saved->file_count; i++) {
+            char name[FS_WEAR_NAME_SIZE];
+
+            memcpy(name, saved->files[i].name, sizeof(name));
+            name[sizeof(name) - 1] = '\0';
+            fs_wear_add(&wear.files[fs_wear_file_slot(name)].counters, &saved->files[i].counters);
+        }
+    }
+    wear.boots++;
+    wear_loaded = true;
+    k_mutex_unlock(&wear_mutex);
+}
+
+/**
+ * Write to a temporary copy and rename it over the old one, so a reset while
+ * saving keeps the last save.
+ */
+int fs_wear_save(void) {
+    struct fs_file_t file;
+
+    if (!wear_loaded) {
+        return -EAGAIN;
+    }
+
+    k_mutex_lock(&wear_save_mutex, K_FOREVER);
+    fs_wear_get(&wear_saved.totals);
+    wear_saved.magic = FS_WEAR_MAGIC;
+    wear_saved.version = FS_WEAR_VERSION;
+    wear_saved.crc = crc32_ieee((const uint8_t *)&wear_saved, offsetof(fs_wear_saved_t, crc));
+
+    fs_file_t_init(&file);
+    int ret = fs_wear_open(&file, FS_WEAR_TMP_FILE, FS_O_CREATE | FS_O_WRITE | FS_O_TRUNC, FS_WEAR_TELEMETRY);
+    if (ret < 0) {
+        k_mutex_unlock(&wear_save_mutex);
+        return ret;
+    }
+
+    if (fs_wear_write(&file, &wear_saved, sizeof(wear_saved)) != sizeof(wear_saved) || fs_wear_sync(&file) < 0) {
+        ret = -EIO;
+    }
+    fs_wear_close(&file);
+
+    if (ret == 0) {
+        ret = fs_rename(FS_WEAR_TMP_FILE, FS_WEAR_FILE);
+    }
+    if (ret < 0) {
+        fs_unlink(FS_WEAR_TMP_FILE);
+    }
+    k_mutex_unlock(&wear_save_mutex);
+    return ret;
+}
+
+int fs_wear_to_json(const fs_wear_totals_t *totals, char *buf, size_t len) {
+    json_writer_t writer;
+
+    json_writer_init(&writer, buf, len);
+    json_writer_object_begin(&writer, NULL);
+    json_writer_object_begin(&writer, "wear");
+    json_writer_uint(&writer, "boots", totals->boots);
+    json_writer_uint(&writer, "seconds", totals->seconds);
+
+    // Each caller's counters, in the order of "fields"
+    json_writer_array_begin(&writer, "fields");
+    json_writer_string(&writer, NULL, "read");
+    json_writer_string(&writer, NULL, "written");
+    json_writer_string(&writer, NULL, "opens");
+    json_writer_string(&writer, NULL, "syncs");
+    json_writer_string(&writer, NULL, "erases");
+    json_writer_array_end(&writer);
+
+    json_writer_object_begin(&writer, "callers");
+    for (int i = 0; i < FS_WEAR_CALLERS; i++) {
+        const fs_wear_counters_t *counters = &totals->callers[i];
+
+        json_writer_array_begin(&writer, caller_names[i]);
+        json_writer_uint64(&writer, NULL, counters->bytes_read);
+        json_writer_uint64(&writer, NULL, counters->bytes_written);
+        json_writer_uint(&writer, NULL, counters->opens);
+        json_writer_uint(&writer, NULL, counters->syncs);
+        json_writer_uint(&writer, NULL, counters->erases);
+        json_writer_array_end(&writer);
+    }
+    json_writer_object_end(&writer);
+
+    json_writer_object_end(&writer);
+    json_writer_object_end(&writer);
+    return json_writer_finish(&writer);
+}
+
+void fs_wear_emit(void) {
+    static char line[FS_WEAR_JSON_SIZE];
+    fs_wear_totals_t totals;
+
+    fs_wear_get(&totals);
+    int len = fs_wear_to_json(&totals, line, sizeof(line) - 1);
+    if (len < 0) {
+        printk("Wear frame does not fit in %u bytes\n", (unsigned)sizeof(line));
+        return;
+    }
+
+    line[len++] = '\n';
+    SEGGER_RTT_Write(0, line, len);
+}
+
+static void fs_wear_thread(void *p1, void *p2, void *p3) {
+    while (1) {
+        k_sleep(K_SECONDS(FS_WEAR_SAVE_INTERVAL_S));
+
+        int ret = fs_wear_save();
+        if (ret < 0) {
+            printk("Failed to save %s: %d\n", FS_WEAR_FILE, ret);
+        }
+        fs_wear_emit();
+    }
+}
+
+K_THREAD_DEFINE(fs_wear_thread_id, STACK_SIZE, fs_wear_thread, NULL, NULL, NULL, THREAD_PRIORITY, 0, 0);
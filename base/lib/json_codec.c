@@ -0,0 +1,50 @@
+/*
+* @file     json_codec.c
+* @brief    Descriptor-driven JSON Codec for Persisted Records
+*/
+
+#include <errno.h>
+#include <string.h>
+#include "json_codec.h"
+#include "json_scan.h"
+#include "json_writer.h"
+
+int json_codec_encode(const json_codec_field_t *fields, size_t count, const void *record, char *buf, size_t len) {
+    json_writer_t writer;
+
+    json_writer_init(&writer, buf, len);
+    json_writer_object_begin(&writer, NULL);
+    for (size_t i = 0; i < count; i++) {
+        const char *value = (const char *)record + fields[i].offset;
+        json_writer_string_n(&writer, fields[i].key, value, fields[i].size);
+    }
+    json_writer_object_end(&writer);
+
+    return json_writer_finish(&writer);
+}
+
+int json_codec_decode(const char *text, size_t len, const json_codec_field_t *fields, size_t count, void *record) {
+    json_scan_field_t scan[JSON_CODEC_MAX_FIELDS];
+
+    if (count > JSON_CODEC_MAX_FIELDS) {
+        return -EINVAL;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        scan[i].key = fields[i].key;
+    }
+
+    int found = json_scan(text, len, scan, count);
+    if (found < 0) {
+        return found;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        char *value = (char *)record + fields[i].offset;
+
+        if (json_scan_string(&scan[i], value, fields[i].size) < 0) {
+            return -ENOMEM;
+        }
+    }
+    return found;
+}
@@ -0,0 +1,337 @@
+/*
+* @file     json_scan.c
+* @brief    In-place Field Scanner for One-line JSON Objects
+*/
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include "json_scan.h"
+
+// Cursor over the text, never read at or past end
+typedef struct {
+    const char *pos;
+    const char *end;
+} scan_t;
+
+static void skip_space(scan_t *scan) {
+    while (scan->pos < scan->end &&
+           (*scan->pos == ' ' || *scan->pos == '\t' || *scan->pos == '\r' || *scan->pos == '\n')) {
+        scan->pos++;
+    }
+}
+
+static bool accept(scan_t *scan, char c) {
+    skip_space(scan);
+    if (scan->pos < scan->end && *scan->pos == c) {
+        scan->pos++;
+        return true;
+    }
+    return false;
+}
+
+static bool is_hex(char c) {
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+}
+
+/**
+ * Step over a string whose opening quote was consumed. Sets the view to its
+ * raw contents.
+ */
+static bool scan_string(scan_t *scan, const char **value, size_t *len) {
+    const char *start = scan->pos;
+
+    while (scan->pos < scan->end) {
+        unsigned char c = *scan->pos;
+
+        if (c == '"') {
+            *value = start;
+            *len = scan->pos - start;
+            scan->pos++;
+            return true;
+        }
+        if (c < 0x20) {
+            return false;
+        }
+        if (c == '\\') {
+            if (scan->end - scan->pos < 2) {
+                return false;
+            }
+            char escape = scan->pos[1];
+            if (escape == 'u') {
+                if (scan->end - scan->pos < 6 || !is_hex(scan->pos[2]) || !is_hex(scan->pos[3]) ||
+                    !is_hex(scan->pos[4]) || !is_hex(scan->pos[5])) {
+                    return false;
+                }
+                scan->pos += 6;
+                continue;
+            }
+            // strchr() would match the terminator of the set
+            if (escape == '\0' || !strchr("\"\\/bfnrt", escape)) {
+                return false;
+            }
+            scan->pos += 2;
+            continue;
+        }
+        scan->pos++;
+    }
+    return false;
+}
+
+static bool scan_literal(scan_t *scan, const char *word) {
+    size_t len = strlen(word);
+
+    if ((size_t)(scan->end - scan->pos) < len || memcmp(scan->pos, word, len) != 0) {
+        return false;
+    }
+    scan->pos += len;
+    return true;
+}
+
+/**
+ * A number as JSON spells it: -?int frac? exp?
+ */
+static bool scan_number(scan_t *scan) {
+    const char *start;
+
+    if (scan->pos < scan->end && *scan->pos == '-') {
+        scan->pos++;
+    }
+    start = scan->pos;
+    while (scan->pos < scan->end && *scan->pos >= '0' && *scan->pos <= '9') {
+        scan->pos++;
+    }
+    if (scan->pos == start || (*start == '0' && scan->pos - start > 1)) {
+        return false;
+    }
+
+    if (scan->pos < scan->end && *scan->pos == '.') {
+        start = ++scan->pos;
+        while (scan->pos < scan->end && *scan->pos >= '0' && *scan->pos <= '9') {
+            scan->pos++;
+        }
+        if (scan->pos == start) {
+            return false;
+        }
+    }
+
+    if (scan->pos < scan->end && (*scan->pos == 'e' || *scan->pos == 'E')) {
+        scan->pos++;
+        if (scan->pos < scan->end && (*scan->pos == '+' || *scan->pos == '-')) {
+            scan->pos++;
+        }
+        start = scan->pos;
+        while (scan->pos < scan->end && *scan->pos >= '0' && *scan->pos <= '9') {
+            scan->pos++;
+        }
+        if (scan->pos == start) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Skip a nested object or array whose opening bracket is at the cursor.
+ * Brackets must pair up; the members inside are only checked for strings.
+ */
+static bool skip_container(scan_t *scan) {
+    // Bit n set when level n is an array
+    uint32_t arrays = 0;
+    int depth = 0;
+
+    do {
+        if (scan->pos >= scan->end) {
+            return false;
+        }
+
+        char c = *scan->pos++;
+        const char *value;
+        size_t len;
+
+        if (c == '{' || c == '[') {
+            if (depth == JSON_SCAN_MAX_DEPTH) {
+                return false;
+            }
+            arrays = (arrays & ~(1U << depth)) | ((c == '[') << depth);
+            depth++;
+        } else if (c == '}' || c == ']') {
+            depth--;
+            if (((arrays >> depth) & 1) != (c == ']')) {
+                return false;
+            }
+        } else if (c == '"') {
+            if (!scan_string(scan, &value, &len)) {
+                return false;
+            }
+        } else if ((unsigned char)c < 0x20 && c != '\t' && c != '\r' && c != '\n') {
+            return false;
+        }
+    } while (depth > 0);
+
+    return true;
+}
+
+/**
+ * Step over one member value, keeping a view of strings and scalars
+ */
+static bool scan_value(scan_t *scan, json_scan_field_t *field) {
+    const char *value;
+    size_t len;
+    bool string = false;
+
+    skip_space(scan);
+    if (scan->pos >= scan->end) {
+        return false;
+    }
+
+    value = scan->pos;
+    switch (*scan->pos) {
+    case '"':
+        scan->pos++;
+        if (!scan_string(scan, &value, &len)) {
+            return false;
+        }
+        string = true;
+        break;
+    case '{':
+    case '[':
+        if (!skip_container(scan)) {
+            return false;
+        }
+        len = scan->pos - value;
+        break;
+    case 't':
+    case 'f':
+    case 'n':
+        if (!scan_literal(scan, "true") && !scan_literal(scan, "false") && !scan_literal(scan, "null")) {
+            return false;
+        }
+        len = scan->pos - value;
+        break;
+    default:
+        if (!scan_number(scan)) {
+            return false;
+        }
+        len = scan->pos - value;
+    }
+
+    // The first of duplicate keys wins
+    if (field && !field->value) {
+        field->value = value;
+        field->len = len;
+        field->string = string;
+    }
+    return true;
+}
+
+static json_scan_field_t *find_field(json_scan_field_t *fields, size_t count, const char *key, size_t len) {
+    for (size_t i = 0; i < count; i++) {
+        if (strlen(fields[i].key) == len && memcmp(fields[i].key, key, len) == 0) {
+            return &fields[i];
+        }
+    }
+    return NULL;
+}
+
+int json_scan(const char *text, size_t len, json_scan_field_t *fields, size_t count) {
+    scan_t scan = { text, text + len };
+    int found = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        fields[i].value = NULL;
+        fields[i].len = 0;
+        fields[i].string = false;
+    }
+
+    if (!accept(&scan, '{')) {
+        return -EINVAL;
+    }
+
+    if (!accept(&scan, '}')) {
+        do {
+            const char *key;
+            size_t key_len;
+
+            if (!accept(&scan, '"') || !scan_string(&scan, &key, &key_len) || !accept(&scan, ':')) {
+                return -EINVAL;
+            }
+
+            json_scan_field_t *field = find_field(fields, count, key, key_len);
+            bool wanted = field && !field->value;
+
+            if (!scan_value(&scan, field)) {
+                return -EINVAL;
+            }
+            found += wanted;
+        } while (accept(&scan, ','));
+
+        if (!accept(&scan, '}')) {
+            return -EINVAL;
+        }
+    }
+
+    // Nothing but white space may follow the object
+    skip_space(&scan);
+    return scan.pos == scan.end ? found : -EINVAL;
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    return (c | 0x20) - 'a' + 10;
+}
+
+int json_scan_string(const json_scan_field_t *field, char *buf, size_t len) {
+    size_t out = 0;
+
+    if (len == 0) {
+        return -ENOMEM;
+    }
+    buf[0] = '\0';
+    if (!field->value || !field->string) {
+        return 0;
+    }
+
+    for (size_t i = 0; i < field->len; i++) {
+        char c = field->value[i];
+
+        if (c == '\\') {
+            // The scanner has checked every escape is complete
+            char escape = field->value[++i];
+            switch (escape) {
+            case 'b': c = '\b'; break;
+            case 'f': c = '\f'; break;
+            case 'n': c = '\n'; break;
+            case 'r': c = '\r'; break;
+            case 't': c = '\t'; break;
+            case 'u': {
+                uint32_t code = 0;
+                for (int digit = 1; digit <= 4; digit++) {
+                    code = code << 4 | hex_value(field->value[i + digit]);
+                }
+                i += 4;
+                // A NUL would cut the C string short
+                if (code == 0) {
+                    buf[0] = '\0';
+                    return -EINVAL;
+                }
+                // Records are ASCII, anything wider is not kept
+                c = code < 0x80 ? (char)code : '?';
+                break;
+            }
+            default: c = escape; break;
+            }
+        }
+
+        if (out + 1 >= len) {
+            buf[out] = '\0';
+            return -ENOMEM;
+        }
+        buf[out++] = c;
+    }
+
+    buf[out] = '\0';
+    return out;
+}
@@ -0,0 +1,164 @@
+/*
+* @file     json_writer.c
+* @brief    Streaming JSON Writer into a Caller Buffer
+*/
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include "json_writer.h"
+
+static void put_char(json_writer_t *writer, char c) {
+    // Keep a byte for the NUL written by json_writer_finish()
+    if (writer->pos + 1 < writer->len) {
+        writer->buf[writer->pos++] = c;
+    } else {
+        writer->overflow = true;
+    }
+}
+
+static void put_raw(json_writer_t *writer, const char *text) {
+    while (*text) {
+        put_char(writer, *text++);
+    }
+}
+
+/**
+ * Quote and escape a string: the two-character escapes where JSON has one,
+ * \u00XX for other control bytes, everything else as is.
+ */
+static void put_string(json_writer_t *writer, const char *text, size_t len) {
+    static const char digits[] = "0123456789abcdef";
+
+    put_char(writer, '"');
+    for (size_t i = 0; i < len && text[i]; i++) {
+        unsigned char c = text[i];
+
+        switch (c) {
+        case '"':  put_raw(writer, "\\\""); break;
+        case '\\': put_raw(writer, "\\\\"); break;
+        case '\b': put_raw(writer, "\\b"); break;
+        case '\f': put_raw(writer, "\\f"); break;
+        case '\n': put_raw(writer, "\\n"); break;
+        case '\r': put_raw(writer, "\\r"); break;
+        case '\t': put_raw(writer, "\\t"); break;
+        default:
+            if (c < 0x20) {
+                put_raw(writer, "\\u00");
+                put_char(writer, digits[c >> 4]);
+                put_char(writer, digits[c & 0x0F]);
+            } else {
+                put_char(writer, c);
+            }
+        }
+    }
+    put_char(writer, '"');
+}
+
+/**
+ * Separate a new member from the previous one and write its key
+ */
+static void put_member(json_writer_t *writer, const char *key) {
+    if (!writer->first) {
+        put_char(writer, ',');
+    }
+    writer->first = false;
+
+    if (key) {
+        put_string(writer, key, strlen(key));
+        put_char(writer, ':');
+    }
+}
+
+static void open_container(json_writer_t *writer, const char *key, char open) {
+    put_member(writer, key);
+    put_char(writer, open);
+    writer->first = true;
+
+    if (writer->depth < JSON_WRITER_MAX_DEPTH) {
+        writer->depth++;
+    } else {
+        writer->overflow = true;
+    }
+}
+
+static void close_container(json_writer_t *writer, char close) {
+    put_char(writer, close);
+    writer->first = false;
+    if (writer->depth > 0) {
+        writer->depth--;
+    }
+}
+
+void json_writer_init(json_writer_t *writer, char *buf, size_t len) {
+    writer->buf = buf;
+    writer->len = len;
+    writer->pos = 0;
+    writer->depth = 0;
+    writer->first = true;
+    writer->overflow = len == 0;
+}
+
+void json_writer_object_begin(json_writer_t *writer, const char *key) {
+    open_container(writer, key, '{');
+}
+
+void json_writer_object_end(json_writer_t *writer) {
+    close_container(writer, '}');
+}
+
+void json_writer_array_begin(json_writer_t *writer, const char *key) {
+    open_container(writer, key, '[');
+}
+
+void json_writer_array_end(json_writer_t *writer) {
+    close_container(writer, ']');
+}
+
+void json_writer_string(json_writer_t *writer, const char *key, const char *value) {
+    put_member(writer, key);
+    put_string(writer, value, strlen(value));
+}
+
+void json_writer_string_n(json_writer_t *writer, const char *key, const char *value, size_t len) {
+    put_member(writer, key);
+    put_string(writer, value, len);
+}
+
+void json_writer_hex(json_writer_t *writer, const char *key, const uint8_t *data, size_t len) {
+    static const char digits[] = "0123456789abcdef";
+
+    put_member(writer, key);
+    put_char(writer, '"');
+    for (size_t i = 0; i < len; i++) {
+        put_char(writer, digits[data[i] >> 4]);
+        put_char(writer, digits[data[i] & 0x0F]);
+    }
+    put_char(writer, '"');
+}
+
+void json_writer_uint(json_writer_t *writer, const char *key, uint32_t value) {
+    char digits[11];
+
+    snprintf(digits, sizeof(digits), "%u", value);
+    put_member(writer, key);
+    put_raw(writer, digits);
+}
+
+void json_writer_uint64(json_writer_t *writer, const char *key, uint64_t value) {
+    char digits[21];
+
+    snprintf(digits, sizeof(digits), "%llu", (unsigned long long)value);
+    put_member(writer, key);
+    put_raw(writer, digits);
+}
+
+int json_writer_finish(json_writer_t *writer) {
+    if (writer->len > 0) {
+        writer->buf[writer->pos] = '\0';
+    }
+    if (writer->overflow) {
+        return -ENOMEM;
+    }
+    return writer->depth == 0 ? (int)writer->pos : -EINVAL;
+}
@@ -43,5 +43,6 @@ double sensor_get_magnetometer_threshold(void) {
 }
 
 void sensor_threshold_init(void) {
-    k_sem_init(&sensor_threshold_update_sem, 0, 1);
+    // One count per change, so fs.c can tell how many it folded into one write
+    k_sem_init(&sensor_threshold_update_sem, 0, K_SEM_MAX_LIMIT);
 }
\ No newline at end of file
@@ -5,12 +5,32 @@
 */
 
 #include "user.h"
+#include "block_codec.h"
 
 // Singly linked list to hold user nodes, and mutex and semaphore for thread safety
 sys_slist_t user_config_list;
 struct k_mutex user_config_list_mutex;
 struct k_sem user_list_update_sem;
 
+K_MSGQ_DEFINE(user_change_msgq, sizeof(user_change_t), USER_CHANGE_QUEUE_SIZE, 1);
+atomic_t user_change_overflow;
+
+// Queue a change for the user store. Caller must hold user_config_list_mutex,
+// so changes are queued in the order they were made.
+static void user_change_queue(uint8_t type, const char *alias, const char *mac, const char *passcode) {
+    user_change_t change = { .type = type };
+
+    strncpy(change.alias, alias, sizeof(change.alias) - 1);
+    if (mac) {
+        strncpy(change.mac, mac, sizeof(change.mac) - 1);
+        strncpy(change.passcode, passcode, sizeof(change.passcode) - 1);
+    }
+
+    if (k_msgq_put(&user_change_msgq, &change, K_NO_WAIT) < 0) {
+        atomic_set(&user_change_overflow, 1);
+    }
+}
+
 // Checks if the given MAC address is valid
 bool user_valid_max(const char *mac) {
     unsigned int bytes[6];
@@ -44,8 +64,23 @@ bool user_valid_passcode(const char *passcode) {
     return true;
 }
 
-// Add a user to the linked list if they exist in predefined users
-int user_add(const char *alias, const char *mac, const char *passcode) {
+// Add a user to the linked list, queueing the change if it is to be stored
+static int user_insert(const char *alias, const char *mac, const char *passcode, bool store) {
+    // Aliases must fit the record persisted in users.log
+    if (alias[0] == '\0' || strlen(alias) >= USER_ALIAS_LENGTH) {
+        return USER_ALIAS_INVALID;
+    }
+
+    // New aliases must also fit a block's user field whole, or two users
+    // sharing a prefix could not be told apart in the chain. Longer aliases
+    // stored by earlier firmware still load, so nobody is locked out.
+    if (strlen(alias) >= BLOCK_USER_LENGTH) {
+        if (store) {
+            return USER_ALIAS_INVALID;
+        }
+        printk("User %s is recorded in the chain as its first %d characters\n", alias, BLOCK_USER_LENGTH - 1);
+    }
+
     if (!user_valid_max(mac)) {
         return USER_MAC_INVALID;
     }
@@ -94,14 +129,24 @@ int user_add(const char *alias, const char *mac, const char *passcode) {
     strcpy((char *)new_user->passcode, passcode);
 
     sys_slist_append(&user_config_list, &new_user->node);
+    if (store) {
+        user_change_queue(USER_CHANGE_ADD, alias, mac, passcode);
+    }
     k_mutex_unlock(&user_config_list_mutex);
-    k_sem_give(&user_list_update_sem);
-    
+    if (store) {
+        k_sem_give(&user_list_update_sem);
+    }
+
     return USER_SUCCESS;
 }
 
-// Remove a user by alias from the linked lists
-int user_remove(const char *alias) {
+// Add a user to the linked list if they exist in predefined users
+int user_add(const char *alias, const char *mac, const char *passcode) {
+    return user_insert(alias, mac, passcode, true);
+}
+
+// Remove a user by alias from the linked list, queueing the change if it is to be stored
+static int user_delete(const char *alias, bool store) {
     k_mutex_lock(&user_config_list_mutex, K_FOREVER);
 
     sys_snode_t *prev = NULL;
@@ -111,9 +156,17 @@ int user_remove(const char *alias) {
         user_config_t *entry = CONTAINER_OF(snode, user_config_t, node);
         if (strcmp(entry->alias, alias) == 0) {
             sys_slist_remove(&user_config_list, prev, snode);
+            if (store) {
+                user_change_queue(USER_CHANGE_REMOVE, alias, NULL, NULL);
+            }
+            k_free(entry->alias);
+            k_free(entry->mac);
+            k_free(entry->passcode);
             k_free(entry);
             k_mutex_unlock(&user_config_list_mutex);
-            k_sem_give(&user_list_update_sem);
+            if (store) {
+                k_sem_give(&user_list_update_sem);
+            }
             return USER_SUCCESS;
         }
         prev = snode;
@@ -124,6 +177,18 @@ int user_remove(const char *alias) {
     return USER_NOT_FOUND;
 }
 
+// Remove a user by alias from the linked lists
+int user_remove(const char *alias) {
+    return user_delete(alias, true);
+}
+
+int user_apply(const user_change_t *change) {
+    if (change->type == USER_CHANGE_ADD) {
+        return user_insert(change->alias, change->mac, change->passcode, false);
+    }
+    return user_delete(change->alias, false);
+}
+
 // View details of a specific user or all users
 void user_view(const struct shell *shell, const char *alias) {
     k_mutex_lock(&user_config_list_mutex, K_FOREVER);
@@ -154,6 +219,7 @@ void user_view(const struct shell *shell, const char *alias) {
 // Initialize list, mutex, and semaphore
 void user_init(void) {
     k_mutex_init(&user_config_list_mutex);
-    k_sem_init(&user_list_update_sem, 0, 1);
+    // Counts every change, so the writer knows how many it coalesced
+    k_sem_init(&user_list_update_sem, 0, K_SEM_MAX_LIMIT);
     sys_slist_init(&user_config_list);
 }
\ No newline at end of file
@@ -0,0 +1,174 @@
+/*
+* @file     user_store.c
+* @brief    Log-structured User Store
+*/
+
+#include <zephyr/kernel.h>
+#include <stdio.h>
+#include <string.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/fs/fs.h>
+#include <zephyr/sys/crc.h>
+#include "fs_wear.h"
+#include "user_store.h"
+
+LOG_MODULE_REGISTER(user_store, LOG_LEVEL_INF);
+
+// Guards store_records, the benchmark appends from the shell thread
+K_MUTEX_DEFINE(user_store_mutex);
+static user_store_record_t store_records[USER_STORE_CHUNK];
+
+static uint32_t user_store_crc(const user_store_record_t *record) {
+    return crc32_ieee((const uint8_t *)record, offsetof(user_store_record_t, crc));
+}
+
+static void user_store_seal(user_store_record_t *record, const user_change_t *change) {
+    memset(record, 0, sizeof(*record));
+    record->change = *change;
+    record->crc = user_store_crc(record);
+}
+
+int user_store_append(const char *path, const user_change_t *changes, size_t count) {
+    struct fs_file_t file;
+
+    fs_file_t_init(&file);
+
+    int ret = fs_wear_open(&file, path, FS_O_CREATE | FS_O_WRITE | FS_O_APPEND, FS_WEAR_USERS);
+    if (ret < 0) {
+        LOG_ERR("Failed to open %s: %d", path, ret);
+        return ret;
+    }
+
+    k_mutex_lock(&user_store_mutex, K_FOREVER);
+    while (count > 0 && ret == 0) {
+        size_t batch = MIN(count, ARRAY_SIZE(store_records));
+        size_t len = batch * sizeof(user_store_record_t);
+
+        for (size_t i = 0; i < batch; i++) {
+            user_store_seal(&store_records[i], &changes[i]);
+        }
+        if (fs_wear_write(&file, store_records, len) != (ssize_t)len) {
+            ret = -EIO;
+        }
+        changes += batch;
+        count -= batch;
+    }
+    k_mutex_unlock(&user_store_mutex);
+
+    if (ret == 0 && fs_wear_sync(&file) < 0) {
+        ret = -EIO;
+    }
+
+    fs_wear_close(&file);
+    return ret;
+}
+
+int user_store_replay(const char *path, user_store_fn fn, void *ctx) {
+    struct fs_file_t file;
+    struct fs_dirent entry;
+    uint32_t kept = 0, skipped = 0;
+    bool torn = false;
+    ssize_t r;
+
+    fs_file_t_init(&file);
+
+    int ret = fs_stat(path, &entry);
+    if (ret == 0) {
+        ret = fs_wear_open(&file, path, FS_O_RDWR, FS_WEAR_USERS);
+    }
+    if (ret < 0) {
+        return ret;
+    }
+
+    // A reset can only tear the last append, whose last write held at most a
+    // chunk of records. A bad record before those is corrupt, not torn.
+    uint32_t records = entry.size / sizeof(user_store_record_t);
+    uint32_t last_write = records > USER_STORE_CHUNK ? records - USER_STORE_CHUNK : 0;
+
+    k_mutex_lock(&user_store_mutex, K_FOREVER);
+    while (!torn && (r = fs_wear_read(&file, store_records, sizeof(store_records))) > 0) {
+        size_t count = r / sizeof(user_store_record_t);
+
+        for (size_t i = 0; i < count; i++) {
+            if (store_records[i].crc == user_store_crc(&store_records[i])) {
+                fn(&store_records[i].change, ctx);
+            } else if (kept >= last_write) {
+                torn = true;
+                break;
+            } else {
+                LOG_ERR("Skipping corrupt record %u of %s", kept, path);
+                skipped++;
+            }
+            kept++;
+        }
+        torn = torn || count * sizeof(user_store_record_t) != (size_t)r;
+    }
+    k_mutex_unlock(&user_store_mutex);
+
+    if (r < 0) {
+        fs_wear_close(&file);
+        return r;
+    }
+
+    if (torn) {
+        // The next append goes after the cut
+        ret = fs_truncate(&file, kept * sizeof(user_store_record_t));
+        LOG_WRN("Cut torn records from %s after %u records", path, kept);
+        if (ret < 0) {
+            LOG_ERR("Failed to cut %s: %d", path, ret);
+        }
+    }
+    if (skipped > 0) {
+        LOG_WRN("Skipped %u corrupt records of %s", skipped, path);
+    }
+
+    fs_wear_close(&file);
+    return ret < 0 ? ret : kept;
+}
+
+int user_store_rewrite_begin(user_store_writer_t *writer, const char *path) {
+    writer->path = path;
+    writer->records = 0;
+    writer->err = 0;
+    snprintf(writer->tmp_path, sizeof(writer->tmp_path), "%s.tmp", path);
+    fs_file_t_init(&writer->file);
+
+    return fs_wear_open(&writer->file, writer->tmp_path, FS_O_CREATE | FS_O_WRITE | FS_O_TRUNC, FS_WEAR_USERS);
+}
+
+void user_store_rewrite_put(user_store_writer_t *writer, const user_change_t *change) {
+    user_store_record_t record;
+
+    if (writer->err < 0) {
+        return;
+    }
+
+    user_store_seal(&record, change);
+    if (fs_wear_write(&writer->file, &record, sizeof(record)) != sizeof(record)) {
+        writer->err = -EIO;
+        return;
+    }
+    writer->records++;
+}
+
+/**
+ * The old log stays in place until the rename, which LittleFS does
+ * atomically, so a reset while compacting loses nothing.
+ */
+int user_store_rewrite_end(user_store_writer_t *writer) {
+    int ret = writer->err;
+
+    if (ret == 0 && fs_wear_sync(&writer->file) < 0) {
+        ret = -EIO;
+    }
+
+    fs_wear_close(&writer->file);
+    if (ret == 0) {
+        ret = fs_rename(writer->tmp_path, writer->path);
+    }
+    if (ret < 0) {
+        LOG_ERR("Failed to rewrite %s: %d", writer->path, ret);
+        fs_unlink(writer->tmp_path);
+    }
+    return ret;
+}
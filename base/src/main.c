@@ -17,6 +17,10 @@
 #include "servo.h"
 #include "keypad.h"
 #include "sensor.h"
+#include "blockchain.h"
+#include "chain_bench.h"
+#include "chain_stats.h"
+#include "fs_wear.h"
 
 // Adding users command.
 static int cmd_user_add(const struct shell *shell, size_t argc, char **argv) {
@@ -59,6 +63,9 @@ static int cmd_user_add(const struct shell *shell, size_t argc, char **argv) {
         case USER_MEMORY_ERROR:
             shell_print(shell, "Memory allocation failed.");
             break;
+        case USER_ALIAS_INVALID:
+            shell_print(shell, "Alias must be 1 to %d characters.", BLOCK_USER_LENGTH - 1);
+            break;
         default:
             shell_print(shell, "Unknown error.");
             break;
@@ -124,6 +131,303 @@ static int cmd_sensor_view(const struct shell *shell, size_t argc, char **argv)
     return 0;
 }
 
+// Viewing blockchain command.
+static int cmd_chain_view(const struct shell *shell, size_t argc, char **argv) {
+    uint32_t height = chain_height();
+    uint32_t count = 10;
+    uint32_t from = height > count ? height - count : 0;
+
+    if (argc >= 2) {
+        from = strtoul(argv[1], NULL, 10);
+    }
+    if (argc >= 3) {
+        count = strtoul(argv[2], NULL, 10);
+    }
+
+    chain_view(shell, from, count);
+    return 0;
+}
+
+// Deep blockchain verification command.
+static int cmd_chain_verify(const struct shell *shell, size_t argc, char **argv) {
+    int64_t start = k_uptime_get();
+    bool valid = validate_chain_from_file();
+    int64_t elapsed = k_uptime_get() - start;
+
+    if (valid) {
+        shell_print(shell, "Blockchain valid: %u blocks verified in %lld ms.", chain_height(), elapsed);
+    } else {
+        shell_error(shell, "Blockchain tampered!");
+    }
+    return 0;
+}
+
+// Merkle inclusion proof command.
+static int cmd_chain_proof(const struct shell *shell, size_t argc, char **argv) {
+    if (argc != 2) {
+        shell_print(shell, "Usage: chain proof <height>");
+        return -EINVAL;
+    }
+
+    chain_proof(shell, strtoul(argv[1], NULL, 10));
+    return 0;
+}
+
+// Blockchain writer queue and commit counters.
+static int cmd_chain_status(const struct shell *shell, size_t argc, char **argv) {
+    chain_writer_status_t status;
+    chain_writer_status(&status);
+
+    shell_print(shell, "Queue: %u/%u (peak %u)", status.depth, status.capacity, status.peak_depth);
+    shell_print(shell, "Queued: %u, written: %u, failed: %u, dropped: %u",
+                status.queued, status.written, status.failed, status.dropped);
+    if (status.failed > 0) {
+        shell_print(shell, "Last error: %d", status.last_error);
+    }
+
+    // Blocks per write, in hundredths
+    uint32_t ratio = status.commits ? status.written * 100 / status.commits : 0;
+    shell_print(shell, "Commits: %u, blocks per commit: %u.%02u (window %u ms, max %u)",
+                status.commits, ratio / 100, ratio % 100, status.window_ms, status.max_blocks);
+    shell_print(shell, "Boot restore: %u ms, tail rebuilds: %u", status.boot_ms, status.tail_rebuilds);
+    return 0;
+}
+
+// Chain performance counters as one JSON line.
+static int cmd_chain_stats(const struct shell *shell, size_t argc, char **argv) {
+    chain_stats_t stats;
+    char line[CHAIN_STATS_JSON_SIZE];
+
+    chain_stats_get(&stats);
+    if (chain_stats_to_json(&stats, line, sizeof(line)) < 0) {
+        shell_error(shell, "Stats do not fit in %u bytes", (unsigned)sizeof(line));
+        return -ENOMEM;
+    }
+
+    shell_print(shell, "%s", line);
+    return 0;
+}
+
+// Set the group commit window of the blockchain writer.
+static int cmd_chain_commit(const struct shell *shell, size_t argc, char **argv) {
+    if (argc < 2 || argc > 3) {
+        shell_print(shell, "Usage: chain commit <window ms> [<max blocks>]");
+        return -EINVAL;
+    }
+
+    chain_writer_status_t status;
+    chain_writer_status(&status);
+
+    uint32_t window_ms = strtoul(argv[1], NULL, 10);
+    uint32_t max_blocks = argc == 3 ? strtoul(argv[2], NULL, 10) : status.max_blocks;
+
+    if (chain_set_commit_window(window_ms, max_blocks) < 0) {
+        shell_error(shell, "Max blocks must be between 1 and %d", CHAIN_COMMIT_MAX_BLOCKS);
+        return -EINVAL;
+    }
+
+    shell_print(shell, "Group commit: window %u ms, max %u blocks", window_ms, max_blocks);
+    return 0;
+}
+
+// Stream blocks to the PC over RTT.
+static int cmd_chain_export(const struct shell *shell, size_t argc, char **argv) {
+    uint32_t since = 0;
+
+    if (argc == 3 && strcmp(argv[1], "--since") == 0) {
+        since = strtoul(argv[2], NULL, 10);
+    } else if (argc != 1) {
+        shell_print(shell, "Usage: chain export [--since <height>]");
+        return -EINVAL;
+    }
+
+    chain_export(shell, since);
+    return 0;
+}
+
+#ifdef CONFIG_CHAIN_BENCH
+// Storage benchmarks, in bench.conf builds only.
+static int cmd_chain_bench(const struct shell *shell, size_t argc, char **argv) {
+    if (argc >= 2 && strcmp(argv[1], "json") == 0) {
+        chain_bench_json(shell);
+        return 0;
+    }
+
+    if (argc >= 2 && strcmp(argv[1], "lines") == 0) {
+        chain_bench_lines(shell);
+        return 0;
+    }
+
+    if (argc >= 2 && strcmp(argv[1], "users") == 0) {
+        uint32_t users = argc >= 3 ? strtoul(argv[2], NULL, 10) : CHAIN_BENCH_USERS;
+
+        if (users == 0 || users > 0xFFFF) {
+            shell_print(shell, "Usage: chain bench users [<1 to 65535 users>]");
+            return -EINVAL;
+        }
+        chain_bench_users(shell, users);
+        return 0;
+    }
+
+    if (argc >= 2 && strcmp(argv[1], "hash") == 0) {
+        chain_bench_hash(shell);
+        return 0;
+    }
+
+    if (argc >= 2 && strcmp(argv[1], "chain") == 0) {
+        uint32_t blocks = argc >= 3 ? strtoul(argv[2], NULL, 10) : 0;
+
+        if (argc >= 3 && (blocks < 10 || blocks > CHAIN_BENCH_CHAIN_BLOCKS)) {
+            shell_print(shell, "Usage: chain bench chain [<10 to %u blocks>]", CHAIN_BENCH_CHAIN_BLOCKS);
+            return -EINVAL;
+        }
+        chain_bench_chain(shell, blocks);
+        return 0;
+    }
+
+    if (argc >= 2 && strcmp(argv[1], "append") == 0) {
+        uint32_t height = argc >= 3 ? strtoul(argv[2], NULL, 10) : CHAIN_BENCH_APPEND_HEIGHT;
+
+        if (height < 10 || height > CHAIN_BENCH_APPEND_HEIGHT) {
+            shell_print(shell, "Usage: chain bench append [<10 to %u blocks>]", CHAIN_BENCH_APPEND_HEIGHT);
+            return -EINVAL;
+        }
+        chain_bench_append(shell, height);
+        return 0;
+    }
+
+    uint32_t events_per_day = argc >= 2 ? strtoul(argv[1], NULL, 10) : 50;
+
+    chain_bench_pack(shell, events_per_day);
+    return 0;
+}
+#endif
+
+// Write changed config files to flash now.
+static int cmd_storage_sync(const struct shell *shell, size_t argc, char **argv) {
+    int ret = fs_config_sync();
+    if (ret < 0) {
+        shell_error(shell, "Failed to write config files: %d", ret);
+        return ret;
+    }
+
+    shell_print(shell, "Config files are on flash.");
+    return 0;
+}
+
+// Config file write counters.
+static int cmd_storage_status(const struct shell *shell, size_t argc, char **argv) {
+    static const char *const names[FS_CONFIG_FILES] = {
+        [FS_CONFIG_USERS] = "users.log",
+        [FS_CONFIG_SENSORS] = "sensors.conf",
+    };
+
+    shell_print(shell, "Quiet period: %u ms", fs_config_get_quiet());
+    for (int i = 0; i < FS_CONFIG_FILES; i++) {
+        fs_config_stats_t stats;
+        fs_config_stats(i, &stats);
+        // The user log is appended to, so its size says more than a generation
+        bool log = i == FS_CONFIG_USERS;
+        shell_print(shell, "%s: %s %u, changes %u, writes %u, saved %u, failed %u, pending %u",
+                    names[i], log ? "records" : "generation", log ? stats.records : stats.generation,
+                    stats.changes, stats.writes, stats.saved, stats.failures, stats.pending);
+    }
+    return 0;
+}
+
+// Set how long config changes settle before they are written.
+static int cmd_storage_quiet(const struct shell *shell, size_t argc, char **argv) {
+    if (argc != 2) {
+        shell_print(shell, "Usage: storage quiet <ms>");
+        return -EINVAL;
+    }
+
+    fs_config_set_quiet(strtoul(argv[1], NULL, 10));
+    shell_print(shell, "Config writes wait for %u ms of quiet.", fs_config_get_quiet());
+    return 0;
+}
+
+static void print_wear(const struct shell *shell, const char *name, const fs_wear_counters_t *counters) {
+    shell_print(shell, "%-22s %12llu %12llu %8u %8u %8u", name, (unsigned long long)counters->bytes_read,
+                (unsigned long long)counters->bytes_written, counters->opens, counters->syncs, counters->erases);
+}
+
+// Flash reads, writes and estimated erases since first boot, by caller and file.
+static int cmd_storage_stats(const struct shell *shell, size_t argc, char **argv) {
+    static fs_wear_totals_t totals;
+
+    if (argc == 2 && strcmp(argv[1], "save") == 0) {
+        int ret = fs_wear_save();
+        if (ret < 0) {
+            shell_error(shell, "Failed to save %s: %d", FS_WEAR_FILE, ret);
+            return ret;
+        }
+    } else if (argc != 1) {
+        shell_print(shell, "Usage: storage stats [save]");
+        return -EINVAL;
+    }
+
+    fs_wear_get(&totals);
+    shell_print(shell, "%u boots, %u s up in total", totals.boots, totals.seconds);
+    shell_print(shell, "%-22s %12s %12s %8s %8s %8s", "caller", "read", "written", "opens", "syncs", "erases");
+    for (int i = 0; i < FS_WEAR_CALLERS; i++) {
+        print_wear(shell, fs_wear_caller_name(i), &totals.callers[i]);
+    }
+    shell_print(shell, "%-22s %12s %12s %8s %8s %8s", "file", "read", "written", "opens", "syncs", "erases");
+    for (uint32_t i = 0; i < totals.file_count; i++) {
+        print_wear(shell, totals.files[i].name, &totals.files[i].counters);
+    }
+
+    fs_wear_emit();
+    return 0;
+}
+
+// Blockchain search command.
+// Whether a shell argument is the short or long form of an option
+static bool is_option(const char *arg, const char *short_name, const char *long_name) {
+    return strcmp(arg, short_name) == 0 || strcmp(arg, long_name) == 0;
+}
+
+static int cmd_chain_query(const struct shell *shell, size_t argc, char **argv) {
+    chain_query_t query = { .event = BLOCK_EVENT_MAX, .from = 0, .to = UINT32_MAX };
+    uint32_t limit = 10;
+
+    if (argc % 2 == 0) {
+        shell_print(shell, "Usage: chain query [--user <alias>] [--event <event>] [--since <seconds>] [--from <from>] [--to <to>] [--limit <limit>]");
+        return -EINVAL;
+    }
+
+    for (int i = 1; i < argc - 1; i += 2) {
+        if (is_option(argv[i], "-u", "--user")) {
+            strncpy(query.user, argv[i + 1], BLOCK_USER_LENGTH - 1);
+        } else if (is_option(argv[i], "-e", "--event")) {
+            query.event = block_event_parse(argv[i + 1]);
+            if (query.event == BLOCK_EVENT_MAX) {
+                shell_error(shell, "Unknown event '%s'", argv[i + 1]);
+                return -EINVAL;
+            }
+        } else if (is_option(argv[i], "-s", "--since")) {
+            // Back from the newest block, timestamps restart at each boot so
+            // uptime would only cover blocks from this one
+            uint32_t last = chain_last_timestamp();
+            uint32_t since = strtoul(argv[i + 1], NULL, 10);
+            query.from = last > since ? last - since : 0;
+        } else if (is_option(argv[i], "-f", "--from")) {
+            query.from = strtoul(argv[i + 1], NULL, 10);
+        } else if (is_option(argv[i], "-t", "--to")) {
+            query.to = strtoul(argv[i + 1], NULL, 10);
+        } else if (is_option(argv[i], "-n", "--limit")) {
+            limit = strtoul(argv[i + 1], NULL, 10);
+        } else {
+            shell_error(shell, "Unknown option '%s'", argv[i]);
+            return -EINVAL;
+        }
+    }
+
+    chain_query(shell, &query, limit);
+    return 0;
+}
+
 // Main.
 int main(void) {
     user_init();
@@ -152,5 +456,30 @@ SHELL_STATIC_SUBCMD_SET_CREATE(
     SHELL_SUBCMD_SET_END
 );
 
+SHELL_STATIC_SUBCMD_SET_CREATE(
+    chain_cmds,
+    SHELL_CMD(view, NULL, "View blocks as JSON: chain view [<height>] [<count>]", cmd_chain_view),
+    SHELL_CMD(verify, NULL, "Re-verify every block of the chain", cmd_chain_verify),
+    SHELL_CMD(proof, NULL, "Merkle inclusion proof for a block: chain proof <height>", cmd_chain_proof),
+    SHELL_COND_CMD(CONFIG_CHAIN_BENCH, bench, NULL, "Archive packing ratio and speed: chain bench [<events per day>], JSON lines: chain bench json, line reader: chain bench lines, user store: chain bench users [<users>], appends: chain bench append [<height>], hashing: chain bench hash, chains: chain bench chain [<blocks>]", cmd_chain_bench),
+    SHELL_CMD(export, NULL, "Stream blocks over RTT channel 1: chain export [--since <height>]", cmd_chain_export),
+    SHELL_CMD(query, NULL, "Newest matching blocks: chain query [--user <alias>] [--event <event>] [--since <seconds>] [--from <from>] [--to <to>] [--limit <limit>]", cmd_chain_query),
+    SHELL_CMD(status, NULL, "Writer queue depth and commit counters", cmd_chain_status),
+    SHELL_CMD(stats, NULL, "Append latency, validation time, flash and heap use as JSON", cmd_chain_stats),
+    SHELL_CMD(commit, NULL, "Set group commit: chain commit <window ms> [<max blocks>]", cmd_chain_commit),
+    SHELL_SUBCMD_SET_END
+);
+
+SHELL_STATIC_SUBCMD_SET_CREATE(
+    storage_cmds,
+    SHELL_CMD(sync, NULL, "Write changed config files to flash now", cmd_storage_sync),
+    SHELL_CMD(status, NULL, "Config file changes, writes and writes saved", cmd_storage_status),
+    SHELL_CMD(quiet, NULL, "Set the config write quiet period: storage quiet <ms>", cmd_storage_quiet),
+    SHELL_CMD(stats, NULL, "Flash wear by caller and file, also sent over RTT: storage stats [save]", cmd_storage_stats),
+    SHELL_SUBCMD_SET_END
+);
+
 SHELL_CMD_REGISTER(user, &user_cmds, "User entry access configuration commands.", NULL);
-SHELL_CMD_REGISTER(sensor, &sensor_cmds, "Sensor threshold configuration commands.", NULL);
\ No newline at end of file
+SHELL_CMD_REGISTER(sensor, &sensor_cmds, "Sensor threshold configuration commands.", NULL);
+SHELL_CMD_REGISTER(chain, &chain_cmds, "Blockchain commands.", NULL);
+SHELL_CMD_REGISTER(storage, &storage_cmds, "Config file persistence commands.", NULL);
\ No newline at end of file
@@ -0,0 +1,487 @@
+/*
+* @file     chain_audit.c
+* @brief    Offline Blockchain Verifier for Base Node Flash Dumps
+*
+* Reads the chain from dumps of the storage partition (/lfs) and, if given,
+* the archive partition (/ext), then checks every record, hash link,
+* checkpoint root and segment trailer using the base node's own codec.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <mbedtls/sha256.h>
+#include "block_codec.h"
+#include "chain_segment.h"
+#include "lfs_image.h"
+
+_Static_assert(sizeof(block_record_t) == 80, "block_record_t must match the on-flash layout");
+
+// Checkpoint groups verified by one work item, so each item holds whole groups
+#define AUDIT_CHUNK_GROUPS 64
+#define AUDIT_MAX_THREADS 256
+
+typedef struct {
+    uint8_t *data;              /* Segment file, NULL if missing */
+    size_t len;
+    bool active;                /* chain.log, no trailer */
+    char path[CHAIN_SEGMENT_PATH_SIZE];
+} audit_segment_t;
+
+typedef struct {
+    lfs_image_t storage;
+    lfs_image_t archive;
+    bool has_archive;
+
+    audit_segment_t *segments;
+    uint32_t segment_count;     /* Sealed segments, then the active one */
+    block_record_t *records;    /* The whole chain, block n at records[n] */
+    uint32_t height;
+
+    atomic_uint next;           /* Next work item to claim */
+    pthread_mutex_t lock;
+    uint32_t broken_height;     /* Lowest failure found so far, under lock */
+    const char *broken_reason;
+} audit_t;
+
+/**
+ * CRC-32 (IEEE), the same as Zephyr's crc32_ieee()
+ */
+static uint32_t crc32_ieee(const uint8_t *data, size_t len) {
+    uint32_t crc = 0xFFFFFFFF;
+
+    for (size_t i = 0; i < len; i++) {
+        crc ^= data[i];
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+        }
+    }
+    return ~crc;
+}
+
+static uint32_t block_compute_crc(const block_record_t *block) {
+    return crc32_ieee((const uint8_t *)block, offsetof(block_record_t, crc));
+}
+
+static bool is_checkpoint_height(uint32_t height) {
+    return height % CHAIN_GROUP_SIZE == CHAIN_CHECKPOINT_INTERVAL;
+}
+
+static double elapsed_s(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/**
+ * Record a failure, keeping only the lowest height
+ */
+static void audit_fail(audit_t *audit, uint32_t height, const char *reason) {
+    pthread_mutex_lock(&audit->lock);
+    if (height < audit->broken_height) {
+        audit->broken_height = height;
+        audit->broken_reason = reason;
+    }
+    pthread_mutex_unlock(&audit->lock);
+}
+
+/**
+ * Read a file by its path on the base node, from whichever dump holds that
+ * mount point
+ */
+static int audit_read(audit_t *audit, const char *path, uint8_t **data, size_t *len) {
+    if (strncmp(path, "/lfs/", 5) == 0) {
+        return lfs_image_read(&audit->storage, path + 4, data, len);
+    }
+    if (strncmp(path, "/ext/", 5) == 0 && audit->has_archive) {
+        return lfs_image_read(&audit->archive, path + 4, data, len);
+    }
+    return LFS_ERR_NOENT;
+}
+
+static void find_hot_segment(void *ctx, const char *name) {
+    uint32_t *count = ctx;
+    uint32_t segment;
+    char suffix[4];
+
+    if (sscanf(name, "chain.%u.%3s", &segment, suffix) == 2 && strcmp(suffix, "seg") == 0) {
+        *count = segment + 1 > *count ? segment + 1 : *count;
+    }
+}
+
+static void find_archived_segment(void *ctx, const char *name) {
+    uint32_t *count = ctx;
+    uint32_t segment;
+    char suffix[4];
+
+    if (sscanf(name, "%u.%3s", &segment, suffix) == 2 && strcmp(suffix, "seg") == 0) {
+        *count = segment + 1 > *count ? segment + 1 : *count;
+    }
+}
+
+/**
+ * Load every segment file. A sealed segment is taken from internal flash
+ * while it is still there, as on the base node.
+ */
+static int audit_load(audit_t *audit) {
+    uint8_t *active = NULL;
+    size_t active_len = 0;
+    uint32_t sealed = 0;
+    uint64_t height = 0;
+
+    lfs_image_list(&audit->storage, "/", find_hot_segment, &sealed);
+    if (audit->has_archive) {
+        lfs_image_list(&audit->archive, CHAIN_ARCHIVE_DIR + 4, find_archived_segment, &sealed);
+    }
+
+    // The active segment's first record says how many segments come before
+    // it, even if their files are missing
+    if (audit_read(audit, BLOCKCHAIN_FILE, &active, &active_len) == 0 && active_len >= sizeof(block_record_t)) {
+        uint32_t first = ((const block_record_t *)active)->height;
+        if (first % CHAIN_SEGMENT_BLOCKS == 0 && first / CHAIN_SEGMENT_BLOCKS > sealed) {
+            sealed = first / CHAIN_SEGMENT_BLOCKS;
+        }
+    }
+
+    audit->segment_count = sealed + 1;
+    audit->segments = calloc(audit->segment_count, sizeof(audit_segment_t));
+    if (!audit->segments) {
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < audit->segment_count; i++) {
+        audit_segment_t *segment = &audit->segments[i];
+
+        if (i == sealed) {
+            segment->active = true;
+            segment->data = active;
+            segment->len = active_len;
+            strcpy(segment->path, BLOCKCHAIN_FILE);
+            height += segment->len / sizeof(block_record_t);
+            break;
+        }
+
+        snprintf(segment->path, sizeof(segment->path), CHAIN_SEGMENT_HOT_FMT, i);
+        if (audit_read(audit, segment->path, &segment->data, &segment->len) < 0) {
+            snprintf(segment->path, sizeof(segment->path), CHAIN_SEGMENT_ARCHIVE_FMT, i);
+            if (audit_read(audit, segment->path, &segment->data, &segment->len) < 0) {
+                segment->data = NULL;
+            }
+        }
+        height += CHAIN_SEGMENT_BLOCKS;
+    }
+
+    if (height > UINT32_MAX) {
+        return -1;
+    }
+
+    audit->height = height;
+    audit->records = calloc(height ? height : 1, sizeof(block_record_t));
+    return audit->records ? 0 : -1;
+}
+
+/**
+ * Check a sealed segment's trailer against the records decoded from it
+ */
+static void audit_trailer(audit_t *audit, uint32_t index, const chain_segment_trailer_t *trailer) {
+    uint32_t first = index * CHAIN_SEGMENT_BLOCKS;
+    uint8_t digest[HASH_LEN];
+    mbedtls_sha256_context ctx;
+
+    if (trailer->magic != CHAIN_SEGMENT_MAGIC ||
+        trailer->crc != crc32_ieee((const uint8_t *)trailer, offsetof(chain_segment_trailer_t, crc)) ||
+        trailer->first_height != first || trailer->last_height != first + CHAIN_SEGMENT_BLOCKS - 1) {
+        audit_fail(audit, first, "damaged segment trailer");
+        return;
+    }
+
+    mbedtls_sha256_init(&ctx);
+    mbedtls_sha256_starts(&ctx, 0);
+    mbedtls_sha256_update(&ctx, (const uint8_t *)&audit->records[first], CHAIN_SEGMENT_SIZE);
+    mbedtls_sha256_finish(&ctx, digest);
+    mbedtls_sha256_free(&ctx);
+
+    if (memcmp(digest, trailer->digest, HASH_LEN) != 0) {
+        audit_fail(audit, first, "segment digest does not match its trailer");
+    }
+}
+
+/**
+ * Unpack an archived segment. The CRC is not stored in packed form, so it is
+ * recomputed as the base node's reader does.
+ */
+static void audit_unpack(audit_t *audit, uint32_t index, const uint8_t *data, size_t len) {
+    const chain_segment_header_t *header = (const chain_segment_header_t *)data;
+    uint32_t first = index * CHAIN_SEGMENT_BLOCKS;
+    block_pack_ctx_t ctx;
+    size_t pos = sizeof(*header);
+
+    if (header->first_height != first) {
+        audit_fail(audit, first, "packed segment has the wrong first height");
+        return;
+    }
+
+    block_pack_init(&ctx, first);
+
+    for (uint32_t i = 0; i < CHAIN_SEGMENT_BLOCKS; i++) {
+        block_record_t *block = &audit->records[first + i];
+
+        int ret = block_unpack(&ctx, &data[pos], len - pos, block);
+        if (ret < 0) {
+            audit_fail(audit, first + i, "packed record cannot be unpacked");
+            return;
+        }
+        block->crc = block_compute_crc(block);
+        pos += ret;
+    }
+
+    if (pos != len) {
+        audit_fail(audit, first, "packed segment has trailing bytes");
+    }
+}
+
+/**
+ * Decode one segment file into the record array
+ */
+static void audit_decode(audit_t *audit, uint32_t index) {
+    const audit_segment_t *segment = &audit->segments[index];
+    uint32_t first = index * CHAIN_SEGMENT_BLOCKS;
+    chain_segment_trailer_t trailer;
+
+    if (segment->active) {
+        if (audit->height > first) {
+            memcpy(&audit->records[first], segment->data, (audit->height - first) * sizeof(block_record_t));
+        }
+        return;
+    }
+
+    if (!segment->data) {
+        audit_fail(audit, first, "segment file missing");
+        return;
+    }
+    if (segment->len < sizeof(chain_segment_header_t) + sizeof(trailer)) {
+        audit_fail(audit, first, "segment file truncated");
+        return;
+    }
+
+    memcpy(&trailer, segment->data + segment->len - sizeof(trailer), sizeof(trailer));
+    size_t body = segment->len - sizeof(trailer);
+
+    if (((const chain_segment_header_t *)segment->data)->magic == CHAIN_SEGMENT_PACKED_MAGIC) {
+        audit_unpack(audit, index, segment->data, body);
+    } else if (body == CHAIN_SEGMENT_SIZE) {
+        memcpy(&audit->records[first], segment->data, CHAIN_SEGMENT_SIZE);
+    } else {
+        audit_fail(audit, first, "segment file has the wrong size");
+        return;
+    }
+
+    audit_trailer(audit, index, &trailer);
+}
+
+/**
+ * Check the blocks in [from, to). from is the start of a checkpoint group, so
+ * every checkpoint's leaves are in range; the block before it is taken as
+ * verified, which holds once every range has passed.
+ */
+static void audit_verify(audit_t *audit, uint32_t from, uint32_t to) {
+    static const uint8_t genesis[HASH_LEN] = {0};
+    uint8_t leaves[CHAIN_CHECKPOINT_INTERVAL][HASH_LEN];
+    uint8_t computed[HASH_LEN];
+    const uint8_t *prev_hash = from > 0 ? audit->records[from - 1].hash : genesis;
+
+    for (uint32_t height = from; height < to; height++) {
+        const block_record_t *block = &audit->records[height];
+
+        if (block->version != BLOCK_VERSION || block->length != sizeof(block_record_t) ||
+            block->event >= BLOCK_EVENT_MAX || block->height != height ||
+            (block->event == BLOCK_EVENT_CHECKPOINT) != is_checkpoint_height(height) ||
+            block->crc != block_compute_crc(block)) {
+            audit_fail(audit, height, "damaged record");
+            return;
+        }
+
+        block_hash(block, prev_hash, computed);
+        if (memcmp(computed, block->hash, HASH_LEN) != 0) {
+            audit_fail(audit, height, "hash does not match the previous block");
+            return;
+        }
+
+        if (block->event == BLOCK_EVENT_CHECKPOINT) {
+            for (uint32_t i = 0; i < CHAIN_CHECKPOINT_INTERVAL; i++) {
+                memcpy(leaves[i], audit->records[height - CHAIN_CHECKPOINT_INTERVAL + i].hash, HASH_LEN);
+            }
+            block_merkle_root(leaves, computed);
+            if (memcmp(computed, block->merkle_root, HASH_LEN) != 0) {
+                audit_fail(audit, height, "checkpoint root does not match its group");
+                return;
+            }
+        }
+
+        prev_hash = block->hash;
+    }
+}
+
+static void *decode_worker(void *arg) {
+    audit_t *audit = arg;
+
+    for (uint32_t index; (index = atomic_fetch_add(&audit->next, 1)) < audit->segment_count;) {
+        audit_decode(audit, index);
+    }
+    return NULL;
+}
+
+static void *verify_worker(void *arg) {
+    audit_t *audit = arg;
+    const uint32_t chunk = AUDIT_CHUNK_GROUPS * CHAIN_GROUP_SIZE;
+    uint32_t items = (audit->height + chunk - 1) / chunk;
+
+    for (uint32_t item; (item = atomic_fetch_add(&audit->next, 1)) < items;) {
+        uint32_t from = item * chunk;
+        uint32_t to = audit->height - from > chunk ? from + chunk : audit->height;
+        audit_verify(audit, from, to);
+    }
+    return NULL;
+}
+
+static void run_workers(audit_t *audit, void *(*worker)(void *), unsigned threads) {
+    pthread_t ids[AUDIT_MAX_THREADS];
+    unsigned started = 0;
+
+    atomic_store(&audit->next, 0);
+
+    for (; started < threads; started++) {
+        if (pthread_create(&ids[started], NULL, worker, audit) != 0) {
+            break;
+        }
+    }
+    if (started == 0) {
+        // No threads available, do the work here
+        worker(audit);
+    }
+    for (unsigned i = 0; i < started; i++) {
+        pthread_join(ids[i], NULL);
+    }
+}
+
+static int write_records(const audit_t *audit, const char *path) {
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        return -1;
+    }
+
+    size_t written = fwrite(audit->records, sizeof(block_record_t), audit->height, file);
+    return fclose(file) == 0 && written == audit->height ? 0 : -1;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+            "Usage: %s [-j <threads>] [-b <block size>] [-B <block size>] [-o <chain.bin>]\n"
+            "          <storage dump> [<archive dump>]\n"
+            "  -j  verification threads (default: all cores)\n"
+            "  -b  erase block size of the storage dump (default: detect)\n"
+            "  -B  erase block size of the archive dump (default: detect)\n"
+            "  -o  write the extracted chain as raw records\n", name);
+}
+
+int main(int argc, char **argv) {
+    static audit_t audit;
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned threads = cores > 0 ? cores : 1;
+    uint32_t storage_block_size = 0, archive_block_size = 0;
+    const char *output = NULL;
+    struct timespec start;
+    int opt, ret;
+
+    while ((opt = getopt(argc, argv, "j:b:B:o:h")) != -1) {
+        switch (opt) {
+        case 'j':
+            threads = strtoul(optarg, NULL, 10);
+            break;
+        case 'b':
+            storage_block_size = strtoul(optarg, NULL, 0);
+            break;
+        case 'B':
+            archive_block_size = strtoul(optarg, NULL, 0);
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    if (optind >= argc || argc - optind > 2 || threads == 0) {
+        usage(argv[0]);
+        return 2;
+    }
+    threads = threads > AUDIT_MAX_THREADS ? AUDIT_MAX_THREADS : threads;
+
+    ret = lfs_image_open(&audit.storage, argv[optind], storage_block_size);
+    if (ret < 0) {
+        fprintf(stderr, "Cannot mount storage dump %s: %d\n", argv[optind], ret);
+        return 2;
+    }
+    printf("Storage: %s, %u blocks of %u bytes\n", argv[optind], audit.storage.cfg.block_count, audit.storage.cfg.block_size);
+
+    if (argc - optind == 2) {
+        ret = lfs_image_open(&audit.archive, argv[optind + 1], archive_block_size);
+        if (ret < 0) {
+            fprintf(stderr, "Cannot mount archive dump %s: %d\n", argv[optind + 1], ret);
+            return 2;
+        }
+        audit.has_archive = true;
+        printf("Archive: %s, %u blocks of %u bytes\n", argv[optind + 1], audit.archive.cfg.block_count, audit.archive.cfg.block_size);
+    }
+
+    pthread_mutex_init(&audit.lock, NULL);
+    audit.broken_height = UINT32_MAX;
+
+    if (audit_load(&audit) < 0) {
+        fprintf(stderr, "Out of memory loading the chain\n");
+        return 2;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    run_workers(&audit, decode_worker, threads);
+    double decode_s = elapsed_s(&start);
+
+    if (output) {
+        if (write_records(&audit, output) < 0) {
+            fprintf(stderr, "Cannot write %s\n", output);
+            return 2;
+        }
+        printf("Extracted %u blocks to %s\n", audit.height, output);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    run_workers(&audit, verify_worker, threads);
+    double verify_s = elapsed_s(&start);
+
+    double mib = (double)audit.height * sizeof(block_record_t) / (1024 * 1024);
+    printf("Segments: %u sealed, %u blocks in total\n", audit.segment_count - 1, audit.height);
+    printf("Decoded in %.3f s, verified in %.3f s on %u threads: %.1f MiB/s, %.0f blocks/s\n",
+           decode_s, verify_s, threads, verify_s > 0 ? mib / verify_s : 0, verify_s > 0 ? audit.height / verify_s : 0);
+
+    const audit_segment_t *active = &audit.segments[audit.segment_count - 1];
+    if (active->len % sizeof(block_record_t) != 0) {
+        // The base node cuts these at boot and records a RECOVERY block
+        printf("Ignored %u torn bytes at the end of %s\n", (unsigned)(active->len % sizeof(block_record_t)), active->path);
+    }
+
+    if (audit.broken_height != UINT32_MAX) {
+        printf("Chain broken at height %u: %s\n", audit.broken_height, audit.broken_reason);
+        return 1;
+    }
+
+    printf("Chain valid: %u blocks\n", audit.height);
+    return 0;
+}
@@ -0,0 +1,153 @@
+/*
+* @file     lfs_image.c
+* @brief    Read-only LittleFS Volume from a Flash Dump
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lfs_image.h"
+
+#define LFS_IMAGE_MIN_BLOCK_SIZE 512
+#define LFS_IMAGE_MAX_BLOCK_SIZE 65536
+
+static int image_read(const struct lfs_config *cfg, lfs_block_t block, lfs_off_t off, void *buffer, lfs_size_t size) {
+    const lfs_image_t *image = cfg->context;
+    size_t pos = (size_t)block * cfg->block_size + off;
+
+    if (pos + size > image->size) {
+        return LFS_ERR_IO;
+    }
+    memcpy(buffer, image->data + pos, size);
+    return LFS_ERR_OK;
+}
+
+/**
+ * Mount the dump with one erase block size. LittleFS refuses a size that does
+ * not match the one in its superblock.
+ */
+static int image_mount(lfs_image_t *image, uint32_t block_size) {
+    if (block_size == 0 || image->size % block_size != 0) {
+        return LFS_ERR_INVAL;
+    }
+
+    memset(&image->cfg, 0, sizeof(image->cfg));
+    image->cfg.context = image;
+    image->cfg.read = image_read;
+    image->cfg.read_size = LFS_IMAGE_READ_SIZE;
+    image->cfg.prog_size = LFS_IMAGE_PROG_SIZE;
+    image->cfg.block_size = block_size;
+    image->cfg.block_count = image->size / block_size;
+    image->cfg.block_cycles = -1;
+    image->cfg.cache_size = LFS_IMAGE_CACHE_SIZE;
+    image->cfg.lookahead_size = LFS_IMAGE_LOOKAHEAD_SIZE;
+
+    return lfs_mount(&image->lfs, &image->cfg);
+}
+
+int lfs_image_open(lfs_image_t *image, const char *path, uint32_t block_size) {
+    FILE *file = fopen(path, "rb");
+    int ret = LFS_ERR_INVAL;
+
+    memset(image, 0, sizeof(*image));
+    if (!file) {
+        return LFS_ERR_NOENT;
+    }
+
+    if (fseek(file, 0, SEEK_END) == 0) {
+        long size = ftell(file);
+        image->size = size > 0 ? (size_t)size : 0;
+    }
+    rewind(file);
+
+    image->data = malloc(image->size ? image->size : 1);
+    if (!image->data) {
+        fclose(file);
+        return LFS_ERR_NOMEM;
+    }
+    size_t read = fread(image->data, 1, image->size, file);
+    fclose(file);
+
+    if (read != image->size) {
+        free(image->data);
+        image->data = NULL;
+        return LFS_ERR_IO;
+    }
+
+    if (block_size != 0) {
+        ret = image_mount(image, block_size);
+    } else {
+        for (block_size = LFS_IMAGE_MIN_BLOCK_SIZE; block_size <= LFS_IMAGE_MAX_BLOCK_SIZE; block_size *= 2) {
+            ret = image_mount(image, block_size);
+            if (ret == LFS_ERR_OK) {
+                break;
+            }
+        }
+    }
+
+    if (ret < 0) {
+        free(image->data);
+        image->data = NULL;
+        return ret;
+    }
+
+    image->mounted = 1;
+    return LFS_ERR_OK;
+}
+
+void lfs_image_close(lfs_image_t *image) {
+    if (image->mounted) {
+        lfs_unmount(&image->lfs);
+        image->mounted = 0;
+    }
+    free(image->data);
+    image->data = NULL;
+}
+
+int lfs_image_read(lfs_image_t *image, const char *path, uint8_t **data, size_t *len) {
+    lfs_file_t file;
+
+    int ret = lfs_file_open(&image->lfs, &file, path, LFS_O_RDONLY);
+    if (ret < 0) {
+        return ret;
+    }
+
+    lfs_soff_t size = lfs_file_size(&image->lfs, &file);
+    *data = size >= 0 ? malloc(size ? size : 1) : NULL;
+    if (!*data) {
+        lfs_file_close(&image->lfs, &file);
+        return size < 0 ? size : LFS_ERR_NOMEM;
+    }
+
+    lfs_ssize_t read = lfs_file_read(&image->lfs, &file, *data, size);
+    lfs_file_close(&image->lfs, &file);
+
+    if (read != size) {
+        free(*data);
+        *data = NULL;
+        return read < 0 ? read : LFS_ERR_IO;
+    }
+
+    *len = size;
+    return LFS_ERR_OK;
+}
+
+int lfs_image_list(lfs_image_t *image, const char *path, void (*fn)(void *ctx, const char *name), void *ctx) {
+    lfs_dir_t dir;
+    struct lfs_info info;
+    int ret;
+
+    ret = lfs_dir_open(&image->lfs, &dir, path);
+    if (ret < 0) {
+        return ret;
+    }
+
+    while ((ret = lfs_dir_read(&image->lfs, &dir, &info)) > 0) {
+        if (info.type == LFS_TYPE_REG) {
+            fn(ctx, info.name);
+        }
+    }
+
+    lfs_dir_close(&image->lfs, &dir);
+    return ret;
+}
@@ -0,0 +1,36 @@
+/*
+* @file     lfs_image.h
+* @brief    Read-only LittleFS Volume from a Flash Dump
+*/
+
+#ifndef LFS_IMAGE_H
+#define LFS_IMAGE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "lfs.h"
+
+/* Caches match the Zephyr LittleFS defaults the base node is built with */
+#define LFS_IMAGE_READ_SIZE 16
+#define LFS_IMAGE_PROG_SIZE 16
+#define LFS_IMAGE_CACHE_SIZE 64
+#define LFS_IMAGE_LOOKAHEAD_SIZE 32
+
+typedef struct {
+    uint8_t *data;          /* Whole dump, held in memory */
+    size_t size;
+    struct lfs_config cfg;
+    lfs_t lfs;
+    int mounted;
+} lfs_image_t;
+
+/* Load a partition dump and mount it. A block size of 0 tries every power of
+ * two from 512 bytes to 64 KiB, the erase block is not stored in the dump. */
+int lfs_image_open(lfs_image_t *image, const char *path, uint32_t block_size);
+void lfs_image_close(lfs_image_t *image);
+/* Read a whole file into a buffer that the caller frees */
+int lfs_image_read(lfs_image_t *image, const char *path, uint8_t **data, size_t *len);
+/* Call fn with the name of each regular file in a directory */
+int lfs_image_list(lfs_image_t *image, const char *path, void (*fn)(void *ctx, const char *name), void *ctx);
+
+#endif /* LFS_IMAGE_H */
@@ -15,6 +15,7 @@ from PyQt5.QtGui import QFont
 
 # Assuming send_file.py exists and send_image is callable
 from send_file import send_image, send_status
+from proof import verify_proof, decode_block, decode_export
 
 # Configure serial port
 try:
@@ -26,6 +27,10 @@ except serial.SerialException as e:
 
 # Path to the RTT log file
 PATH = "RTT.log"
+# Log of RTT channel 1, where `chain export` streams blocks
+EXPORT_PATH = "RTT_chain.log"
+# Height and hash of the last block received from `chain export`
+CURSOR_PATH = "chain_cursor.json"
 
 def ansi_to_html_with_cleanup(text):
     """
@@ -141,11 +146,15 @@ class RTTShellReader(QThread):
     json_received = pyqtSignal(dict) # Emits parsed JSON as a dictionary
     log_line_received = pyqtSignal(str) # Emits raw log lines for display
 
+    def __init__(self, path=PATH):
+        super().__init__()
+        self.path = path
+
     def run(self):
         try:
             # Open file and seek to the end
             # This ensures we only read new data appended after the GUI starts
-            with open(PATH, 'r', encoding='utf-8', errors='ignore') as file:
+            with open(self.path, 'r', encoding='utf-8', errors='ignore') as file:
                 file.seek(0, os.SEEK_END)
                 while True:
                     line = file.readline()
@@ -163,11 +172,11 @@ class RTTShellReader(QThread):
                         # print(f"DEBUG: No valid JSON found or parsed from line: {line.strip()}")
 
         except FileNotFoundError:
-            print(f"Error: RTT.log not found at {PATH}. RTT reading disabled.")
-            self.log_line_received.emit(f"<span style='color:red;'>Error: RTT.log not found at {PATH}.</span>")
+            print(f"Error: {self.path} not found. RTT reading disabled.")
+            self.log_line_received.emit(f"<span style='color:red;'>Error: {self.path} not found.</span>")
         except Exception as e:
-            print(f"Error reading RTT.log: {e}")
-            self.log_line_received.emit(f"<span style='color:red;'>Error reading RTT.log: {e}</span>")
+            print(f"Error reading {self.path}: {e}")
+            self.log_line_received.emit(f"<span style='color:red;'>Error reading {self.path}: {e}</span>")
             time.sleep(1) # Wait before retrying
 
 class SensorGUI(QWidget):
@@ -249,6 +258,15 @@ class SensorGUI(QWidget):
         self.rtt_thread.log_line_received.connect(self.update_shell_output) # Display raw RTT lines too
         self.rtt_thread.start()
 
+        # Catch up on blocks recorded while the GUI was not running
+        self.cursor = self.load_cursor()
+        self.export_thread = RTTShellReader(EXPORT_PATH)
+        self.export_thread.json_received.connect(self.handle_export)
+        self.export_thread.log_line_received.connect(self.update_shell_output)
+        self.export_thread.start()
+        if ser:
+            ser.write(f"chain export --since {self.cursor['height']}\n".encode())
+
     def slider_changed(self, sensor: str, value: int, label: QLabel):
         """Updates the slider label text based on the sensor type and value."""
         if sensor == "Accel":
@@ -351,6 +369,14 @@ class SensorGUI(QWidget):
         """
         Slot to send parsed JSON data received from the RTT log to the TagoIO dashboard.
         """
+        if "proof" in data:
+            # Inclusion proof from `chain proof`, checked locally instead of uploaded
+            proof = data["proof"]
+            result = "VALID" if verify_proof(proof) else "INVALID"
+            self.shell_output.append(f"<span style='color:#800080;'>Proof for block {proof['height']}: {result}</span>")
+            self.shell_output.append(f'<pre style="font-family: monospace; white-space: pre-wrap; margin: 0; color:#800080;">{json.dumps(decode_block(proof["block"]), indent=2)}</pre>')
+            return
+
         # Append the parsed JSON in a distinct color for easy identification
         json_pretty = json.dumps(data, indent=2)
         self.shell_output.append(f"<span style='color:#800080;'>--- RTT JSON START ---</span>") # Purple for JSON
@@ -362,6 +388,44 @@ class SensorGUI(QWidget):
         send_status(data)
 
 
+    def load_cursor(self) -> dict:
+        """Loads the last exported height and hash, or starts from the genesis block."""
+        try:
+            with open(CURSOR_PATH, 'r') as file:
+                return json.load(file)
+        except (FileNotFoundError, json.JSONDecodeError):
+            return {"height": 0, "hash": "0" * 64}
+
+    def handle_export(self, data: dict):
+        """
+        Slot for frames from `chain export`. Blocks are checked against the last
+        one received, uploaded, and the cursor saved so a reconnect resumes here.
+        """
+        frame = data.get("export")
+        if frame is None:
+            return
+        if "end" in frame:
+            self.shell_output.append(f"<span style='color:#800080;'>Chain export caught up at block {frame['end']}</span>")
+            return
+        if frame["from"] != self.cursor["height"]:
+            # Already received, or part of an export that was cut short
+            return
+
+        try:
+            blocks = decode_export(frame, self.cursor["hash"])
+        except ValueError as e:
+            self.shell_output.append(f"<span style='color:red;'>Chain export rejected: {e}</span>")
+            return
+
+        for block in blocks:
+            if block["event"] != "CHECKPOINT":
+                block.pop("height")
+                send_status(block)
+
+        self.cursor = {"height": frame["from"] + len(blocks), "hash": blocks[-1]["curr_hash"]}
+        with open(CURSOR_PATH, 'w') as file:
+            json.dump(self.cursor, file)
+
     def show_message_box(self, title: str, message: str):
         """Helper function to display a QMessageBox."""
         msg_box = QMessageBox()
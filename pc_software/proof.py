@@ -0,0 +1,110 @@
+"""
+Verify Merkle inclusion proofs printed by the base node's `chain proof` command,
+and the records streamed by `chain export`
+"""
+import hashlib
+import json
+import struct
+import sys
+import zlib
+
+MERKLE_NODE_PREFIX = b"\x01"
+
+# Hashed part of a block record: everything before the block's own hash
+BLOCK_FORMAT = "<BBHIIii6s18s"
+EVENT_NAMES = ["NONE", "PRESENCE", "TAMPERING", "DISCONNECTION", "FAIL", "SUCCESS", "CHECKPOINT", "RECOVERY"]
+MEAS_NONE = -2**31
+
+# Full on-flash record: hashed fields, the block's hash, then a CRC32 of both
+RECORD_SIZE = 80
+CANONICAL_SIZE = 44
+HASH_SIZE = 32
+
+
+def merkle_node(left: bytes, right: bytes) -> bytes:
+    return hashlib.sha256(MERKLE_NODE_PREFIX + left + right).digest()
+
+
+def decode_block(block_hex: str) -> dict:
+    """
+    Decodes the hashed bytes of a block record into its event fields
+    """
+    (_, event, _, height, timestamp, mag_meas, ultra_meas,
+     mac, user) = struct.unpack(BLOCK_FORMAT, bytes.fromhex(block_hex))
+
+    def milli(value):
+        return "N/A" if value == MEAS_NONE else f"{value / 1000:.3f}"
+
+    return {
+        "height": height,
+        "timestamp": str(timestamp),
+        "event": EVENT_NAMES[event] if event < len(EVENT_NAMES) else str(event),
+        "mag_meas": milli(mag_meas),
+        "ultra_meas": milli(ultra_meas),
+        "user": user.split(b"\x00", 1)[0].decode(errors="replace"),
+        "MAC": "N/A" if not any(mac) else ":".join(f"{b:02X}" for b in mac),
+    }
+
+
+def verify_proof(proof: dict) -> bool:
+    """
+    Recomputes the block hash from its bytes, then walks the sibling path up
+    to the checkpoint's Merkle root
+    """
+    leaf = hashlib.sha256(bytes.fromhex(proof["block"]) + bytes.fromhex(proof["prev_hash"])).digest()
+    if leaf.hex() != proof["leaf"]:
+        return False
+
+    node = leaf
+    index = proof["index"]
+    for sibling in proof["path"]:
+        sibling = bytes.fromhex(sibling)
+        node = merkle_node(sibling, node) if index & 1 else merkle_node(node, sibling)
+        index >>= 1
+
+    return node.hex() == proof["root"]
+
+
+def decode_export(frame: dict, prev_hash: str = None) -> list:
+    """
+    Checks the records of a `chain export` frame and decodes them. Each
+    record's CRC and hash are recomputed, and the first must link to
+    prev_hash when given. Raises ValueError on a record that does not match.
+    """
+    if prev_hash is not None and frame["prev_hash"] != prev_hash:
+        raise ValueError(f"Frame at {frame['from']} does not link to the last exported block")
+
+    data = bytes.fromhex(frame["records"])
+    link = bytes.fromhex(frame["prev_hash"])
+    blocks = []
+
+    for offset in range(0, len(data), RECORD_SIZE):
+        record = data[offset:offset + RECORD_SIZE]
+        canonical = record[:CANONICAL_SIZE]
+        block_hash = record[CANONICAL_SIZE:CANONICAL_SIZE + HASH_SIZE]
+        (crc,) = struct.unpack("<I", record[CANONICAL_SIZE + HASH_SIZE:])
+        height = frame["from"] + len(blocks)
+
+        if zlib.crc32(record[:CANONICAL_SIZE + HASH_SIZE]) != crc:
+            raise ValueError(f"Block {height} is damaged")
+        if hashlib.sha256(canonical + link).digest() != block_hash:
+            raise ValueError(f"Block {height} does not match its hash")
+
+        block = decode_block(canonical.hex())
+        if block["height"] != height:
+            raise ValueError(f"Expected block {height}, got {block['height']}")
+
+        block["prev_hash"] = link.hex()
+        block["curr_hash"] = block_hash.hex()
+        blocks.append(block)
+        link = block_hash
+
+    return blocks
+
+
+if __name__ == "__main__":
+    # Usage: python proof.py '<proof JSON line>'  (or pipe the line on stdin)
+    line = sys.argv[1] if len(sys.argv) > 1 else sys.stdin.read()
+    proof = json.loads(line[line.index("{"):])["proof"]
+    print(json.dumps(decode_block(proof["block"]), indent=2))
+    print("Proof valid" if verify_proof(proof) else "Proof INVALID")